@@ -0,0 +1,81 @@
+/*
+ * Analysis Module - Gateway, host benchmark
+ * 2024
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "esp_check_err.h"
+#include "white_list.h"
+#include "app_packet.h"
+#include "sample_history.h"
+#include "bench.h"
+
+// Description:
+// Host build of the benchmark (see more bench.h), runs the same stages on the
+// same modules as the benchmark firmware, with ESP-IDF and NimBLE replaced by the
+// stubs of include/ and host_stubs.c. It exits with 1 if some stage is over its
+// threshold, so ctest reports the regression.
+
+uint8_t host_process_data_packet(const packet_view_t* packet, uint8_t wl_index, uint32_t packet_time);
+
+
+const char* g_tag_host = "HOST";    // tag used in ESP_CHECK
+
+
+int main(void)
+{
+    init_white_list();
+    esp_err_t err = bench_run(host_process_data_packet);
+    if (err != ESP_OK)
+        ESP_LOGE(g_tag_host, "Benchmark failed: %s", esp_err_to_name(err));
+    return err == ESP_OK ? 0 : 1;
+}
+
+
+// stores samples of data packet as process_data_packet of main.c,
+// uplink and backlog sync are not part of the host build
+// returns number of stored samples
+uint8_t host_process_data_packet(const packet_view_t* packet, uint8_t wl_index, uint32_t packet_time)
+{
+    uint8_t pushed_cnt = 0;
+    uint8_t subject_id = white_list[wl_index].subject_id;  // samples are stored per subject
+
+    if (packet->header == DATA_HEADER && packet->payload_len >= TEMP_DATA_SIZE)
+    {
+        sensor_kind_t kind = get_sensor_kind_by_uuid16(&white_list[wl_index].device_uuid);
+        sample_channel_t channel = get_default_channel_by_kind(kind);
+        int16_t value = decode_data_value(channel, packet->payload[0], packet->payload[1]);
+        if (push_sample(subject_id, channel, value, wl_index, packet_time) == ESP_OK)
+            pushed_cnt++;
+        TRACE_I(TRACE_PACKET_DATA, wl_index, pushed_cnt);
+    }
+    else if (packet->header == DATA_TLV_HEADER)
+    {
+        tlv_packet_view_t tlv;
+        if (parse_tlv_packet(&tlv, packet) == -1)
+        {
+            TRACE_E(TRACE_PACKET_ERROR, packet->header, packet->payload_len);
+            return 0;
+        }
+        TRACE_I(TRACE_PACKET_TLV, tlv.seq, tlv.records_len);
+
+        tlv_iter_t iter;
+        tlv_sample_t sample;
+        tlv_iter_init(&iter, &tlv);
+        while (tlv_iter_next(&iter, &sample))
+        {
+            // time offset is counted back from the moment the packet was sent
+            uint32_t timestamp = packet_time >= sample.time_offset_s ? packet_time - sample.time_offset_s : 0;
+            int16_t value = decode_meas_value(&sample);
+            sample_channel_t channel = get_channel_by_meas_type(sample.type);
+            if (push_sample(subject_id, channel, value, wl_index, timestamp) == ESP_OK)
+                pushed_cnt++;
+        }
+    }
+
+    return pushed_cnt;
+}
@@ -0,0 +1,164 @@
+/*
+ * Analysis Module - Gateway, host stubs of the benchmark build
+ * 2024
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "esp_err.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "host/ble_hs.h"
+
+// Description:
+// Host definitions of the ESP-IDF and NimBLE functions the modules of the
+// benchmark build call. Time and cycles come from the host clocks, advert data is
+// parsed by a real AD parser of the fields the gateway reads, the gap procedures
+// fail with BLE_HS_ENOTSUP as there is no controller.
+
+#define HOST_MAX_UUIDS16    (BLE_HS_ADV_MAX_SZ / 2)     // max number of 16-bit uuids in an advert
+
+
+ble_uuid16_t host_uuids16[HOST_MAX_UUIDS16];    // uuids of the last parsed advert, as NimBLE keeps them
+
+
+// gets monotonic time in ns
+static int64_t host_get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+int64_t esp_timer_get_time(void)
+{
+    return host_get_time_ns() / 1000;
+}
+
+
+uint32_t esp_cpu_get_cycle_count(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return (uint32_t)__rdtsc();
+#else
+    return (uint32_t)host_get_time_ns();
+#endif
+}
+
+
+esp_reset_reason_t esp_reset_reason(void)
+{
+    return ESP_RST_POWERON;
+}
+
+
+const char* esp_err_to_name(esp_err_t code)
+{
+    switch (code)
+    {
+        case ESP_OK:                return "ESP_OK";
+        case ESP_FAIL:              return "ESP_FAIL";
+        case ESP_ERR_NO_MEM:        return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:   return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE:  return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND:     return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT:       return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_INVALID_CRC:   return "ESP_ERR_INVALID_CRC";
+        default:                    return "UNKNOWN ERROR";
+    }
+}
+
+
+// parses AD structures into fields as ble_hs_adv_parse_fields of NimBLE,
+// later structures of the same type override earlier ones
+// returns 0 on success, BLE_HS_EBADDATA if AD structures are malformed
+int ble_hs_adv_parse_fields(struct ble_hs_adv_fields* adv_fields, const uint8_t* src, uint8_t src_len)
+{
+    memset(adv_fields, 0, sizeof(*adv_fields));
+    uint8_t pos = 0;
+    while (pos < src_len)
+    {
+        uint8_t ad_len = src[pos];
+        if (ad_len == 0)    // the rest is padding
+            break;
+
+        if (pos + 1 + ad_len > src_len)
+            return BLE_HS_EBADDATA;
+
+        uint8_t ad_type = src[pos + 1];
+        const uint8_t* ad_data = src + pos + 2;
+        uint8_t ad_data_len = ad_len - 1;
+        switch (ad_type)
+        {
+            case BLE_HS_ADV_TYPE_FLAGS:
+                if (ad_data_len != 1)
+                    return BLE_HS_EBADDATA;
+                adv_fields->flags = ad_data[0];
+                break;
+
+            case BLE_HS_ADV_TYPE_INCOMP_UUIDS16:
+            case BLE_HS_ADV_TYPE_COMP_UUIDS16:
+                if (ad_data_len % 2 != 0)
+                    return BLE_HS_EBADDATA;
+                adv_fields->num_uuids16 = ad_data_len / 2;
+                for (uint8_t i = 0; i < adv_fields->num_uuids16; i++)
+                    host_uuids16[i] = (ble_uuid16_t)BLE_UUID16_INIT(ad_data[2 * i] | (ad_data[2 * i + 1] << 8));
+                adv_fields->uuids16 = host_uuids16;
+                adv_fields->uuids16_is_complete = ad_type == BLE_HS_ADV_TYPE_COMP_UUIDS16;
+                break;
+
+            case BLE_HS_ADV_TYPE_INCOMP_NAME:
+            case BLE_HS_ADV_TYPE_COMP_NAME:
+                adv_fields->name = ad_data;
+                adv_fields->name_len = ad_data_len;
+                adv_fields->name_is_complete = ad_type == BLE_HS_ADV_TYPE_COMP_NAME;
+                break;
+
+            case BLE_HS_ADV_TYPE_TX_PWR_LVL:
+                if (ad_data_len != 1)
+                    return BLE_HS_EBADDATA;
+                adv_fields->tx_pwr_lvl = (int8_t)ad_data[0];
+                adv_fields->tx_pwr_lvl_is_present = 1;
+                break;
+
+            case BLE_HS_ADV_TYPE_MFG_DATA:
+                adv_fields->mfg_data = ad_data;
+                adv_fields->mfg_data_len = ad_data_len;
+                break;
+
+            default:    // types the gateway does not read
+                break;
+        }
+
+        pos += 1 + ad_len;
+    }
+    return 0;
+}
+
+
+int ble_gap_disc(uint8_t own_addr_type, int32_t duration_ms, const struct ble_gap_disc_params* disc_params,
+                 ble_gap_event_fn* cb, void* cb_arg)
+{
+    return BLE_HS_ENOTSUP;
+}
+
+
+int ble_gap_disc_cancel(void)
+{
+    return BLE_HS_ENOTSUP;
+}
+
+
+int ble_gap_connect(uint8_t own_addr_type, const ble_addr_t* peer_addr, int32_t duration_ms,
+                    const struct ble_gap_conn_params* params, ble_gap_event_fn* cb, void* cb_arg)
+{
+    return BLE_HS_ENOTSUP;
+}
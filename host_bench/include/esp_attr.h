@@ -0,0 +1,23 @@
+/*
+ * esp_attr.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_ESP_ATTR_H_
+#define HOST_ESP_ATTR_H_
+
+
+// Description:
+// Host has no RTC memory and no IRAM, the data stays in ordinary memory,
+// which lives as long as the process, as RTC memory lives until reset.
+
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define RTC_SLOW_ATTR
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+
+#endif /* HOST_ESP_ATTR_H_ */
@@ -0,0 +1,22 @@
+/*
+ * esp_cpu.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_ESP_CPU_H_
+#define HOST_ESP_CPU_H_
+
+
+#include <stdint.h>
+
+// Description:
+// Host cycle counter is the time stamp counter on x86 and the monotonic
+// clock in ns elsewhere, truncated to 32 bits as the counter of the target.
+
+
+uint32_t esp_cpu_get_cycle_count(void);
+
+
+#endif /* HOST_ESP_CPU_H_ */
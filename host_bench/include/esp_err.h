@@ -0,0 +1,37 @@
+/*
+ * esp_err.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_ESP_ERR_H_
+#define HOST_ESP_ERR_H_
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Description:
+// Host stand-in of the ESP-IDF error codes, only the codes used by the
+// modules of the benchmark build (see more host_bench.c).
+
+typedef int esp_err_t;
+
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_STATE   0x103
+#define ESP_ERR_INVALID_SIZE    0x104
+#define ESP_ERR_NOT_FOUND       0x105
+#define ESP_ERR_NOT_SUPPORTED   0x106
+#define ESP_ERR_TIMEOUT         0x107
+#define ESP_ERR_INVALID_CRC     0x109
+
+
+const char* esp_err_to_name(esp_err_t code);
+
+
+#endif /* HOST_ESP_ERR_H_ */
@@ -0,0 +1,28 @@
+/*
+ * esp_log.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_ESP_LOG_H_
+#define HOST_ESP_LOG_H_
+
+
+#include <stdio.h>
+
+// Description:
+// Host ESP_LOGx print to stdout in the format of the target log, without
+// timestamps, ESP_LOGD and ESP_LOGV are off as at the default log level.
+
+#define HOST_LOG(letter, tag, fmt, ...)  printf(letter " (%s) " fmt "\n", tag, ##__VA_ARGS__)
+
+#define ESP_LOGE(tag, fmt, ...) HOST_LOG("E", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) HOST_LOG("W", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) HOST_LOG("I", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) do {} while (0)
+#define ESP_LOGV(tag, fmt, ...) do {} while (0)
+#define ESP_LOG_BUFFER_HEX(tag, buffer, len) do { (void)(buffer); (void)(len); } while (0)
+
+
+#endif /* HOST_ESP_LOG_H_ */
@@ -0,0 +1,41 @@
+/*
+ * esp_timer.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_ESP_TIMER_H_
+#define HOST_ESP_TIMER_H_
+
+
+#include <stdint.h>
+#include "esp_err.h"
+
+// Description:
+// Host esp_timer_get_time() is the monotonic clock in us, the one-shot
+// timers are declared only, the benchmark does not start them.
+
+typedef struct esp_timer* esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void* arg);
+
+typedef enum {
+    ESP_TIMER_TASK
+} esp_timer_dispatch_t;
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void* arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char* name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+
+int64_t esp_timer_get_time(void);
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle);
+esp_err_t esp_timer_start_once(esp_timer_handle_t handle, uint64_t timeout_us);
+esp_err_t esp_timer_stop(esp_timer_handle_t handle);
+
+
+#endif /* HOST_ESP_TIMER_H_ */
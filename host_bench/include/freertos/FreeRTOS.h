@@ -0,0 +1,32 @@
+/*
+ * FreeRTOS.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_FREERTOS_H_
+#define HOST_FREERTOS_H_
+
+
+#include <stdint.h>
+
+// Description:
+// Host benchmark runs in one thread, so critical sections compile to nothing.
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+
+typedef struct {
+    int owner;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED    {0}
+#define portENTER_CRITICAL(mux)         (void)(mux)
+#define portEXIT_CRITICAL(mux)          (void)(mux)
+#define portENTER_CRITICAL_SAFE(mux)    (void)(mux)
+#define portEXIT_CRITICAL_SAFE(mux)     (void)(mux)
+
+
+#endif /* HOST_FREERTOS_H_ */
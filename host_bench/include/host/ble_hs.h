@@ -0,0 +1,138 @@
+/*
+ * ble_hs.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_BLE_HS_H_
+#define HOST_BLE_HS_H_
+
+
+#include <stdint.h>
+#include "esp_err.h"
+
+// Description:
+// Host stand-in of the NimBLE host API, only the types and constants used by
+// the modules of the benchmark build. ble_hs_adv_parse_fields() is a real AD
+// parser (see more host_stubs.c), so the advert stage parses as on the target,
+// the gap procedures are declared only, the benchmark starts no scan.
+
+#define BLE_HS_FOREVER      INT32_MAX
+#define BLE_HS_EINVAL       3
+#define BLE_HS_ENOTSUP      8
+#define BLE_HS_EBADDATA     10
+
+#define BLE_HS_ADV_MAX_SZ               31      // max length of legacy advert data
+#define BLE_HS_ADV_TYPE_FLAGS           0x01
+#define BLE_HS_ADV_TYPE_INCOMP_UUIDS16  0x02
+#define BLE_HS_ADV_TYPE_COMP_UUIDS16    0x03
+#define BLE_HS_ADV_TYPE_INCOMP_NAME     0x08
+#define BLE_HS_ADV_TYPE_COMP_NAME       0x09
+#define BLE_HS_ADV_TYPE_TX_PWR_LVL      0x0a
+#define BLE_HS_ADV_TYPE_MFG_DATA        0xff
+#define BLE_HS_ADV_F_DISC_GEN           0x02
+#define BLE_HS_ADV_F_BREDR_UNSUP        0x04
+
+#define BLE_HCI_ADV_RPT_EVTYPE_NONCONN_IND  3
+#define BLE_HCI_ADV_LEGACY_MASK             0x10
+#define BLE_HCI_LE_PHY_1M                   1
+#define BLE_HCI_LE_PHY_2M                   2
+#define BLE_HCI_LE_PHY_CODED                3
+#define BLE_GAP_LE_PHY_1M_MASK              0x01
+#define BLE_GAP_LE_PHY_CODED_MASK           0x04
+#define BLE_GAP_EXT_ADV_DATA_STATUS_COMPLETE 0
+
+#define BLE_ADDR_PUBLIC     0
+#define BLE_ADDR_RANDOM     1
+
+#define BLE_UUID_TYPE_16    16
+
+typedef struct {
+    uint8_t type;
+    uint8_t val[6];
+} ble_addr_t;
+
+typedef struct {
+    uint8_t type;
+} ble_uuid_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint16_t value;
+} ble_uuid16_t;
+
+#define BLE_UUID16_INIT(uuid16)     { .u = { .type = BLE_UUID_TYPE_16 }, .value = (uuid16) }
+
+struct ble_hs_adv_fields {
+    uint8_t flags;
+    const ble_uuid16_t* uuids16;
+    uint8_t num_uuids16;
+    unsigned uuids16_is_complete : 1;
+    const uint8_t* name;
+    uint8_t name_len;
+    unsigned name_is_complete : 1;
+    int8_t tx_pwr_lvl;
+    unsigned tx_pwr_lvl_is_present : 1;
+    const uint8_t* mfg_data;
+    uint8_t mfg_data_len;
+};
+
+struct ble_gap_disc_desc {
+    uint8_t event_type;
+    uint8_t length_data;
+    ble_addr_t addr;
+    int8_t rssi;
+    const uint8_t* data;
+    ble_addr_t direct_addr;
+};
+
+struct ble_gap_ext_disc_desc {
+    uint8_t props;
+    uint8_t data_status;
+    uint8_t legacy_event_type;
+    ble_addr_t addr;
+    int8_t rssi;
+    int8_t tx_power;
+    uint8_t sid;
+    uint8_t prim_phy;
+    uint8_t sec_phy;
+    uint8_t length_data;
+    const uint8_t* data;
+    uint16_t periodic_adv_itvl;
+    ble_addr_t direct_addr;
+};
+
+struct ble_gap_disc_params {
+    uint16_t itvl;
+    uint16_t window;
+    uint8_t filter_policy;
+    uint8_t limited : 1;
+    uint8_t passive : 1;
+    uint8_t filter_duplicates : 1;
+};
+
+struct ble_gap_conn_params {
+    uint16_t scan_itvl;
+    uint16_t scan_window;
+    uint16_t itvl_min;
+    uint16_t itvl_max;
+    uint16_t latency;
+    uint16_t supervision_timeout;
+    uint16_t min_ce_len;
+    uint16_t max_ce_len;
+};
+
+struct ble_gap_event;
+typedef int ble_gap_event_fn(struct ble_gap_event* event, void* arg);
+
+
+int ble_hs_adv_parse_fields(struct ble_hs_adv_fields* adv_fields, const uint8_t* src, uint8_t src_len);
+int ble_gap_disc(uint8_t own_addr_type, int32_t duration_ms, const struct ble_gap_disc_params* disc_params,
+                 ble_gap_event_fn* cb, void* cb_arg);
+int ble_gap_disc_cancel(void);
+int ble_gap_connect(uint8_t own_addr_type, const ble_addr_t* peer_addr, int32_t duration_ms,
+                    const struct ble_gap_conn_params* params, ble_gap_event_fn* cb, void* cb_arg);
+
+
+#endif /* HOST_BLE_HS_H_ */
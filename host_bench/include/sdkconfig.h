@@ -0,0 +1,53 @@
+/*
+ * sdkconfig.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_SDKCONFIG_H_
+#define HOST_SDKCONFIG_H_
+
+
+// Description:
+// Host configuration of the benchmark build, the Kconfig defaults of the options
+// read by its modules (see more Kconfig.projbuild). The thresholds are in cycles
+// of the host counter (see more esp_cpu.h), they can be set from CMake.
+
+#define CONFIG_AM_BENCHMARK 1
+#define CONFIG_AM_BENCH_ADVERTS 1000
+#ifndef CONFIG_AM_BENCH_MAX_ADVERT_CYCLES
+#define CONFIG_AM_BENCH_MAX_ADVERT_CYCLES 40000
+#endif
+#ifndef CONFIG_AM_BENCH_MAX_OPEN_PACKET_CYCLES
+#define CONFIG_AM_BENCH_MAX_OPEN_PACKET_CYCLES 600
+#endif
+#ifndef CONFIG_AM_BENCH_MAX_WL_LOOKUP_CYCLES
+#define CONFIG_AM_BENCH_MAX_WL_LOOKUP_CYCLES 800
+#endif
+#ifndef CONFIG_AM_BENCH_MAX_ANALYSIS_CYCLES
+#define CONFIG_AM_BENCH_MAX_ANALYSIS_CYCLES 20000
+#endif
+
+#define CONFIG_AM_WHITE_LIST_CAPACITY 8
+#define CONFIG_AM_WHITE_LIST_MAX_PER_UUID 2
+#define CONFIG_AM_MAX_SUBJECTS 1
+#define CONFIG_AM_RSSI_ACCEPTABLE_LVL -50
+#define CONFIG_AM_SAMPLE_HISTORY_LEN 16
+#define CONFIG_AM_SAMPLE_MAX_AGE_S 60
+#define CONFIG_AM_SCORE_TABLE_NEWS2 1
+#define CONFIG_AM_TREND_EWMA_SHIFT 2
+#define CONFIG_AM_TREND_WINDOW_S 600
+#define CONFIG_AM_TRACE_LEVEL 2
+#define CONFIG_AM_TRACE_BUFF_LEN 64
+
+#define CONFIG_AM_ENERGY_SCAN_UA 85000
+#define CONFIG_AM_ENERGY_CONN_UA 30000
+#define CONFIG_AM_ENERGY_CPU_UA 25000
+#define CONFIG_AM_ENERGY_LIGHT_SLEEP_UA 1000
+#define CONFIG_AM_ENERGY_SLEEP_UA 10
+#define CONFIG_AM_BATTERY_CAPACITY_MAH 1000
+#define CONFIG_AM_LIGHT_SLEEP 1
+
+
+#endif /* HOST_SDKCONFIG_H_ */
@@ -0,0 +1,247 @@
+/*
+ * adv_prefilter.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_ADV_PREFILTER_H_
+#define MAIN_ADV_PREFILTER_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "host/ble_hs.h"
+#include "app_packet.h"
+#include "white_list.h"
+#include "seq_dedup.h"
+#include "sdkconfig.h"
+
+// Description:
+// The prefilter decides whether a discovered advert is worth full parsing, before
+// ble_hs_adv_parse_fields() and any logging run. It walks the raw AD structures
+// (length, type, data), remembering only the manufacturer specific data and
+// the 16-bit service UUID lists, and checks the cheapest conditions first:
+//   1. RSSI is acceptable (registration and deletion only, they need a connection)
+//   2. AD structures are well-formed
+//   3. manufacturer data contains a packet header
+//   4. the header is expected in current mode (REG_HEADER for registration,
+//      DEL_HEADER for deletion, DATA_HEADER or DATA_TLV_HEADER for data)
+//   5. a service UUID is interesting (registration only)
+//   6. one more device with the UUID can be registered (registration only)
+//   7. the address is in the white list (deletion and data only)
+//   8. the packet is not a duplicate by its sequence number (data only, see seq_dedup.h),
+//      the number is marked as received only after the packet is processed
+// Stages 1-5 depend on the advert only, adv_prefilter_is_candidate() runs them in
+// the host task before the advert is copied into the worker queue, so in a crowded
+// air the queue is not filled with adverts of foreign devices. Stages 6-8 read the
+// white list and the sequence windows, which only the worker changes, so
+// adv_prefilter() runs them in the worker.
+// Every stage has its own counter of dropped adverts, so it is visible where a
+// crowded air is filtered out. Every counter is incremented by one task only.
+
+#define RSSI_ACCEPTABLE_LVL CONFIG_AM_RSSI_ACCEPTABLE_LVL  // acceptable rssi level for connection
+
+// enum of prefilter modes, one per device mode
+typedef enum {
+    ADV_FILTER_REGISTRATION = 0,
+    ADV_FILTER_DELETION = 1,
+    ADV_FILTER_DATA = 2
+} adv_filter_mode_t;
+
+// struct that describes counters of the prefilter
+typedef struct {
+    uint32_t seen_cnt;              // number of adverts seen
+    uint32_t dropped_rssi_cnt;      // dropped because of low rssi
+    uint32_t dropped_malformed_cnt; // dropped because of malformed AD structures
+    uint32_t dropped_no_header_cnt; // dropped because of no manufacturer data with header
+    uint32_t dropped_header_cnt;    // dropped because of header not expected in current mode
+    uint32_t dropped_uuid_cnt;      // dropped because of no interesting uuid
+    uint32_t dropped_quota_cnt;     // dropped because no more devices with the uuid can be registered
+    uint32_t dropped_addr_cnt;      // dropped because of address not in white list
+    uint32_t dropped_dup_cnt;       // dropped because of sequence number already received
+    uint32_t passed_cnt;            // number of candidates passed to full parsing
+} adv_filter_stats_t;
+
+// type of function that checks a 16-bit service uuid found in advert
+typedef bool adv_uuid_fn(const ble_uuid16_t* uuid);
+
+
+bool adv_prefilter_walk(const uint8_t* data, uint8_t data_len, adv_uuid_fn* uuid_cb, const uint8_t** mfg_data,
+                        uint8_t* mfg_data_len, bool* uuid_found);
+bool adv_prefilter_uuid_is_known(const ble_uuid16_t* uuid);
+bool adv_prefilter_is_candidate(const uint8_t* data, uint8_t data_len, int8_t rssi, adv_filter_mode_t mode);
+bool adv_prefilter(const struct ble_gap_disc_desc* disc_desc, adv_filter_mode_t mode);
+void adv_prefilter_log_stats();
+
+
+const char* g_tag_filter = "FILTER";        // tag used in ESP_CHECK
+adv_filter_stats_t g_adv_filter_stats = {}; // counters of the prefilter, since boot
+
+
+// walks AD structures: length (1 byte), type (1 byte), data (length - 1 bytes)
+// remembers the first manufacturer data and, if uuid_cb is not NULL, whether
+// uuid_cb accepts some uuid of the 16-bit service UUID lists
+// returns false if AD structures are malformed
+bool adv_prefilter_walk(const uint8_t* data, uint8_t data_len, adv_uuid_fn* uuid_cb, const uint8_t** mfg_data,
+                        uint8_t* mfg_data_len, bool* uuid_found)
+{
+    *mfg_data = NULL;
+    *mfg_data_len = 0;
+    *uuid_found = false;
+    uint8_t pos = 0;
+    while (pos < data_len)
+    {
+        uint8_t ad_len = data[pos];
+        if (ad_len == 0)    // the rest is padding
+            break;
+
+        if (pos + 1 + ad_len > data_len)
+            return false;
+
+        uint8_t ad_type = data[pos + 1];
+        const uint8_t* ad_data = data + pos + 2;
+        uint8_t ad_data_len = ad_len - 1;
+        if (ad_type == BLE_HS_ADV_TYPE_MFG_DATA && *mfg_data == NULL)
+        {
+            *mfg_data = ad_data;
+            *mfg_data_len = ad_data_len;
+        }
+        else if (uuid_cb != NULL && !*uuid_found &&
+                 (ad_type == BLE_HS_ADV_TYPE_INCOMP_UUIDS16 || ad_type == BLE_HS_ADV_TYPE_COMP_UUIDS16))
+        {
+            for (uint8_t i = 0; i + 1 < ad_data_len && !*uuid_found; i += 2)
+            {
+                ble_uuid16_t uuid = BLE_UUID16_INIT(ad_data[i] | (ad_data[i + 1] << 8));
+                *uuid_found = uuid_cb(&uuid);
+            }
+        }
+
+        pos += 1 + ad_len;
+    }
+    return true;
+}
+
+
+// checks if the uuid is one of the interesting uuids, whatever the white list holds
+bool adv_prefilter_uuid_is_known(const ble_uuid16_t* uuid)
+{
+    return get_wl_uuid_index(uuid) != -1;
+}
+
+
+// checks raw advert by its content only and decides whether it is a candidate,
+// safe to call from the host task as it reads no state of the worker
+bool adv_prefilter_is_candidate(const uint8_t* data, uint8_t data_len, int8_t rssi, adv_filter_mode_t mode)
+{
+    g_adv_filter_stats.seen_cnt++;
+
+    // registration and deletion need connection, so rssi must be acceptable
+    if (mode != ADV_FILTER_DATA && rssi < RSSI_ACCEPTABLE_LVL)
+    {
+        g_adv_filter_stats.dropped_rssi_cnt++;
+        return false;
+    }
+
+    const uint8_t* mfg_data;
+    uint8_t mfg_data_len;
+    bool uuid_found;
+    if (!adv_prefilter_walk(data, data_len, mode == ADV_FILTER_REGISTRATION ? adv_prefilter_uuid_is_known : NULL,
+                            &mfg_data, &mfg_data_len, &uuid_found))
+    {
+        g_adv_filter_stats.dropped_malformed_cnt++;
+        return false;
+    }
+
+    // check packet header
+    if (mfg_data == NULL || mfg_data_len < HEADER_SIZE)
+    {
+        g_adv_filter_stats.dropped_no_header_cnt++;
+        return false;
+    }
+
+    uint16_t header = GET_BE16(mfg_data);
+    bool header_expected = false;
+    switch (mode)
+    {
+        case ADV_FILTER_REGISTRATION: header_expected = header == REG_HEADER; break;
+        case ADV_FILTER_DELETION:     header_expected = header == DEL_HEADER; break;
+        case ADV_FILTER_DATA:         header_expected = header == DATA_HEADER || header == DATA_TLV_HEADER; break;
+    }
+    if (!header_expected)
+    {
+        g_adv_filter_stats.dropped_header_cnt++;
+        return false;
+    }
+
+    // registration needs an interesting uuid
+    if (mode == ADV_FILTER_REGISTRATION && !uuid_found)
+    {
+        g_adv_filter_stats.dropped_uuid_cnt++;
+        return false;
+    }
+
+    return true;
+}
+
+
+// checks candidate against the white list and received sequence numbers and
+// decides whether it goes to full parsing, called from the worker only
+bool adv_prefilter(const struct ble_gap_disc_desc* disc_desc, adv_filter_mode_t mode)
+{
+    const uint8_t* mfg_data;
+    uint8_t mfg_data_len;
+    bool uuid_found;
+    adv_prefilter_walk(disc_desc->data, disc_desc->length_data,
+                       mode == ADV_FILTER_REGISTRATION ? uuid_is_interesting : NULL,
+                       &mfg_data, &mfg_data_len, &uuid_found);
+
+    // registration needs one more device with the uuid to be possible
+    if (mode == ADV_FILTER_REGISTRATION && !uuid_found)
+    {
+        g_adv_filter_stats.dropped_quota_cnt++;
+        return false;
+    }
+
+    // deletion and data need a registered device
+    int8_t wl_index = mode != ADV_FILTER_REGISTRATION ? get_white_list_index_by_addr(&disc_desc->addr) : -1;
+    if (mode != ADV_FILTER_REGISTRATION && wl_index == -1)
+    {
+        g_adv_filter_stats.dropped_addr_cnt++;
+        return false;
+    }
+
+    // data packet is processed only once, repeats of it are dropped
+    uint16_t seq;
+    if (mode == ADV_FILTER_DATA && get_packet_seq(&seq, mfg_data, mfg_data_len) == 0 &&
+        !seq_dedup_is_new(wl_index, seq))
+    {
+        g_adv_filter_stats.dropped_dup_cnt++;
+        return false;
+    }
+
+    g_adv_filter_stats.passed_cnt++;
+    return true;
+}
+
+
+// prints counters of the prefilter
+void adv_prefilter_log_stats()
+{
+    ESP_LOGI(g_tag_filter, "Adverts seen: %lu, passed: %lu", (unsigned long)g_adv_filter_stats.seen_cnt,
+            (unsigned long)g_adv_filter_stats.passed_cnt);
+    ESP_LOGI(g_tag_filter, "Dropped: rssi %lu, malformed %lu, no header %lu, header %lu, uuid %lu, quota %lu, "
+            "addr %lu, dup %lu",
+            (unsigned long)g_adv_filter_stats.dropped_rssi_cnt,
+            (unsigned long)g_adv_filter_stats.dropped_malformed_cnt,
+            (unsigned long)g_adv_filter_stats.dropped_no_header_cnt,
+            (unsigned long)g_adv_filter_stats.dropped_header_cnt,
+            (unsigned long)g_adv_filter_stats.dropped_uuid_cnt,
+            (unsigned long)g_adv_filter_stats.dropped_quota_cnt,
+            (unsigned long)g_adv_filter_stats.dropped_addr_cnt,
+            (unsigned long)g_adv_filter_stats.dropped_dup_cnt);
+}
+
+
+#endif /* MAIN_ADV_PREFILTER_H_ */
@@ -13,12 +13,37 @@
 #include <unistd.h>
 #include "esp_log.h"
 #include "esp_check_err.h"
+#include "sample_history.h"
+#include "white_list.h"
+#include "trace.h"
+#include "sdkconfig.h"
 
-// maximum possible score for the temperature classification
-#define TEMP_MAX_SCORE  3
+// Description:
+// The analysis is an early warning score in the style of NEWS (National Early
+// Warning Score). Every monitored parameter (temperature, SpO2, heart rate,
+// activity) is a row of a const table: the channel of its samples, its input, its
+// weight and the bands of its values. The input is the latest sample or one of the
+// trend statistics of the channel (EWMA, slope, variance, see sample_history.h), so
+// a trend (e.g. temperature falling 0.5 °C over ten minutes) is scored by a row of
+// its own, before the latest value reaches an abnormal band. A band gives the score for values up to its upper bound,
+// bands are sorted by the bound and the last one is unbounded. The weighted scores
+// are summed up, and the total (or a single parameter with "red" score) is mapped
+// to the life rate by the thresholds of the table. The table is selected at
+// compile time (see Kconfig), adding a parameter means adding a row. Every
+// parameter gets an explicit status: scored, stale (the latest sample is too old),
+// missing (a sensor is registered, but has sent no samples yet) or not monitored
+// (the subject has no sensor of its kind) or no trend (the history of the channel
+// is too short for a trend input). A stale or missing parameter is scored
+// with the missing score of its row, so a silent sensor does not discard the data
+// of the others. The state is UNDEFINED only if no parameter of the subject has a
+// fresh sample at all. Bands are in the fixed-point units of their channel (see
+// sample_history.h), so the analysis runs on integers only. The fixed-point
+// pipeline may be checked against the float one at boot (see Kconfig).
 
-//variable to store the temperature data, stored in RTC memory
-float RTC_DATA_ATTR temp_data;
+// maximum age of a sample to be used in analysis, in s
+#define SAMPLE_MAX_AGE_S    CONFIG_AM_SAMPLE_MAX_AGE_S
+
+#define SCORE_NO_RED        UINT8_MAX   // mark for table without "red" score
 
 // enum to define different life rate states
 typedef enum {
@@ -28,71 +53,372 @@ typedef enum {
     VERY_CRITICAL = 2
 } liferate_t;
 
+// enum to define status of a parameter in analysis
+typedef enum {
+    PARAM_NOT_MONITORED = 0,    // subject has no sensor of this parameter
+    PARAM_SCORED = 1,           // the latest sample is fresh and scored
+    PARAM_STALE = 2,            // the latest sample is older than SAMPLE_MAX_AGE_S
+    PARAM_MISSING = 3,          // sensor is registered, but has sent no samples
+    PARAM_NO_TREND = 4          // trend input has not been measured yet
+} param_status_t;
+
+// enum to define input of a parameter
+typedef enum {
+    PARAM_INPUT_LATEST = 0,     // the latest sample
+    PARAM_INPUT_EWMA = 1,       // EWMA of samples
+    PARAM_INPUT_SLOPE = 2,      // change of EWMA over the last trend window
+    PARAM_INPUT_VARIANCE = 3    // variance of samples around EWMA
+} param_input_t;
+
+// struct that describes one band of parameter values
+typedef struct {
+    int32_t upper;  // upper bound of the band (inclusive), fixed-point
+    uint8_t score;  // score of values in the band
+} score_band_t;
+
+// struct that describes one parameter of the score table
+typedef struct {
+    sample_channel_t channel;   // channel of the parameter samples
+    param_input_t input;        // input of the parameter, the latest sample by default
+    uint8_t weight;             // weight of the parameter score in the total
+    uint8_t missing_score;      // score of stale or missing parameter
+    uint8_t bands_cnt;          // number of bands
+    const score_band_t* bands;  // bands sorted by upper bound
+} score_param_t;
+
+// struct that describes thresholds of the total score
+typedef struct {
+    uint8_t critical_total;         // total score from which state is CRITICAL
+    uint8_t very_critical_total;    // total score from which state is VERY_CRITICAL
+    uint8_t red_score;              // single parameter score from which state is at least CRITICAL
+} score_thresholds_t;
+
+
+// score tables, selected at compile time
+#define SCORE_BANDS(...) \
+    .bands_cnt = sizeof((const score_band_t[]){__VA_ARGS__}) / sizeof(score_band_t), \
+    .bands = (const score_band_t[]){__VA_ARGS__}
+
+#if defined(CONFIG_AM_SCORE_TABLE_TEMP_ONLY)
+// temperature only, the classification of the first version of the gateway
+const score_param_t score_table[] = {
+        {.channel = CHANNEL_TEMP, .weight = 1, .missing_score = 0,
+         SCORE_BANDS({TEMP_FIXED(35.0), 3}, {TEMP_FIXED(36.0), 1}, {TEMP_FIXED(38.0), 0},
+                     {TEMP_FIXED(39.0), 1}, {INT32_MAX, 2})}
+};
+const score_thresholds_t score_thresholds = {.critical_total = 1, .very_critical_total = 3, .red_score = SCORE_NO_RED};
+#else
+// NEWS2 bands, activity (0 - no movement) stands for the level of consciousness
+const score_param_t score_table[] = {
+        {.channel = CHANNEL_TEMP, .weight = 1, .missing_score = 0,
+         SCORE_BANDS({TEMP_FIXED(35.0), 3}, {TEMP_FIXED(36.0), 1}, {TEMP_FIXED(38.0), 0},
+                     {TEMP_FIXED(39.0), 1}, {INT32_MAX, 2})},
+        {.channel = CHANNEL_SPO2, .weight = 1, .missing_score = 0,
+         SCORE_BANDS({91, 3}, {93, 2}, {95, 1}, {INT32_MAX, 0})},
+        {.channel = CHANNEL_HEART_RATE, .weight = 1, .missing_score = 0,
+         SCORE_BANDS({40, 3}, {50, 1}, {90, 0}, {110, 1}, {130, 2}, {INT32_MAX, 3})},
+        {.channel = CHANNEL_ACTIVITY, .weight = 1, .missing_score = 0,
+         SCORE_BANDS({0, 3}, {INT32_MAX, 0})},
+        // trends, change per trend window
+        {.channel = CHANNEL_TEMP, .input = PARAM_INPUT_SLOPE, .weight = 1, .missing_score = 0,
+         SCORE_BANDS({TEMP_FIXED(-1.0), 2}, {TEMP_FIXED(-0.5), 1}, {TEMP_FIXED(0.5), 0},
+                     {TEMP_FIXED(1.0), 1}, {INT32_MAX, 2})},
+        {.channel = CHANNEL_SPO2, .input = PARAM_INPUT_SLOPE, .weight = 1, .missing_score = 0,
+         SCORE_BANDS({-4, 2}, {-2, 1}, {INT32_MAX, 0})},
+        {.channel = CHANNEL_HEART_RATE, .input = PARAM_INPUT_SLOPE, .weight = 1, .missing_score = 0,
+         SCORE_BANDS({-30, 2}, {-15, 1}, {15, 0}, {30, 1}, {INT32_MAX, 2})}
+};
+const score_thresholds_t score_thresholds = {.critical_total = 5, .very_critical_total = 7, .red_score = 3};
+#endif
 
-esp_err_t push_temp_data(float temp);
-int8_t get_temp_score(float temp);
-liferate_t start_analysis();
-float convert_temp_data_to_float(uint8_t temp_msb, uint8_t temp_lsb);
+#define SCORE_PARAMS_CNT    (sizeof(score_table) / sizeof(score_table[0]))  // number of parameters
 
+// struct that describes result of analysis of one subject
+typedef struct {
+    int8_t state;                           // life rate (liferate_t)
+    uint8_t total_score;                    // weighted sum of parameter scores
+    uint8_t scores[SCORE_PARAMS_CNT];       // score of every parameter
+    uint8_t statuses[SCORE_PARAMS_CNT];     // status of every parameter (param_status_t)
+} analysis_result_t;
 
-// pushes temperature data to store
-esp_err_t push_temp_data(float temp)
+
+uint8_t get_band_score(const score_param_t* param, int32_t value);
+esp_err_t get_param_input(uint8_t subject_id, const score_param_t* param, const sample_t* latest, int32_t* value);
+param_status_t score_param(uint8_t subject_id, const score_param_t* param, uint8_t* score);
+liferate_t start_analysis(uint8_t subject_id);
+liferate_t get_worst_state(liferate_t state1, liferate_t state2);
+liferate_t get_subject_state(uint8_t subject_id);
+esp_err_t get_subject_result(uint8_t subject_id, analysis_result_t* result);
+int16_t decode_temp_data(uint8_t temp_msb, uint8_t temp_lsb);
+int16_t decode_meas_value(const tlv_sample_t* sample);
+int16_t decode_data_value(sample_channel_t channel, uint8_t value_msb, uint8_t value_lsb);
+#ifdef CONFIG_AM_FIXED_POINT_SELF_CHECK
+esp_err_t fixed_point_self_check();
+#endif
+
+
+const char* g_tag_analysis = "ANALYSIS";    // tag used in ESP_CHECK
+
+// analysis results of the last cycle per subject, stored in RTC memory
+RTC_DATA_ATTR analysis_result_t subject_results[MAX_SUBJECTS] = {
+        [0 ... MAX_SUBJECTS - 1] = {.state = UNDEFINED}
+};
+
+
+// calculates score of parameter value by the bands of its table row
+uint8_t get_band_score(const score_param_t* param, int32_t value)
 {
-    temp_data = temp;
-    return ESP_OK;
+    for (uint8_t i = 0; i < param->bands_cnt; i++)
+        if (value <= param->bands[i].upper)
+            return param->bands[i].score;
+
+    return param->bands[param->bands_cnt - 1].score;
+}
+
+
+// scores one parameter of given subject by its latest sample
+param_status_t score_param(uint8_t subject_id, const score_param_t* param, uint8_t* score)
+{
+    *score = 0;
+
+    // check if the subject has a sensor of this parameter
+    ble_uuid16_t uuid = get_uuid16_by_sensor_kind(get_sensor_kind_by_channel(param->channel));
+    if (get_subject_sensors_cnt_by_uuid16(subject_id, &uuid) == 0)
+        return PARAM_NOT_MONITORED;
+
+    sample_t sample;
+    if (get_latest_sample(subject_id, param->channel, &sample) != ESP_OK)
+    {
+        *score = param->missing_score;
+        return PARAM_MISSING;
+    }
+
+    if (get_sample_age_s(&sample) > SAMPLE_MAX_AGE_S)
+    {
+        TRACE_I(TRACE_ANALYSIS_STALE, get_sample_age_s(&sample), subject_id);
+        *score = param->missing_score;
+        return PARAM_STALE;
+    }
+
+    int32_t value;
+    if (get_param_input(subject_id, param, &sample, &value) != ESP_OK)
+    {
+        *score = param->missing_score;
+        return PARAM_NO_TREND;
+    }
+
+    *score = get_band_score(param, value);
+    return PARAM_SCORED;
 }
 
-// calculates the temperature score based on given temperature value
-int8_t get_temp_score(float temp)
+
+// gets input value of parameter, trend inputs are taken from trend statistics
+// of the channel, the slope is used only until the next one is due
+esp_err_t get_param_input(uint8_t subject_id, const score_param_t* param, const sample_t* latest, int32_t* value)
 {
-    if (temp > 36.0 && temp <= 38.0)
-        return 0;
+    if (param->input == PARAM_INPUT_LATEST)
+    {
+        *value = latest->value;
+        return ESP_OK;
+    }
+
+    trend_t trend;
+    if (get_trend(subject_id, param->channel, &trend) != ESP_OK)
+        return ESP_FAIL;
 
-    if (temp > 35.0 && temp <= 39.0)
-        return 1;
+    switch (param->input)
+    {
+        case PARAM_INPUT_EWMA:
+            *value = trend.ewma / (1 << TREND_FRAC_BITS);
+            return ESP_OK;
 
-    if (temp > 39.0)
-        return 2;
+        case PARAM_INPUT_SLOPE:
+            if (!trend.slope_is_valid || get_rtc_time_s() - trend.anchor_ts > 2 * TREND_WINDOW_S)
+                return ESP_FAIL;
+            *value = trend.slope;
+            return ESP_OK;
 
-    if (temp <= 35.0)
-        return 3;
+        case PARAM_INPUT_VARIANCE:
+            *value = trend.variance > INT32_MAX ? INT32_MAX : (int32_t)trend.variance;
+            return ESP_OK;
 
-    return -1;
+        default:
+            return ESP_FAIL;
+    }
 }
 
-// analyses the temperature data and classify it into life rate categories
-liferate_t start_analysis()
+
+// analyses the latest data of given subject by the score table and classify
+// it into life rate categories, the result is stored as the result of the subject
+liferate_t start_analysis(uint8_t subject_id)
 {
-    int8_t critical_meas_score = get_temp_score(temp_data);
-    int8_t critical_max_score = TEMP_MAX_SCORE;
-
-    // calculate the result score as a ratio between measured score and maximum score
-    float res_score = (float)critical_meas_score/(float)critical_max_score;
-    ESP_LOGI("AM", "Temp data: %f", temp_data);
-    ESP_LOGI("AM", "Score is:  %f", res_score);
-    if(res_score >= 0.0 && res_score < 0.3)
-        return NORMAL;
-    if(res_score >= 0.3 && res_score < 0.7)
-        return CRITICAL;
-    if(res_score >= 0.7 && res_score <= 1.0)
-        return VERY_CRITICAL;
-
-    return UNDEFINED;
+    if (subject_id >= MAX_SUBJECTS)
+        return UNDEFINED;
+
+    analysis_result_t* result = &subject_results[subject_id];
+    bool is_scored = false;
+    bool has_red_score = false;
+    uint16_t total_score = 0;
+    for (uint8_t i = 0; i < SCORE_PARAMS_CNT; i++)
+    {
+        uint8_t score;
+        param_status_t status = score_param(subject_id, &score_table[i], &score);
+        result->scores[i] = score;
+        result->statuses[i] = status;
+        TRACE_D(TRACE_PARAM_SCORE, i | (status << 8), score);
+
+        if (status == PARAM_NOT_MONITORED)
+            continue;
+
+        if (status == PARAM_SCORED)
+            is_scored = true;
+        total_score += score_table[i].weight * score;
+        if (score >= score_thresholds.red_score)
+            has_red_score = true;
+    }
+
+    result->total_score = total_score > UINT8_MAX ? UINT8_MAX : total_score;
+    TRACE_I(TRACE_ANALYSIS, subject_id, result->total_score);
+
+    if (!is_scored)
+        result->state = UNDEFINED;
+    else if (total_score >= score_thresholds.very_critical_total)
+        result->state = VERY_CRITICAL;
+    else if (total_score >= score_thresholds.critical_total || has_red_score)
+        result->state = CRITICAL;
+    else
+        result->state = NORMAL;
+
+    return result->state;
 }
 
-// converts raw temperature data (from two bytes) to a float value
-float convert_temp_data_to_float(uint8_t temp_msb, uint8_t temp_lsb)
+
+// chooses the more critical of two states, undefined state is
+// less important than any defined one
+liferate_t get_worst_state(liferate_t state1, liferate_t state2)
 {
-    // extract the most significant byte (MSB) and the least significant byte (LSB)
-    float ret_val = (float)(temp_msb & 0b01111111);
+    return state1 > state2 ? state1 : state2;
+}
 
-    // add the fractional part by shifting the LSB and dividing by powers of 2
-    for (int i = 0; i < 8; i++)
-        ret_val += ((temp_lsb >> (7-i)) & 1) / (float)(2 << i);
+
+// gets state of given subject, stored in the last analysis
+liferate_t get_subject_state(uint8_t subject_id)
+{
+    if (subject_id >= MAX_SUBJECTS)
+        return UNDEFINED;
+
+    return subject_results[subject_id].state;
+}
+
+
+// gets result of the last analysis of given subject
+esp_err_t get_subject_result(uint8_t subject_id, analysis_result_t* result)
+{
+    if (subject_id >= MAX_SUBJECTS || result == NULL)
+        return ESP_FAIL;
+
+    *result = subject_results[subject_id];
+    return ESP_OK;
+}
+
+
+// decodes raw temperature data (from two bytes) to Q8.8 value, the MSB
+// holds the sign bit and the integer part, the LSB holds the fractional part
+int16_t decode_temp_data(uint8_t temp_msb, uint8_t temp_lsb)
+{
+    int16_t ret_val = ((temp_msb & 0b01111111) << 8) | temp_lsb;
 
     // adjust for the sign based on the MSB (negative if the MSB's sign bit is 1)
-    return ret_val * ((temp_msb>>7) & 1 ? -1.0 : 1.0);
+    return (temp_msb >> 7) & 1 ? -ret_val : ret_val;
+}
+
+
+// decodes value of TLV sample to a fixed-point value of its channel (see more app_packet.h)
+int16_t decode_meas_value(const tlv_sample_t* sample)
+{
+    if (sample->type == MEAS_TEMP)
+        return decode_temp_data(sample->value[0], sample->value[1]);
+
+    // SpO2, heart rate and activity are one byte unsigned values
+    return sample->value[0];
+}
+
+
+// decodes value of DATA_HEADER packet (two bytes in temperature format) to a
+// fixed-point value of its channel, only temperature is Q8.8, the other channels
+// take the integer part as one byte unsigned value, as in TLV samples
+int16_t decode_data_value(sample_channel_t channel, uint8_t value_msb, uint8_t value_lsb)
+{
+    if (channel == CHANNEL_TEMP)
+        return decode_temp_data(value_msb, value_lsb);
+
+    return value_msb;
+}
+
+
+#ifdef CONFIG_AM_FIXED_POINT_SELF_CHECK
+// checks the fixed-point pipeline against the float one it has replaced, for every
+// possible raw temperature value and every one byte value of the other channels:
+// decoding must be exact and scoring must be equal
+esp_err_t fixed_point_self_check()
+{
+    // float bands of temperature (the first parameter of both score tables)
+    const float temp_bands_upper[] = {35.0, 36.0, 38.0, 39.0};
+    const uint8_t temp_bands_score[] = {3, 1, 0, 1, 2};
+
+    uint32_t mismatch_cnt = 0;
+    for (uint32_t raw = 0; raw <= UINT16_MAX; raw++)
+    {
+        uint8_t temp_msb = raw >> 8;
+        uint8_t temp_lsb = raw & 0xFF;
+
+        // float decoding, as in the float pipeline
+        float temp = (float)(temp_msb & 0b01111111);
+        for (int i = 0; i < 8; i++)
+            temp += ((temp_lsb >> (7-i)) & 1) / (float)(2 << i);
+        temp *= (temp_msb>>7) & 1 ? -1.0 : 1.0;
+
+        uint8_t band = 0;
+        while (band < sizeof(temp_bands_upper) / sizeof(float) && temp > temp_bands_upper[band])
+            band++;
+
+        int16_t fixed_temp = decode_data_value(CHANNEL_TEMP, temp_msb, temp_lsb);
+        if (sample_value_to_float(CHANNEL_TEMP, fixed_temp) != temp ||
+            get_band_score(&score_table[0], fixed_temp) != temp_bands_score[band])
+            mismatch_cnt++;
+    }
+
+    // the other channels are integers, float bands have the same bounds
+    for (uint8_t i = 0; i < SCORE_PARAMS_CNT; i++)
+    {
+        const score_param_t* param = &score_table[i];
+        if (param->channel == CHANNEL_TEMP || param->input != PARAM_INPUT_LATEST)
+            continue;
+
+        for (uint32_t raw = 0; raw <= UINT8_MAX; raw++)
+        {
+            float value = (float)raw;
+            uint8_t band = 0;
+            while (band + 1 < param->bands_cnt && value > (float)param->bands[band].upper)
+                band++;
+
+            int16_t fixed_value = decode_data_value(param->channel, raw, 0);
+            if (sample_value_to_float(param->channel, fixed_value) != value ||
+                get_band_score(param, fixed_value) != param->bands[band].score)
+                mismatch_cnt++;
+        }
+    }
+
+    if (mismatch_cnt > 0)
+    {
+        ESP_LOGE(g_tag_analysis, "Fixed-point self check failed: %lu mismatches.", (unsigned long)mismatch_cnt);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(g_tag_analysis, "Fixed-point self check passed.");
+    return ESP_OK;
 }
+#endif
 
 
 #endif /* MAIN_ANALYSIS_MODULE_H_ */
@@ -9,14 +9,152 @@
 #define MAIN_APP_PACKET_H_
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include "system.h"
 
+// Description:
+// An application packet is carried in the manufacturer specific data of an advert.
+// It starts with a 16-bit header in big-endian (network) order, which defines the
+// packet type, and is followed by optional payload. The header is read and written
+// with byte shifts, so the byte order of the target does not matter and no bytes
+// have to be reversed at runtime. A received packet is parsed into a packet view,
+// in which the payload points straight into the advert data, so no copy is needed.
+// The view is valid only while the advert data is.
+//
+// DATA_HEADER packets carry one value in temperature format, optionally followed
+// by a sequence number:
+//   value (2 bytes, msb, lsb) | sequence number (2 bytes, big-endian, optional)
+// Data packets with sequence number are deduplicated by the gateway (see more
+// seq_dedup.h), a sensor increments it for every new packet.
+//
+// DATA_TLV_HEADER packets carry a versioned TLV payload, so a sensor can buffer
+// several readings of several measurement types and send them in one advert:
+//   version (1 byte) | flags (1 byte) | sequence number (2 bytes, big-endian) | records
+// every record is:
+//   type (1 byte) | length (1 byte) | samples (length bytes)
+// and every sample of a record is:
+//   time offset (1 byte, s before the advert was sent) | value (size defined by type)
+// Records of unknown types are skipped by their length, so new measurement types
+// don't break older gateways. A packet of another version is rejected.
+// A sensor that has more samples than fit into adverts sets TLV_FLAG_BACKLOG, the
+// gateway then connects to receive the rest (see more backlog_sync.h).
+//
+// ALERT_HEADER packets are sent by the gateway itself, when a critical state is
+// escalated (see more escalation.h).
+//
+// SCHEDULE_HEADER packets are sent by the gateway itself during every data scan,
+// they carry its wake schedule (see more time_sync.h).
+
 #define REG_HEADER  0x0001
 #define DEL_HEADER  0x0002
 #define DATA_HEADER 0x0003
+#define DATA_TLV_HEADER 0x0004
+#define ALERT_HEADER 0x0005
+#define SCHEDULE_HEADER 0x0006
 #define HEADER_SIZE 2//sizeof(uint16_t)
 
+#define TEMP_DATA_SIZE  2   // size of temperature data in DATA_HEADER packet (msb, lsb)
+#define DATA_SEQ_SIZE   2   // size of optional sequence number in DATA_HEADER packet
+
+#define TLV_VERSION         0x01    // supported version of TLV payload
+#define TLV_HEADER_SIZE     4       // version, flags, sequence number
+#define TLV_RECORD_HDR_SIZE 2       // type, length
+#define TLV_TIME_OFFSET_SIZE 1      // time offset of every sample
+#define TLV_FLAG_BACKLOG    0x01    // sensor has backlog pending
+
+// measurement types of TLV records
+typedef enum {
+    MEAS_TEMP = 0x01,       // temperature, 2 bytes (msb, lsb as in DATA_HEADER packet)
+    MEAS_SPO2 = 0x02,       // blood oxygen saturation, 1 byte (%)
+    MEAS_HEART_RATE = 0x03, // heart rate, 1 byte (bpm)
+    MEAS_ACTIVITY = 0x04    // activity level, 1 byte
+} meas_type_t;
+
+// struct that describes parsed packet, payload points into the received data
+typedef struct {
+    uint16_t header;        // packet header (REG_HEADER, DEL_HEADER or DATA_HEADER)
+    const uint8_t* payload; // payload after the header, NULL if there is no payload
+    uint8_t payload_len;    // length of the payload
+} packet_view_t;
+
+// struct that describes parsed TLV payload, records point into the received data
+typedef struct {
+    uint8_t version;        // payload version
+    uint8_t flags;          // payload flags
+    uint16_t seq;           // sequence number of the packet
+    const uint8_t* records; // records after the TLV header
+    uint8_t records_len;    // length of the records
+} tlv_packet_view_t;
+
+// struct that describes one sample of a TLV record
+typedef struct {
+    uint8_t type;           // measurement type (meas_type_t)
+    uint8_t time_offset_s;  // s before the advert was sent
+    const uint8_t* value;   // value, points into the received data
+    uint8_t value_len;      // size of the value
+} tlv_sample_t;
+
+// iterator over all samples of all records of TLV payload
+typedef struct {
+    const uint8_t* pos;         // position of the next record
+    const uint8_t* end;         // end of the records
+    const uint8_t* rec_pos;     // position of the next sample in current record
+    const uint8_t* rec_end;     // end of current record
+    uint8_t rec_type;           // type of current record
+    uint8_t rec_value_len;      // value size of current record
+} tlv_iter_t;
+
+// builder of TLV packet
+typedef struct {
+    uint8_t* buff;          // destination buffer
+    uint8_t buff_size;      // size of the destination buffer
+    uint8_t len;            // length of the formed packet
+    uint8_t rec_hdr_pos;    // position of the header of current record
+    uint8_t rec_type;       // type of current record, 0 if there is no record yet
+} tlv_builder_t;
+
+
+bool packet_header_is_valid(uint16_t header);
+int8_t parse_packet_view(packet_view_t* view, const uint8_t* packet, uint8_t packet_len);
+int8_t form_packet(uint8_t* dest_buff, uint16_t header_tag, const uint8_t* data_buff, uint8_t data_buff_len);
+int8_t open_packet(uint16_t* dest_header, uint8_t* dest_buff, const uint8_t* packet, uint8_t packet_len);
+int8_t get_packet_header(uint16_t* dest_header, const uint8_t* packet, uint8_t packet_len);
+int8_t get_packet_seq(uint16_t* dest_seq, const uint8_t* packet, uint8_t packet_len);
+uint8_t get_meas_value_size(uint8_t type);
+int8_t parse_tlv_packet(tlv_packet_view_t* tlv, const packet_view_t* packet);
+void tlv_iter_init(tlv_iter_t* iter, const tlv_packet_view_t* tlv);
+bool tlv_iter_next(tlv_iter_t* iter, tlv_sample_t* sample);
+int8_t tlv_builder_init(tlv_builder_t* builder, uint8_t* dest_buff, uint8_t dest_buff_size, uint16_t seq, uint8_t flags);
+int8_t tlv_builder_add_sample(tlv_builder_t* builder, uint8_t type, uint8_t time_offset_s, const uint8_t* value);
+uint8_t tlv_builder_get_len(const tlv_builder_t* builder);
+
+
+// checks if the header matches valid types (registration, deletion, or data)
+bool packet_header_is_valid(uint16_t header)
+{
+    return (header == REG_HEADER) || (header == DEL_HEADER) || (header == DATA_HEADER) || (header == DATA_TLV_HEADER);
+}
+
+
+// parses a packet into a view without copying the payload
+int8_t parse_packet_view(packet_view_t* view, const uint8_t* packet, uint8_t packet_len)
+{
+    // if the packet length is too small to contain a header or
+    // the packet is NULL, return error
+    if (view == NULL || packet == NULL || packet_len < HEADER_SIZE)
+        return -1;
+
+    uint16_t header = GET_BE16(packet);
+    if (!packet_header_is_valid(header))
+        return -1;
+
+    view->header = header;
+    view->payload_len = packet_len - HEADER_SIZE;
+    view->payload = view->payload_len > 0 ? packet + HEADER_SIZE : NULL;
+    return 0;
+}
+
 
 // forms a packet by adding a header and optional data
 int8_t form_packet(uint8_t* dest_buff, uint16_t header_tag, const uint8_t* data_buff, uint8_t data_buff_len)
@@ -24,12 +162,7 @@ int8_t form_packet(uint8_t* dest_buff, uint16_t header_tag, const uint8_t* data_
     if (dest_buff == NULL)  // check if the destination buffer is not NULL
         return -1;
 
-    // if the system uses little-endian, reverse the bytes of the header
-    uint8_t endianness = check_endianness();
-    if (endianness == L_ENDIAN)
-        reverse_bytes((uint8_t*)&header_tag, sizeof(header_tag));
-
-    memcpy(dest_buff, &header_tag, HEADER_SIZE);
+    PUT_BE16(dest_buff, header_tag);
 
     // if there is data, copy it into the destination buffer after the header
     if (data_buff != NULL)
@@ -39,60 +172,195 @@ int8_t form_packet(uint8_t* dest_buff, uint16_t header_tag, const uint8_t* data_
 }
 
 
-// opens and parses a packet, extracting the header and optional data
+// opens and parses a packet, extracting the header and copying optional data
+// (prefer parse_packet_view, which doesn't copy)
 int8_t open_packet(uint16_t* dest_header, uint8_t* dest_buff, const uint8_t* packet, uint8_t packet_len)
 {
-    // if the packet length is too small to contain a header or
-    // the packet is NULL, return error
-    if (packet_len < HEADER_SIZE || packet == NULL)
+    packet_view_t view;
+    if (dest_header == NULL || parse_packet_view(&view, packet, packet_len) == -1)
         return -1;
 
-    uint8_t header_arr[HEADER_SIZE];
-    memcpy(header_arr, packet, HEADER_SIZE);
+    *dest_header = view.header;
+
+    // if packet is longer than header (contains data) and destination buffer not NULL
+    if (view.payload_len > 0 && dest_buff != NULL)
+        memcpy(dest_buff, view.payload, view.payload_len);
 
-    // if the system uses little-endian, reverse the bytes of the header
-    uint8_t endianness = check_endianness();
-    if (endianness == L_ENDIAN)
-        reverse_bytes((uint8_t*)&header_arr, sizeof(header_arr));
+    return 0;
+}
 
-    // check if the header matches valid types (registration, deletion, or data)
-    uint16_t header = *(uint16_t*)header_arr;
-    if ((header != REG_HEADER) && (header != DEL_HEADER) && (header != DATA_HEADER))
+
+// extracts and validates the header from a packet
+int8_t get_packet_header(uint16_t* dest_header, const uint8_t* packet, uint8_t packet_len)
+{
+    packet_view_t view;
+    if (dest_header == NULL || parse_packet_view(&view, packet, packet_len) == -1)
         return -1;
 
-    *dest_header = header;
+    *dest_header = view.header;
+    return 0;
+}
 
-    // if packet is longer than header (contains data) and destination buffer not NULL
-    if (packet_len > HEADER_SIZE && dest_buff != NULL)
-        memcpy(dest_buff, packet + HEADER_SIZE, packet_len - HEADER_SIZE);
 
+// extracts sequence number of data packet without parsing its payload
+// returns -1 if the packet carries no sequence number
+int8_t get_packet_seq(uint16_t* dest_seq, const uint8_t* packet, uint8_t packet_len)
+{
+    packet_view_t view;
+    if (dest_seq == NULL || parse_packet_view(&view, packet, packet_len) == -1)
+        return -1;
+
+    if (view.header == DATA_TLV_HEADER && view.payload_len >= TLV_HEADER_SIZE && view.payload[0] == TLV_VERSION)
+    {
+        *dest_seq = GET_BE16(view.payload + 2);
+        return 0;
+    }
+    if (view.header == DATA_HEADER && view.payload_len >= TEMP_DATA_SIZE + DATA_SEQ_SIZE)
+    {
+        *dest_seq = GET_BE16(view.payload + TEMP_DATA_SIZE);
+        return 0;
+    }
+    return -1;
+}
+
+
+// gets size of a sample value of given measurement type
+// returns 0 for unknown types
+uint8_t get_meas_value_size(uint8_t type)
+{
+    switch (type)
+    {
+        case MEAS_TEMP:         return 2;
+        case MEAS_SPO2:         return 1;
+        case MEAS_HEART_RATE:   return 1;
+        case MEAS_ACTIVITY:     return 1;
+        default:                return 0;
+    }
+}
+
+
+// parses TLV payload of DATA_TLV_HEADER packet without copying the records
+int8_t parse_tlv_packet(tlv_packet_view_t* tlv, const packet_view_t* packet)
+{
+    if (tlv == NULL || packet == NULL || packet->header != DATA_TLV_HEADER)
+        return -1;
+
+    // check if payload contains TLV header and version is supported
+    if (packet->payload_len < TLV_HEADER_SIZE || packet->payload[0] != TLV_VERSION)
+        return -1;
+
+    tlv->version = packet->payload[0];
+    tlv->flags = packet->payload[1];
+    tlv->seq = GET_BE16(packet->payload + 2);
+    tlv->records = packet->payload + TLV_HEADER_SIZE;
+    tlv->records_len = packet->payload_len - TLV_HEADER_SIZE;
     return 0;
 }
 
 
-// extracts and validates the header from a packet
-int8_t get_packet_header(uint16_t* dest_header, const uint8_t* packet)
+// inits iterator over samples of TLV payload
+void tlv_iter_init(tlv_iter_t* iter, const tlv_packet_view_t* tlv)
 {
-    // if the packet size is smaller than the header size or
-    // the packet is NULL, return error
-    if (sizeof(packet) < HEADER_SIZE || packet == NULL)
+    iter->pos = tlv->records;
+    iter->end = tlv->records + tlv->records_len;
+    iter->rec_pos = NULL;
+    iter->rec_end = NULL;
+    iter->rec_type = 0;
+    iter->rec_value_len = 0;
+}
+
+
+// gets the next sample, records of unknown types are skipped
+// returns false if there are no more samples or a record is truncated
+bool tlv_iter_next(tlv_iter_t* iter, tlv_sample_t* sample)
+{
+    uint8_t sample_size = TLV_TIME_OFFSET_SIZE + iter->rec_value_len;
+    while (iter->rec_pos == NULL || iter->rec_end - iter->rec_pos < sample_size)
+    {
+        // current record is over, go to the next one
+        if (iter->end - iter->pos < TLV_RECORD_HDR_SIZE)
+            return false;
+
+        uint8_t rec_type = iter->pos[0];
+        uint8_t rec_len = iter->pos[1];
+        if (iter->end - iter->pos - TLV_RECORD_HDR_SIZE < rec_len)   // truncated record
+            return false;
+
+        iter->rec_type = rec_type;
+        iter->rec_value_len = get_meas_value_size(rec_type);
+        iter->rec_pos = iter->pos + TLV_RECORD_HDR_SIZE;
+        iter->rec_end = iter->rec_pos + rec_len;
+        iter->pos = iter->rec_end;
+
+        if (iter->rec_value_len == 0)   // unknown type, skip the record
+            iter->rec_pos = iter->rec_end;
+        sample_size = TLV_TIME_OFFSET_SIZE + iter->rec_value_len;
+    }
+
+    sample->type = iter->rec_type;
+    sample->time_offset_s = iter->rec_pos[0];
+    sample->value = iter->rec_pos + TLV_TIME_OFFSET_SIZE;
+    sample->value_len = iter->rec_value_len;
+    iter->rec_pos += sample_size;
+    return true;
+}
+
+
+// inits builder of TLV packet, writes packet header and TLV header
+int8_t tlv_builder_init(tlv_builder_t* builder, uint8_t* dest_buff, uint8_t dest_buff_size, uint16_t seq, uint8_t flags)
+{
+    if (builder == NULL || dest_buff == NULL || dest_buff_size < HEADER_SIZE + TLV_HEADER_SIZE)
         return -1;
 
-    uint8_t header_arr[HEADER_SIZE];
-    memcpy(header_arr, packet, HEADER_SIZE);
+    builder->buff = dest_buff;
+    builder->buff_size = dest_buff_size;
+    builder->rec_hdr_pos = 0;
+    builder->rec_type = 0;
 
-    // if the system uses little-endian, reverse the bytes of the header
-    uint8_t endianness = check_endianness();
-    if (endianness == L_ENDIAN)
-        reverse_bytes((uint8_t*)&header_arr, sizeof(header_arr));
+    form_packet(dest_buff, DATA_TLV_HEADER, NULL, 0);
+    dest_buff[HEADER_SIZE] = TLV_VERSION;
+    dest_buff[HEADER_SIZE + 1] = flags;
+    PUT_BE16(dest_buff + HEADER_SIZE + 2, seq);
+    builder->len = HEADER_SIZE + TLV_HEADER_SIZE;
+    return 0;
+}
 
-    // check if the header matches valid types (registration, deletion, or data)
-    uint16_t header = *(uint16_t*)header_arr;
-    if ((header != REG_HEADER) && (header != DEL_HEADER) && (header != DATA_HEADER))
+
+// adds a sample to TLV packet, samples of the same type added one
+// after another are packed into one record
+int8_t tlv_builder_add_sample(tlv_builder_t* builder, uint8_t type, uint8_t time_offset_s, const uint8_t* value)
+{
+    uint8_t value_len = get_meas_value_size(type);
+    if (builder == NULL || value == NULL || value_len == 0)
         return -1;
 
-    *dest_header = header;
+    uint8_t sample_size = TLV_TIME_OFFSET_SIZE + value_len;
+    bool new_record = builder->rec_type != type || builder->buff[builder->rec_hdr_pos + 1] + sample_size > UINT8_MAX;
+    uint8_t needed = sample_size + (new_record ? TLV_RECORD_HDR_SIZE : 0);
+    if (builder->buff_size - builder->len < needed)   // no space left
+        return -1;
+
+    // start a new record, if type differs from the type of current one
+    if (new_record)
+    {
+        builder->rec_hdr_pos = builder->len;
+        builder->rec_type = type;
+        builder->buff[builder->len++] = type;
+        builder->buff[builder->len++] = 0;
+    }
+
+    builder->buff[builder->len++] = time_offset_s;
+    memcpy(builder->buff + builder->len, value, value_len);
+    builder->len += value_len;
+    builder->buff[builder->rec_hdr_pos + 1] += sample_size;   // update record length
     return 0;
 }
 
+
+// gets length of the formed TLV packet
+uint8_t tlv_builder_get_len(const tlv_builder_t* builder)
+{
+    return builder->len;
+}
+
 #endif /* MAIN_APP_PACKET_H_ */
@@ -0,0 +1,411 @@
+/*
+ * backlog_sync.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_BACKLOG_SYNC_H_
+#define MAIN_BACKLOG_SYNC_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "host/ble_hs.h"
+#include "esp_check_err.h"
+#include "system.h"
+#include "app_packet.h"
+#include "white_list.h"
+#include "ext_scan.h"
+#include "sample_history.h"
+#include "profiler.h"
+#include "energy.h"
+#include "worker.h"
+#include "trace.h"
+#include "sdkconfig.h"
+
+// Description:
+// A sensor that has built up a backlog (e.g. after being out of range) sets
+// TLV_FLAG_BACKLOG in its DATA_TLV_HEADER adverts. Such sensors are marked during
+// the data scan and, when the scan is over, the gateway connects to them one by one
+// before the analysis, so the analysis sees the whole backlog. A sync is:
+//   connect (short connection interval) -> data length and 2M PHY are requested ->
+//   ATT MTU exchange -> discovery of the backlog characteristic and its CCCD ->
+//   subscription -> notifications -> disconnect
+// The sensor sends its backlog in notifications of the backlog characteristic,
+// as large as the ATT MTU allows, every notification is:
+//   age (2 bytes, big-endian, s before now) | DATA_TLV_HEADER packet (see app_packet.h)
+// the time offsets of the samples are counted back from the age. An empty notification
+// ends the backlog and the gateway disconnects. A sync is cut off after
+// BACKLOG_SYNC_MAX_MS, so a stalled sensor does not keep the gateway awake.
+
+#define BACKLOG_SYNC_MAX_MS         CONFIG_AM_BACKLOG_SYNC_MAX_MS   // max duration of one sync
+#define BACKLOG_CONNECT_TIMEOUT_MS  300     // max time to establish connection
+#define BACKLOG_MTU                 247     // preferred ATT MTU, one notification fits one LL packet
+#define BACKLOG_TX_OCTETS           251     // max LL payload (data length extension)
+#define BACKLOG_TX_TIME             2120    // time of max LL payload on 1M PHY, in us
+#define BACKLOG_CONN_ITVL           0x0006  // 7.5 ms (in 1.25 ms units)
+#define BACKLOG_SUPERV_TMO          100     // 1 s (in 10 ms units)
+#define BACKLOG_AGE_SIZE            2       // age of notification
+#define BACKLOG_NOTIFY_MAX_LEN      (BACKLOG_MTU - 3)   // max length of notification
+
+_Static_assert(BACKLOG_NOTIFY_MAX_LEN <= WORKER_DATA_SIZE, "backlog notification must fit into worker message");
+
+// UUID of the custom backlog characteristic of sensors
+#define BACKLOG_CHR_UUID128 BLE_UUID128_DECLARE(0x20, 0x00, 0x5e, 0xa1, 0x6b, 0x3c, 0x4e, 0x9a, \
+                                                0x8f, 0x21, 0x7d, 0x5c, 0x4b, 0xa0, 0x3e, 0x6d)
+
+// enum of steps of a sync
+typedef enum {
+    BACKLOG_IDLE = 0,           // no sync is running
+    BACKLOG_CONNECTING = 1,     // connection is being established
+    BACKLOG_EXCHANGING_MTU = 2, // ATT MTU is being exchanged
+    BACKLOG_DISCOVERING = 3,    // backlog characteristic and its CCCD are being discovered
+    BACKLOG_SUBSCRIBING = 4,    // CCCD is being written
+    BACKLOG_RECEIVING = 5,      // backlog is being received
+    BACKLOG_DISCONNECTING = 6   // connection is being terminated
+} backlog_step_t;
+
+// struct that describes running sync
+typedef struct {
+    uint8_t step;           // step of the sync (backlog_step_t)
+    uint8_t wl_index;       // white list index of the sensor
+    uint16_t conn_handle;   // connection with the sensor
+    uint16_t val_handle;    // handle of the backlog characteristic value
+    uint16_t cccd_handle;   // handle of its client characteristic configuration descriptor
+    bool dscs_are_over;     // flag to indicate whether descriptors of the characteristic are over
+    uint16_t packets_cnt;   // number of received packets
+    uint16_t samples_cnt;   // number of pushed samples
+    int64_t start_time_us;  // start time of the sync (esp_timer_get_time)
+} backlog_sync_t;
+
+// callback that pushes samples of backlog packet, packet_time is the RTC time
+// the packet is counted from, returns number of pushed samples
+typedef uint8_t (*backlog_packet_cb_t)(const packet_view_t* packet, uint8_t wl_index, uint32_t packet_time);
+// callback called when every marked sensor is synced
+typedef void (*backlog_done_cb_t)(void);
+
+
+void backlog_sync_mark(uint8_t wl_index);
+bool backlog_sync_start(uint8_t own_addr_type, backlog_packet_cb_t on_packet, backlog_done_cb_t on_done);
+bool backlog_sync_start_next();
+bool backlog_sync_is_active();
+void backlog_sync_stop(uint8_t step, int err);
+static int backlog_gap_event(struct ble_gap_event *event, void *arg);
+static int handle_backlog_gap_event(struct ble_gap_event *event, void *arg);
+static int on_backlog_mtu(uint16_t conn_handle, const struct ble_gatt_error *error, uint16_t mtu, void *arg);
+static int on_backlog_chr(uint16_t conn_handle, const struct ble_gatt_error *error, const struct ble_gatt_chr *chr, void *arg);
+static int on_backlog_dsc(uint16_t conn_handle, const struct ble_gatt_error *error, uint16_t chr_val_handle,
+                          const struct ble_gatt_dsc *dsc, void *arg);
+static int on_backlog_subscribed(uint16_t conn_handle, const struct ble_gatt_error *error, struct ble_gatt_attr *attr, void *arg);
+void receive_backlog_packet(const uint8_t* notify_buff, uint16_t notify_len);
+static void backlog_timer_cb(void* arg);
+
+
+const char* g_tag_backlog = "BACKLOG";  // tag used in ESP_CHECK
+
+uint32_t backlog_pending[(WHITE_LIST_SIZE + 31) / 32] = {};    // bitmap of white list slots with backlog
+backlog_sync_t backlog_sync = {.step = BACKLOG_IDLE, .conn_handle = BLE_HS_CONN_HANDLE_NONE};
+uint8_t backlog_own_addr_type;              // own addr type of connections
+backlog_packet_cb_t backlog_on_packet = NULL;
+backlog_done_cb_t backlog_on_done = NULL;
+esp_timer_handle_t backlog_timer = NULL;    // timer that cuts off a sync
+
+
+// marks white list entry with given index as having backlog
+void backlog_sync_mark(uint8_t wl_index)
+{
+    if (wl_index >= WHITE_LIST_SIZE)
+        return;
+
+    backlog_pending[wl_index / 32] |= 1UL << (wl_index % 32);
+}
+
+
+// starts sync of every marked sensor, on_packet gets every received packet
+// and on_done is called when the last sensor is synced
+// returns false if no sensor is marked (on_done is not called then)
+bool backlog_sync_start(uint8_t own_addr_type, backlog_packet_cb_t on_packet, backlog_done_cb_t on_done)
+{
+    if (backlog_sync.step != BACKLOG_IDLE || on_packet == NULL || on_done == NULL)
+        return false;
+
+    if (backlog_timer == NULL)
+    {
+        const esp_timer_create_args_t timer_args = {
+            .name = "backlog timer",
+            .callback = &backlog_timer_cb,
+            .arg = NULL,
+            .skip_unhandled_events = true
+        };
+        if (esp_timer_create(&timer_args, &backlog_timer) != ESP_OK)
+            return false;
+    }
+
+    ble_att_set_preferred_mtu(BACKLOG_MTU);
+    backlog_own_addr_type = own_addr_type;
+    backlog_on_packet = on_packet;
+    backlog_on_done = on_done;
+
+    profiler_phase_begin(PHASE_BACKLOG);    // recorded only if a sync is started
+    return backlog_sync_start_next();
+}
+
+
+// connects to the next marked sensor, the mark is cleared
+// returns false if no sensor is left
+bool backlog_sync_start_next()
+{
+    for (uint8_t wl_index = 0; wl_index < WHITE_LIST_SIZE; wl_index++)
+    {
+        if (!(backlog_pending[wl_index / 32] & (1UL << (wl_index % 32))))
+            continue;
+        backlog_pending[wl_index / 32] &= ~(1UL << (wl_index % 32));
+
+        struct ble_gap_conn_params conn_params = {
+                .scan_itvl = 0x0010,
+                .scan_window = 0x0010,
+                .itvl_min = BACKLOG_CONN_ITVL,
+                .itvl_max = BACKLOG_CONN_ITVL,
+                .latency = 0,
+                .supervision_timeout = BACKLOG_SUPERV_TMO,
+                .min_ce_len = 0,
+                .max_ce_len = 0
+        };
+
+        backlog_sync = (backlog_sync_t){
+                .step = BACKLOG_CONNECTING,
+                .wl_index = wl_index,
+                .conn_handle = BLE_HS_CONN_HANDLE_NONE,
+                .start_time_us = esp_timer_get_time()
+        };
+        int rc = ext_scan_connect(backlog_own_addr_type, &white_list[wl_index].device_addr, white_list[wl_index].adv_phy,
+                                  BACKLOG_CONNECT_TIMEOUT_MS, &conn_params, backlog_gap_event, NULL);
+        if (rc != 0)
+        {
+            TRACE_E(TRACE_BACKLOG_FAIL, BACKLOG_CONNECTING, rc);
+            continue;
+        }
+
+        TRACE_I(TRACE_BACKLOG_START, wl_index, 0);
+        return true;
+    }
+
+    backlog_sync.step = BACKLOG_IDLE;
+    return false;
+}
+
+
+// checks if a sync is running
+bool backlog_sync_is_active()
+{
+    return backlog_sync.step != BACKLOG_IDLE;
+}
+
+
+// stops running sync, failed at given step (BACKLOG_IDLE if it is complete),
+// the connection is terminated
+void backlog_sync_stop(uint8_t step, int err)
+{
+    if (step != BACKLOG_IDLE)
+        TRACE_E(TRACE_BACKLOG_FAIL, step, err);
+
+    if (backlog_sync.step == BACKLOG_DISCONNECTING)
+        return;
+
+    backlog_sync.step = BACKLOG_DISCONNECTING;
+    ble_gap_terminate(backlog_sync.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+}
+
+
+// gap event callback of sync connections, runs in the host task, events
+// and notifications are handled by the worker task (see more worker.h)
+static int backlog_gap_event(struct ble_gap_event *event, void *arg)
+{
+    if (event->type != BLE_GAP_EVENT_NOTIFY_RX)
+        return worker_post_gap_event(event, handle_backlog_gap_event, arg);
+
+    if (event->notify_rx.attr_handle == backlog_sync.val_handle && backlog_sync.step == BACKLOG_RECEIVING)
+        worker_post_data(event->notify_rx.om, receive_backlog_packet);
+    return 0;
+}
+
+
+// gap event handler of sync connections
+static int handle_backlog_gap_event(struct ble_gap_event *event, void *arg)
+{
+    switch (event->type)
+    {
+        case BLE_GAP_EVENT_CONNECT:
+        {
+            if (event->connect.status != 0)
+            {
+                // sensor is not reachable any more, go to the next one
+                TRACE_E(TRACE_BACKLOG_FAIL, BACKLOG_CONNECTING, event->connect.status);
+                if (!backlog_sync_start_next())
+                {
+                    profiler_phase_end(PHASE_BACKLOG);
+                    backlog_on_done();
+                }
+                break;
+            }
+
+            backlog_sync.conn_handle = event->connect.conn_handle;
+            energy_radio_begin(RADIO_CONN, ENERGY_FULL_DUTY);
+            esp_timer_start_once(backlog_timer, BACKLOG_SYNC_MAX_MS * 1000);
+
+            // link layer procedures run alongside the ATT ones,
+            // they are only asked for, the sensor may not support them,
+            // sensor on Coded PHY is far away and stays on it (see more ext_scan.h)
+            ble_gap_set_data_len(backlog_sync.conn_handle, BACKLOG_TX_OCTETS, BACKLOG_TX_TIME);
+            if (ADV_PHY_PRIMARY(white_list[backlog_sync.wl_index].adv_phy) != BLE_HCI_LE_PHY_CODED)
+                ble_gap_set_prefered_le_phy(backlog_sync.conn_handle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK,
+                                            BLE_GAP_LE_PHY_CODED_ANY);
+
+            backlog_sync.step = BACKLOG_EXCHANGING_MTU;
+            int rc = ble_gattc_exchange_mtu(backlog_sync.conn_handle, on_backlog_mtu, NULL);
+            if (rc != 0)
+                backlog_sync_stop(BACKLOG_EXCHANGING_MTU, rc);
+            break;
+        }
+        case BLE_GAP_EVENT_DISCONNECT:
+        {
+            esp_timer_stop(backlog_timer);
+            energy_radio_end(RADIO_CONN);
+            TRACE_I(TRACE_BACKLOG_END, backlog_sync.packets_cnt, backlog_sync.samples_cnt);
+            ESP_LOGI(g_tag_backlog, "Backlog of %u samples is received in %lu ms.", backlog_sync.samples_cnt,
+                    (unsigned long)((esp_timer_get_time() - backlog_sync.start_time_us) / 1000));
+
+            if (!backlog_sync_start_next())
+            {
+                profiler_phase_end(PHASE_BACKLOG);
+                backlog_on_done();
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return 0;
+}
+
+
+// callback of ATT MTU exchange, starts discovery of the backlog characteristic
+static int on_backlog_mtu(uint16_t conn_handle, const struct ble_gatt_error *error, uint16_t mtu, void *arg)
+{
+    // the backlog is received with the default MTU too, only slower
+    if (error->status != 0)
+        TRACE_E(TRACE_BACKLOG_FAIL, BACKLOG_EXCHANGING_MTU, error->status);
+
+    backlog_sync.step = BACKLOG_DISCOVERING;
+    int rc = ble_gattc_disc_chrs_by_uuid(conn_handle, 1, 0xFFFF, BACKLOG_CHR_UUID128, on_backlog_chr, NULL);
+    if (rc != 0)
+        backlog_sync_stop(BACKLOG_DISCOVERING, rc);
+    return 0;
+}
+
+
+// callback of characteristic discovery, starts discovery of the CCCD
+static int on_backlog_chr(uint16_t conn_handle, const struct ble_gatt_error *error, const struct ble_gatt_chr *chr, void *arg)
+{
+    if (error->status == 0)
+    {
+        backlog_sync.val_handle = chr->val_handle;
+        return 0;
+    }
+
+    if (error->status != BLE_HS_EDONE || backlog_sync.val_handle == 0)
+    {
+        backlog_sync_stop(BACKLOG_DISCOVERING, error->status);
+        return 0;
+    }
+
+    // descriptors of the characteristic follow its value, up to
+    // the declaration of the next characteristic
+    int rc = ble_gattc_disc_all_dscs(conn_handle, backlog_sync.val_handle, 0xFFFF, on_backlog_dsc, NULL);
+    if (rc != 0)
+        backlog_sync_stop(BACKLOG_DISCOVERING, rc);
+    return 0;
+}
+
+
+// callback of descriptor discovery, subscribes to notifications of the backlog
+static int on_backlog_dsc(uint16_t conn_handle, const struct ble_gatt_error *error, uint16_t chr_val_handle,
+                          const struct ble_gatt_dsc *dsc, void *arg)
+{
+    if (error->status == 0)
+    {
+        if (ble_uuid_cmp(&dsc->uuid.u, BLE_UUID16_DECLARE(BLE_ATT_UUID_CHARACTERISTIC)) == 0)
+            backlog_sync.dscs_are_over = true;
+        else if (!backlog_sync.dscs_are_over && backlog_sync.cccd_handle == 0 &&
+                 ble_uuid_cmp(&dsc->uuid.u, BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16)) == 0)
+            backlog_sync.cccd_handle = dsc->handle;
+        return 0;
+    }
+
+    if (error->status != BLE_HS_EDONE || backlog_sync.cccd_handle == 0)
+    {
+        backlog_sync_stop(BACKLOG_DISCOVERING, error->status);
+        return 0;
+    }
+
+    uint8_t cccd_value[2] = {0x01, 0x00};   // notifications enabled
+    backlog_sync.step = BACKLOG_SUBSCRIBING;
+    int rc = ble_gattc_write_flat(conn_handle, backlog_sync.cccd_handle, cccd_value, sizeof(cccd_value),
+                                  on_backlog_subscribed, NULL);
+    if (rc != 0)
+        backlog_sync_stop(BACKLOG_SUBSCRIBING, rc);
+    return 0;
+}
+
+
+// callback of CCCD write, the sensor starts to send the backlog
+static int on_backlog_subscribed(uint16_t conn_handle, const struct ble_gatt_error *error, struct ble_gatt_attr *attr, void *arg)
+{
+    if (error->status != 0)
+    {
+        backlog_sync_stop(BACKLOG_SUBSCRIBING, error->status);
+        return 0;
+    }
+
+    backlog_sync.step = BACKLOG_RECEIVING;
+    return 0;
+}
+
+
+// pushes samples of received notification, the empty one ends the backlog,
+// runs in the worker task (see more worker.h)
+void receive_backlog_packet(const uint8_t* notify_buff, uint16_t notify_len)
+{
+    if (notify_len == 0)
+    {
+        backlog_sync_stop(BACKLOG_IDLE, 0);
+        return;
+    }
+
+    packet_view_t packet;
+    if (notify_len < BACKLOG_AGE_SIZE ||
+        parse_packet_view(&packet, notify_buff + BACKLOG_AGE_SIZE, notify_len - BACKLOG_AGE_SIZE) == -1)
+    {
+        TRACE_E(TRACE_PACKET_ERROR, 1, notify_len);
+        return;
+    }
+
+    uint32_t now = get_rtc_time_s();
+    uint16_t age = GET_BE16(notify_buff);
+    backlog_sync.packets_cnt++;
+    backlog_sync.samples_cnt += backlog_on_packet(&packet, backlog_sync.wl_index, now >= age ? now - age : 0);
+}
+
+
+// callback of the timer, cuts off the sync that takes too long
+static void backlog_timer_cb(void* arg)
+{
+    if (backlog_sync.step != BACKLOG_IDLE && backlog_sync.conn_handle != BLE_HS_CONN_HANDLE_NONE)
+        backlog_sync_stop(backlog_sync.step, BLE_HS_ETIMEOUT);
+}
+
+
+#endif /* MAIN_BACKLOG_SYNC_H_ */
@@ -0,0 +1,340 @@
+/*
+ * bench.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_BENCH_H_
+#define MAIN_BENCH_H_
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "host/ble_hs.h"
+#include "esp_check_err.h"
+#include "app_packet.h"
+#include "white_list.h"
+#include "adv_prefilter.h"
+#include "analysis_module.h"
+#include "sample_history.h"
+#include "ext_scan.h"
+#include "sdkconfig.h"
+
+// Description:
+// The benchmark measures the cost of the data path on the target itself, so the
+// numbers are those of the real core (RISC-V, no FPU) and of the real NimBLE
+// parsing code. It is built in with CONFIG_AM_BENCHMARK, such a build runs the
+// benchmark at boot instead of the normal operation, so it is not meant for
+// deployment: it fills the white list and the sample history in RTC memory with
+// synthetic sensors (NVS is not touched) and sleeps until reset afterwards.
+// A synthetic stream of BENCH_STREAM_LEN adverts is made first, every registered
+// sensor sends a full DATA_TLV_HEADER advert of its measurement types with normal
+// values, every BENCH_NOISE_EVERY-th advert comes from an unregistered device.
+// The stream is replayed BENCH_ADVERTS times through every measured stage:
+//   advert    - prefilter, AD parsing, packet view, white list lookup and storing
+//               of the samples (the data path of handle_advert in main.c)
+//   open      - open_packet of the app packet
+//   lookup    - get_white_list_index_by_addr, hits and misses
+//   analysis  - start_analysis of every subject in turn
+// Every stage is reported in CPU cycles (esp_cpu_get_cycle_count) and in ns (from
+// esp_timer over the whole stage) per operation, and compared with its threshold
+// from Kconfig, a stage over its threshold is reported as regression.
+// The same stages are built for the host too (see more host_bench/host_bench.c),
+// with esp_timer, RTC_DATA_ATTR and the NimBLE parsing replaced by stubs, so a
+// regression is caught in CI without hardware, the target numbers stay the reference.
+
+#define BENCH_ADVERTS       CONFIG_AM_BENCH_ADVERTS     // number of replayed adverts per stage
+#define BENCH_STREAM_LEN    16      // number of distinct adverts in the stream
+#define BENCH_NOISE_EVERY   4       // every n-th advert comes from unregistered device
+
+// enum of measured stages
+typedef enum {
+    BENCH_ADVERT = 0,   // data path of one advert
+    BENCH_OPEN_PACKET,  // open_packet
+    BENCH_WL_LOOKUP,    // white list lookup by addr
+    BENCH_ANALYSIS,     // start_analysis
+    BENCH_STAGE_CNT
+} bench_stage_t;
+
+// struct that describes one advert of the stream
+typedef struct {
+    struct ble_gap_disc_desc disc_desc;     // discovery descriptor, points into data
+    uint8_t data[BLE_HS_ADV_MAX_SZ];        // advert data
+    const uint8_t* packet;                  // app packet in mfg data
+    uint8_t seq_pos;                        // position of the sequence number in data
+    uint8_t packet_len;                     // length of the app packet
+} bench_advert_t;
+
+// struct that describes result of a stage
+typedef struct {
+    uint32_t cycles;        // CPU cycles per operation
+    uint32_t ns;            // ns per operation
+} bench_result_t;
+
+// callback which stores samples of data packet (process_data_packet of main.c)
+typedef uint8_t bench_data_fn(const packet_view_t* packet, uint8_t wl_index, uint32_t packet_time);
+
+
+esp_err_t bench_run(bench_data_fn* process_cb);
+uint8_t bench_register_sensors();
+void bench_make_stream();
+uint8_t bench_make_advert(bench_advert_t* advert, const ble_addr_t* addr, const ble_uuid16_t* uuid);
+void bench_handle_advert(const bench_advert_t* advert, bench_data_fn* process_cb);
+uint32_t bench_rand();
+void bench_finish_stage(bench_stage_t stage, uint32_t start_cycles, int64_t start_us, uint32_t ops_cnt);
+esp_err_t bench_report();
+
+
+const char* g_tag_bench = "BENCH";  // tag used in ESP_CHECK
+
+// names and thresholds of stages, in cycles per operation
+const char* bench_stage_names[BENCH_STAGE_CNT] = {"advert", "open", "lookup", "analysis"};
+const uint32_t bench_max_cycles[BENCH_STAGE_CNT] = {
+        CONFIG_AM_BENCH_MAX_ADVERT_CYCLES,
+        CONFIG_AM_BENCH_MAX_OPEN_PACKET_CYCLES,
+        CONFIG_AM_BENCH_MAX_WL_LOOKUP_CYCLES,
+        CONFIG_AM_BENCH_MAX_ANALYSIS_CYCLES
+};
+
+bench_advert_t bench_stream[BENCH_STREAM_LEN];  // replayed adverts
+bench_result_t bench_results[BENCH_STAGE_CNT];  // results of stages
+uint32_t bench_rand_state = 0x2545F491;         // state of the generator, fixed so every run is the same
+volatile uint32_t bench_sink;                   // keeps results of measured calls
+
+
+// runs all stages of the benchmark and reports them
+// returns ESP_FAIL if some stage is over its threshold
+esp_err_t bench_run(bench_data_fn* process_cb)
+{
+    uint8_t sensors_cnt = bench_register_sensors();
+    if (sensors_cnt == 0)
+    {
+        ESP_LOGE(g_tag_bench, "No sensor could be registered.");
+        return ESP_FAIL;
+    }
+    bench_make_stream();
+    ESP_LOGI(g_tag_bench, "Replaying %u adverts of %u sensors.", BENCH_ADVERTS, sensors_cnt);
+
+    uint32_t start_cycles = esp_cpu_get_cycle_count();
+    int64_t start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_ADVERTS; i++)
+    {
+        // every replay is a new packet of its sensor, so it is not dropped as duplicate
+        bench_advert_t* advert = &bench_stream[i % BENCH_STREAM_LEN];
+        PUT_BE16(advert->data + advert->seq_pos, i);
+        bench_handle_advert(advert, process_cb);
+    }
+    bench_finish_stage(BENCH_ADVERT, start_cycles, start_us, BENCH_ADVERTS);
+
+    uint16_t header;
+    uint8_t payload[BLE_HS_ADV_MAX_SZ];
+    start_cycles = esp_cpu_get_cycle_count();
+    start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_ADVERTS; i++)
+    {
+        const bench_advert_t* advert = &bench_stream[i % BENCH_STREAM_LEN];
+        bench_sink = open_packet(&header, payload, advert->packet, advert->packet_len);
+    }
+    bench_finish_stage(BENCH_OPEN_PACKET, start_cycles, start_us, BENCH_ADVERTS);
+
+    start_cycles = esp_cpu_get_cycle_count();
+    start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_ADVERTS; i++)
+        bench_sink = get_white_list_index_by_addr(&bench_stream[i % BENCH_STREAM_LEN].disc_desc.addr);
+    bench_finish_stage(BENCH_WL_LOOKUP, start_cycles, start_us, BENCH_ADVERTS);
+
+    start_cycles = esp_cpu_get_cycle_count();
+    start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_ADVERTS; i++)
+        bench_sink = start_analysis(i % MAX_SUBJECTS);
+    bench_finish_stage(BENCH_ANALYSIS, start_cycles, start_us, BENCH_ADVERTS);
+
+    return bench_report();
+}
+
+
+// registers synthetic sensors of every subject and interesting uuid,
+// until the white list is full
+// returns number of registered sensors
+uint8_t bench_register_sensors()
+{
+    for (uint8_t subject_id = 0; subject_id < MAX_SUBJECTS; subject_id++)
+    {
+        set_registration_subject(subject_id);
+        for (uint8_t i = 0; i < WL_UUID_CNT; i++)
+            for (uint8_t j = 0; j < WHITE_LIST_MAX_PER_UUID; j++)
+            {
+                if (get_white_list_len() == WHITE_LIST_SIZE)
+                    return get_white_list_len();
+
+                ble_addr_t addr = {.type = BLE_ADDR_PUBLIC};
+                uint32_t rand = bench_rand();
+                memcpy(addr.val, &rand, sizeof(rand));
+                addr.val[4] = subject_id;
+                addr.val[5] = i;
+                push_to_white_list(wl_uuids[i], addr, ADV_PHY_LEGACY);
+            }
+    }
+    return get_white_list_len();
+}
+
+
+// makes stream of adverts of registered sensors, mixed with
+// adverts of unregistered devices
+void bench_make_stream()
+{
+    uint8_t slot = 0;
+    for (uint8_t i = 0; i < BENCH_STREAM_LEN; i++)
+    {
+        if (i % BENCH_NOISE_EVERY == BENCH_NOISE_EVERY - 1)
+        {
+            // unregistered device, addrs of synthetic sensors never end with 0xEE
+            ble_addr_t addr = {.type = BLE_ADDR_PUBLIC, .val = {i, 0, 0, 0, 0, 0xEE}};
+            bench_make_advert(&bench_stream[i], &addr, &wl_uuids[i % WL_UUID_CNT]);
+            continue;
+        }
+
+        while (white_list[slot].addr_is_empty)
+            slot = (slot + 1) % WHITE_LIST_SIZE;
+        bench_make_advert(&bench_stream[i], &white_list[slot].device_addr, &white_list[slot].device_uuid);
+        slot = (slot + 1) % WHITE_LIST_SIZE;
+    }
+}
+
+
+// makes advert of a sensor: flags, uuid and DATA_TLV_HEADER packet in mfg
+// data, filled with samples of measurement types of the sensor
+// returns length of the advert data
+uint8_t bench_make_advert(bench_advert_t* advert, const ble_addr_t* addr, const ble_uuid16_t* uuid)
+{
+    uint8_t* data = advert->data;
+    uint8_t len = 0;
+    data[len++] = 2;
+    data[len++] = BLE_HS_ADV_TYPE_FLAGS;
+    data[len++] = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+    data[len++] = 3;
+    data[len++] = BLE_HS_ADV_TYPE_COMP_UUIDS16;
+    data[len++] = uuid->value & 0xFF;
+    data[len++] = uuid->value >> 8;
+
+    // mfg data takes the rest of the advert
+    uint8_t mfg_len_pos = len;
+    data[len++] = 0;
+    data[len++] = BLE_HS_ADV_TYPE_MFG_DATA;
+    advert->packet = data + len;
+    advert->seq_pos = len + HEADER_SIZE + 2;    // after version and flags of TLV header
+
+    tlv_builder_t builder;
+    tlv_builder_init(&builder, data + len, BLE_HS_ADV_MAX_SZ - len, bench_rand(), 0);
+    sensor_kind_t kind = get_sensor_kind_by_uuid16(uuid);
+    for (uint8_t offset = 0; ; offset += 10)
+    {
+        int8_t rc;
+        uint8_t value[2];
+        if (kind == SENSOR_KIND_TEMP)
+        {
+            value[0] = 36;                          // 36.5 .. 37.0 C
+            value[1] = 0x80 + bench_rand() % 0x40;
+            rc = tlv_builder_add_sample(&builder, MEAS_TEMP, offset, value);
+        }
+        else if (kind == SENSOR_KIND_PULSEOX)
+        {
+            value[0] = 96 + bench_rand() % 4;       // SpO2 96 .. 99 %
+            rc = tlv_builder_add_sample(&builder, MEAS_SPO2, offset, value);
+            value[0] = 60 + bench_rand() % 30;      // heart rate 60 .. 89 bpm
+            rc |= tlv_builder_add_sample(&builder, MEAS_HEART_RATE, offset, value);
+        }
+        else
+        {
+            value[0] = bench_rand() % 32;           // low activity
+            rc = tlv_builder_add_sample(&builder, MEAS_ACTIVITY, offset, value);
+        }
+        if (rc != 0)    // packet is full
+            break;
+    }
+    advert->packet_len = tlv_builder_get_len(&builder);
+    len += advert->packet_len;
+    data[mfg_len_pos] = 1 + advert->packet_len;
+
+    advert->disc_desc = (struct ble_gap_disc_desc){
+            .event_type = BLE_HCI_ADV_RPT_EVTYPE_NONCONN_IND,
+            .length_data = len,
+            .addr = *addr,
+            .rssi = -60,
+            .data = data
+    };
+    return len;
+}
+
+
+// handles advert as in data scan, up to storing of its samples
+void bench_handle_advert(const bench_advert_t* advert, bench_data_fn* process_cb)
+{
+    const struct ble_gap_disc_desc* disc_desc = &advert->disc_desc;
+    if (!adv_prefilter_is_candidate(disc_desc->data, disc_desc->length_data, disc_desc->rssi, ADV_FILTER_DATA) ||
+        !adv_prefilter(disc_desc, ADV_FILTER_DATA))
+        return;
+
+    struct ble_hs_adv_fields fields;
+    ble_hs_adv_parse_fields(&fields, disc_desc->data, disc_desc->length_data);
+
+    packet_view_t packet;
+    if (parse_packet_view(&packet, fields.mfg_data, fields.mfg_data_len) == -1)
+        return;
+
+    int8_t wl_index = get_white_list_index_by_addr(&disc_desc->addr);
+    if (wl_index != -1)
+    {
+        bench_sink = process_cb(&packet, wl_index, get_rtc_time_s());
+        uint16_t seq;
+        if (bench_sink > 0 && get_packet_seq(&seq, fields.mfg_data, fields.mfg_data_len) == 0)
+            seq_dedup_mark(wl_index, seq);
+    }
+}
+
+
+// gets next number of xorshift generator
+uint32_t bench_rand()
+{
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 17;
+    bench_rand_state ^= bench_rand_state << 5;
+    return bench_rand_state;
+}
+
+
+// stores cost per operation of a finished stage, the cycle counter
+// is 32-bit, so a stage must be shorter than one counter wrap
+void bench_finish_stage(bench_stage_t stage, uint32_t start_cycles, int64_t start_us, uint32_t ops_cnt)
+{
+    uint32_t cycles = esp_cpu_get_cycle_count() - start_cycles;
+    int64_t duration_us = esp_timer_get_time() - start_us;
+    bench_results[stage].cycles = cycles / ops_cnt;
+    bench_results[stage].ns = duration_us * 1000 / ops_cnt;
+}
+
+
+// prints results of all stages against their thresholds
+// returns ESP_FAIL if some stage is over its threshold
+esp_err_t bench_report()
+{
+    esp_err_t err = ESP_OK;
+    for (uint8_t i = 0; i < BENCH_STAGE_CNT; i++)
+    {
+        bool regressed = bench_results[i].cycles > bench_max_cycles[i];
+        if (regressed)
+            err = ESP_FAIL;
+        ESP_LOGI(g_tag_bench, "%-8s %6lu cycles %7lu ns per op (max %lu cycles)%s", bench_stage_names[i],
+                 (unsigned long)bench_results[i].cycles, (unsigned long)bench_results[i].ns,
+                 (unsigned long)bench_max_cycles[i], regressed ? " REGRESSION" : "");
+    }
+    return err;
+}
+
+
+#endif /* MAIN_BENCH_H_ */
@@ -14,6 +14,8 @@
 #include "esp_timer.h"
 #include "driver/gpio.h"
 #include "esp_check_err.h"
+#include "trace.h"
+#include "worker.h"
 
 
 // To ensure reliable operation of the button functionality, proper
@@ -24,6 +26,8 @@
 // are many ways to solve this problem, and one of the simplest is to
 // disable interrupt handling until the contact bouncing subsides, which
 // is the solution used in this case.
+// Press callbacks are not called from the timer task, they are posted to
+// the worker task (see more worker.h), so they may take as long as needed.
 
 // structure that describes button gpio
 typedef struct {
@@ -55,6 +59,7 @@ int64_t g_button_released_time;     // time point when button was released
 
 esp_err_t button_init(button_cnfg_t button_cnfg);
 esp_err_t button_deinit();
+esp_err_t button_enable_wakeup(gpio_num_t gpio_num);
 static void glitching_timer_cb(void* arg);
 static void IRAM_ATTR gpio_isr_handler(void* arg);
 
@@ -77,9 +82,7 @@ esp_err_t button_init(button_cnfg_t button_cnfg)
     // configure gpio button pin, enable interrupt, enable deep sleep wakeup on high level
     ESP_CHECK(gpio_config(&gpio_button_cnfg), g_tag_butt);
     ESP_CHECK(gpio_intr_enable(g_button_cnfg.gpio_num), g_tag_butt);
-    ESP_CHECK(gpio_deep_sleep_wakeup_enable(g_button_cnfg.gpio_num, GPIO_INTR_HIGH_LEVEL), g_tag_butt);
-
-    ESP_CHECK(esp_deep_sleep_enable_gpio_wakeup(1ULL << g_button_cnfg.gpio_num, ESP_GPIO_WAKEUP_GPIO_HIGH), g_tag_butt);
+    button_enable_wakeup(g_button_cnfg.gpio_num);
 
 
     // init button_gpio_t structure for further passing to function
@@ -115,6 +118,20 @@ esp_err_t button_deinit()
 }
 
 
+// enables deep sleep wakeup on high level of the button gpio only, without
+// interrupt and debouncing timer, used by boots that never handle button presses
+// (wakeup configuration does not persist across deep sleep)
+esp_err_t button_enable_wakeup(gpio_num_t gpio_num)
+{
+    ESP_CHECK(gpio_pullup_dis(gpio_num), g_tag_butt);     // low level on release
+    ESP_CHECK(gpio_pulldown_en(gpio_num), g_tag_butt);    // high level on press
+    ESP_CHECK(gpio_deep_sleep_wakeup_enable(gpio_num, GPIO_INTR_HIGH_LEVEL), g_tag_butt);
+
+    ESP_CHECK(esp_deep_sleep_enable_gpio_wakeup(1ULL << gpio_num, ESP_GPIO_WAKEUP_GPIO_HIGH), g_tag_butt);
+    return ESP_OK;
+}
+
+
 // interrupt service routine handler for the button gpio
 // disables interrupts temporarily and starts a debounce timer.
 static void gpio_isr_handler(void* arg)
@@ -151,28 +168,25 @@ static void glitching_timer_cb(void* arg)
             // calculate the duration of the button press
             int64_t button_pressed_period = g_button_released_time - g_button_pressed_time;
             if (button_pressed_period < 0)
-                ESP_LOGE(g_tag_butt, "Button pressed period measurement error.");
+                TRACE_E(TRACE_BUTTON_ERROR, button_pressed_period, 0);
 
-            ESP_LOGI(g_tag_butt, "Button was pressed for %lld us = %f s", button_pressed_period, button_pressed_period/1000000.0);
+            TRACE_I(TRACE_BUTTON_PRESS, button_pressed_period / 1000, 0);
 
             if (button_pressed_period/1000.0 < g_button_cnfg.short_button_press_period_ms)          // SHORT BUTTON PRESS
             {
-                ESP_LOGI(g_tag_butt, "Short button pressed period.");
                 if (g_button_cnfg.on_short_button_press_cb != NULL)
-                    (*g_button_cnfg.on_short_button_press_cb)();
+                    worker_post_call(g_button_cnfg.on_short_button_press_cb);
             }
             else if(button_pressed_period/1000.0 >= g_button_cnfg.short_button_press_period_ms &&
                     button_pressed_period/1000.0 <  g_button_cnfg.medium_button_press_period_ms)      // MEDIUM BUTTON PRESS
             {
-                ESP_LOGI(g_tag_butt, "Medium button pressed period.");
                 if (g_button_cnfg.on_medium_button_press_cb != NULL)
-                    (*g_button_cnfg.on_medium_button_press_cb)();
+                    worker_post_call(g_button_cnfg.on_medium_button_press_cb);
             }
             else if(button_pressed_period/1000.0 >= g_button_cnfg.medium_button_press_period_ms)      // LONG BUTTON PRESS
             {
-                ESP_LOGI(g_tag_butt, "Long button pressed period.");
                 if (g_button_cnfg.on_long_button_press_cb != NULL)
-                    (*g_button_cnfg.on_long_button_press_cb)();
+                    worker_post_call(g_button_cnfg.on_long_button_press_cb);
             }
         }
 
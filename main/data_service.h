@@ -0,0 +1,474 @@
+/*
+ * data_service.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_DATA_SERVICE_H_
+#define MAIN_DATA_SERVICE_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "host/ble_hs.h"
+#include "services/gap/ble_svc_gap.h"
+#include "esp_check_err.h"
+#include "white_list.h"
+#include "sample_history.h"
+#include "analysis_module.h"
+#include "uplink.h"
+#include "trace.h"
+#include "sdkconfig.h"
+
+// Description:
+// The data service lets a phone or a medic's handheld read the current state and the
+// history of subjects over one short connection. The gateway advertises it (connectable)
+// for DATA_ADV_DURATION_MS on demand (see main.c). On connection the gateway asks for
+// ATT MTU of DATA_SERVICE_MTU, for the longest data length and a short connection
+// interval, so a notification takes one link layer packet and several of them go in
+// one connection event. All multi-byte fields are big-endian.
+// State characteristic (read, notify), the read returns every subject that has
+// registered sensors, a notification carries one subject:
+//   subject (1 byte) | state (1 byte) | total score (1 byte) | params count (1 byte) |
+//   params, every one: channel (1 byte) | input (1 byte) | status (1 byte) |
+//                      score (1 byte) | value (4 bytes, fixed-point of the channel)
+// params are listed in order of the score table, only those that fit the ATT MTU.
+// Subscribers get the state once they subscribe and after every analysis.
+// History characteristic (write, notify), the client subscribes and writes a request:
+//   source (1 byte) | start (4 bytes)
+// then the history is streamed in notifications of the ATT MTU size, an empty one
+// ends the stream. Sources:
+//   HISTORY_SRC_SAMPLES - the RTC sample history of every subject, samples measured
+//     from start (RTC time, s), every sample is: subject (1 byte) | channel (1 byte) |
+//     source index (1 byte) | value (2 bytes) | timestamp (4 bytes, s)
+//   HISTORY_SRC_LOG - the uplink log in flash from sequence number start, every
+//     notification is an uplink batch (see uplink.h), needs ATT MTU of 27 at least
+// Up to DATA_HISTORY_IN_FLIGHT notifications are queued at once, the next one is
+// queued when one of them is sent (BLE_GAP_EVENT_NOTIFY_TX).
+
+#define DATA_ADV_DURATION_MS        CONFIG_AM_DATA_SERVICE_ADV_MS   // duration of connectable advertising
+#define DATA_ADV_ITVL               0x00A0  // 100 ms (in 0.625 ms units)
+#define DATA_ADV_INSTANCE           0       // extended advertising instance, the alert never runs with GATT server
+#define DATA_ADV_DATA_MAX_SIZE      31      // max size of legacy advert data
+
+#define DATA_SERVICE_MTU            247     // preferred ATT MTU, one notification fits one LL packet
+#define DATA_SERVICE_TX_OCTETS      251     // max LL payload (data length extension)
+#define DATA_SERVICE_TX_TIME        2120    // time of max LL payload on 1M PHY, in us
+#define DATA_SERVICE_CONN_ITVL      0x0006  // 7.5 ms (in 1.25 ms units)
+#define DATA_SERVICE_SUPERV_TMO     400     // 4 s (in 10 ms units)
+
+#define DATA_STATE_HDR_SIZE         4       // subject, state, total score, params count
+#define DATA_STATE_PARAM_SIZE       8       // channel, input, status, score, value
+#define DATA_STATE_MAX_LEN          512     // max length of attribute value
+#define DATA_HISTORY_REQ_SIZE       5       // source, start
+#define DATA_HISTORY_SAMPLE_SIZE    9       // subject, channel, source index, value, timestamp
+#define DATA_HISTORY_IN_FLIGHT      4       // max number of queued notifications
+#define DATA_ATT_ERR_CCCD_IMPROPER  0xFD    // client characteristic configuration descriptor improperly configured
+
+// enum of history sources
+typedef enum {
+    HISTORY_SRC_SAMPLES = 0,    // RTC sample history
+    HISTORY_SRC_LOG = 1         // uplink log in flash
+} history_src_t;
+
+// struct that describes streaming of the history
+typedef struct {
+    bool is_active;         // flag to indicate whether the history is being streamed
+    uint8_t source;         // source of the history (history_src_t)
+    uint32_t start;         // start of the history, RTC time or sequence number
+    uint32_t next_seq;      // sequence number of the next log record
+    uint8_t subject_id;     // subject of the next sample
+    uint8_t channel;        // channel of the next sample
+    uint8_t index;          // index of the next sample, from the oldest one
+    uint8_t in_flight;      // number of queued notifications
+    uint16_t chunks_cnt;    // number of sent notifications
+} history_stream_t;
+
+
+esp_err_t data_service_adv_start(uint8_t own_addr_type, ble_gap_event_fn* gap_event_cb);
+uint8_t form_data_adv_data(uint8_t* dest_buff, uint8_t dest_buff_len);
+void data_service_on_connect(uint16_t conn_handle);
+void data_service_on_disconnect(uint16_t conn_handle);
+void data_service_on_subscribe(const struct ble_gap_event* event);
+void data_service_on_notify_tx(const struct ble_gap_event* event);
+void data_service_notify_state(uint8_t subject_id);
+size_t data_service_serialize_state(uint8_t* dest_buff, size_t dest_buff_len);
+size_t serialize_subject_state(uint8_t subject_id, uint8_t* dest_buff, size_t dest_buff_len);
+int data_service_start_history(uint16_t conn_handle, const uint8_t* request, size_t request_len);
+void data_service_pump_history();
+size_t form_history_chunk(uint8_t* dest_buff, size_t dest_buff_len, history_stream_t* stream);
+size_t form_samples_chunk(uint8_t* dest_buff, size_t dest_buff_len, history_stream_t* stream);
+
+
+const char* g_tag_data = "DATA";    // tag used in ESP_CHECK
+
+uint16_t data_state_val_handle;     // handle of the state characteristic value, set by nimble
+uint16_t data_history_val_handle;   // handle of the history characteristic value, set by nimble
+
+uint16_t data_conn_handle = BLE_HS_CONN_HANDLE_NONE;   // connection of the data client
+bool data_state_is_subscribed = false;      // flag to indicate whether the client is notified of the state
+bool data_history_is_subscribed = false;    // flag to indicate whether the client is notified of the history
+history_stream_t history_stream = {};       // current streaming of the history
+
+
+// starts connectable advertising of the data service for DATA_ADV_DURATION_MS,
+// gap_event_cb gets events of the connection
+esp_err_t data_service_adv_start(uint8_t own_addr_type, ble_gap_event_fn* gap_event_cb)
+{
+    uint8_t adv_data[DATA_ADV_DATA_MAX_SIZE];
+    uint8_t adv_data_len = form_data_adv_data(adv_data, sizeof(adv_data));
+
+    int rc;
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    struct ble_gap_ext_adv_params adv_params = {0};
+    adv_params.connectable = 1;
+    adv_params.scannable = 1;
+    adv_params.legacy_pdu = 1;          // phones of any BLE version find the gateway
+    adv_params.own_addr_type = own_addr_type;
+    adv_params.primary_phy = BLE_HCI_LE_PHY_1M;
+    adv_params.secondary_phy = BLE_HCI_LE_PHY_1M;
+    adv_params.itvl_min = DATA_ADV_ITVL;
+    adv_params.itvl_max = DATA_ADV_ITVL;
+
+    rc = ble_gap_ext_adv_configure(DATA_ADV_INSTANCE, &adv_params, NULL, gap_event_cb, NULL);
+    if (rc == 0)
+    {
+        struct os_mbuf* om = ble_hs_mbuf_from_flat(adv_data, adv_data_len);
+        rc = om != NULL ? ble_gap_ext_adv_set_data(DATA_ADV_INSTANCE, om) : BLE_HS_ENOMEM;
+    }
+    if (rc == 0)
+        rc = ble_gap_ext_adv_start(DATA_ADV_INSTANCE, DATA_ADV_DURATION_MS / 10, 0);   // duration in 10 ms units
+#else
+    struct ble_gap_adv_params adv_params = {0};
+    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;   // any client may connect
+    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+    adv_params.itvl_min = DATA_ADV_ITVL;
+    adv_params.itvl_max = DATA_ADV_ITVL;
+
+    rc = ble_gap_adv_set_data(adv_data, adv_data_len);
+    if (rc == 0)
+        rc = ble_gap_adv_start(own_addr_type, NULL, DATA_ADV_DURATION_MS, &adv_params, gap_event_cb, NULL);
+#endif
+    if (rc != 0 && rc != BLE_HS_EALREADY)
+    {
+        TRACE_E(TRACE_DATA_FAIL, 0, rc);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(g_tag_data, "Advertising data service for %d s.", DATA_ADV_DURATION_MS / 1000);
+    return ESP_OK;
+}
+
+
+// forms advert data of the data service: flags and complete name of the device
+// returns length of the data
+uint8_t form_data_adv_data(uint8_t* dest_buff, uint8_t dest_buff_len)
+{
+    const char* name = ble_svc_gap_device_name();
+    uint8_t name_len = strlen(name);
+    if (name_len > dest_buff_len - 5)
+        name_len = dest_buff_len - 5;
+
+    uint8_t len = 0;
+    dest_buff[len++] = 2;   // flags, length and type
+    dest_buff[len++] = BLE_HS_ADV_TYPE_FLAGS;
+    dest_buff[len++] = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+    dest_buff[len++] = 1 + name_len;    // complete name, length and type
+    dest_buff[len++] = BLE_HS_ADV_TYPE_COMP_NAME;
+    memcpy(dest_buff + len, name, name_len);
+    len += name_len;
+
+    return len;
+}
+
+
+// prepares new connection of the data client for bulk transfer: asks for larger
+// ATT MTU, data length and short connection interval
+void data_service_on_connect(uint16_t conn_handle)
+{
+    data_conn_handle = conn_handle;
+    data_state_is_subscribed = false;
+    data_history_is_subscribed = false;
+    history_stream.is_active = false;
+    TRACE_I(TRACE_DATA_CONNECT, conn_handle, 0);
+
+    int rc = ble_gattc_exchange_mtu(conn_handle, NULL, NULL);
+    if (rc != 0)
+        TRACE_E(TRACE_DATA_FAIL, 1, rc);
+
+    rc = ble_gap_set_data_len(conn_handle, DATA_SERVICE_TX_OCTETS, DATA_SERVICE_TX_TIME);
+    if (rc != 0)
+        TRACE_E(TRACE_DATA_FAIL, 2, rc);
+
+    struct ble_gap_upd_params conn_params = {
+            .itvl_min = DATA_SERVICE_CONN_ITVL,
+            .itvl_max = DATA_SERVICE_CONN_ITVL,
+            .latency = 0,
+            .supervision_timeout = DATA_SERVICE_SUPERV_TMO
+    };
+    rc = ble_gap_update_params(conn_handle, &conn_params);
+    if (rc != 0)
+        TRACE_E(TRACE_DATA_FAIL, 3, rc);
+}
+
+
+// forgets the data client, its streaming is stopped
+void data_service_on_disconnect(uint16_t conn_handle)
+{
+    if (conn_handle != data_conn_handle)
+        return;
+
+    if (history_stream.is_active)
+        TRACE_E(TRACE_DATA_FAIL, 4, history_stream.chunks_cnt);
+
+    data_conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    data_state_is_subscribed = false;
+    data_history_is_subscribed = false;
+    history_stream.is_active = false;
+}
+
+
+// tracks subscriptions of the data client, a new state subscriber
+// gets the current state of every subject at once
+void data_service_on_subscribe(const struct ble_gap_event* event)
+{
+    if (event->subscribe.conn_handle != data_conn_handle)
+        return;
+
+    if (event->subscribe.attr_handle == data_history_val_handle)
+    {
+        data_history_is_subscribed = event->subscribe.cur_notify;
+        if (!data_history_is_subscribed)
+            history_stream.is_active = false;
+    }
+    else if (event->subscribe.attr_handle == data_state_val_handle)
+    {
+        data_state_is_subscribed = event->subscribe.cur_notify;
+        if (data_state_is_subscribed)
+            for (uint8_t subject_id = 0; subject_id < MAX_SUBJECTS; subject_id++)
+                data_service_notify_state(subject_id);
+    }
+}
+
+
+// continues streaming of the history, when its notification is sent
+void data_service_on_notify_tx(const struct ble_gap_event* event)
+{
+    if (event->notify_tx.conn_handle != data_conn_handle || event->notify_tx.attr_handle != data_history_val_handle)
+        return;
+
+    if (history_stream.in_flight > 0)
+        history_stream.in_flight--;
+    data_service_pump_history();
+}
+
+
+// notifies the subscribed client of the state of given subject
+void data_service_notify_state(uint8_t subject_id)
+{
+    if (data_conn_handle == BLE_HS_CONN_HANDLE_NONE || !data_state_is_subscribed ||
+        get_subject_sensors_cnt(subject_id) == 0)
+        return;
+
+    uint8_t state_buff[DATA_SERVICE_MTU - 3];
+    size_t max_len = ble_att_mtu(data_conn_handle) - 3;
+    size_t state_len = serialize_subject_state(subject_id, state_buff,
+                                               max_len < sizeof(state_buff) ? max_len : sizeof(state_buff));
+    if (state_len == 0)
+        return;
+
+    struct os_mbuf* om = ble_hs_mbuf_from_flat(state_buff, state_len);
+    int rc = om != NULL ? ble_gatts_notify_custom(data_conn_handle, data_state_val_handle, om) : BLE_HS_ENOMEM;
+    if (rc != 0)
+        TRACE_E(TRACE_DATA_FAIL, 5, rc);
+}
+
+
+// serializes state of every subject with registered sensors, as many subjects
+// as fit into the buffer, returns length of the serialized state
+size_t data_service_serialize_state(uint8_t* dest_buff, size_t dest_buff_len)
+{
+    size_t len = 0;
+    for (uint8_t subject_id = 0; subject_id < MAX_SUBJECTS; subject_id++)
+    {
+        if (get_subject_sensors_cnt(subject_id) == 0)
+            continue;
+
+        // every subject is sent whole
+        if (dest_buff_len - len < DATA_STATE_HDR_SIZE + SCORE_PARAMS_CNT * DATA_STATE_PARAM_SIZE)
+            break;
+        len += serialize_subject_state(subject_id, dest_buff + len, dest_buff_len - len);
+    }
+
+    return len;
+}
+
+
+// serializes state of given subject by the result of its last analysis,
+// the params that do not fit into the buffer are left out
+// returns length of the serialized state, 0 if even the header does not fit
+size_t serialize_subject_state(uint8_t subject_id, uint8_t* dest_buff, size_t dest_buff_len)
+{
+    analysis_result_t result;
+    if (dest_buff_len < DATA_STATE_HDR_SIZE || get_subject_result(subject_id, &result) != ESP_OK)
+        return 0;
+
+    size_t len = DATA_STATE_HDR_SIZE;
+    uint8_t params_cnt = 0;
+    for (uint8_t i = 0; i < SCORE_PARAMS_CNT && len + DATA_STATE_PARAM_SIZE <= dest_buff_len; i++)
+    {
+        // the value is the input of the parameter right now, 0 if it is unknown
+        int32_t value = 0;
+        sample_t latest;
+        if (get_latest_sample(subject_id, score_table[i].channel, &latest) != ESP_OK ||
+            get_param_input(subject_id, &score_table[i], &latest, &value) != ESP_OK)
+            value = 0;
+
+        dest_buff[len++] = score_table[i].channel;
+        dest_buff[len++] = score_table[i].input;
+        dest_buff[len++] = result.statuses[i];
+        dest_buff[len++] = result.scores[i];
+        PUT_BE32(dest_buff + len, value);
+        len += 4;
+        params_cnt++;
+    }
+
+    dest_buff[0] = subject_id;
+    dest_buff[1] = (uint8_t)result.state;
+    dest_buff[2] = result.total_score;
+    dest_buff[3] = params_cnt;
+    return len;
+}
+
+
+// starts streaming of the history by the request of the client
+// returns 0 or ATT error code
+int data_service_start_history(uint16_t conn_handle, const uint8_t* request, size_t request_len)
+{
+    if (request_len != DATA_HISTORY_REQ_SIZE)
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+    if (conn_handle != data_conn_handle || !data_history_is_subscribed)
+        return DATA_ATT_ERR_CCCD_IMPROPER;
+
+    uint8_t source = request[0];
+#ifdef CONFIG_AM_UPLINK
+    if (source != HISTORY_SRC_SAMPLES && source != HISTORY_SRC_LOG)
+#else
+    if (source != HISTORY_SRC_SAMPLES)
+#endif
+        return BLE_ATT_ERR_REQ_NOT_SUPPORTED;
+
+    if (history_stream.is_active)   // one streaming at a time
+        return BLE_ATT_ERR_UNLIKELY;
+
+    // the previous stream may have queued notifications yet,
+    // they are counted until they are sent
+    uint8_t in_flight = history_stream.in_flight;
+    history_stream = (history_stream_t){
+            .is_active = true,
+            .source = source,
+            .start = GET_BE32(request + 1),
+            .in_flight = in_flight
+    };
+#ifdef CONFIG_AM_UPLINK
+    if (source == HISTORY_SRC_LOG)  // records before the first one are dropped
+        history_stream.next_seq = history_stream.start > uplink_log_get_first_seq() ?
+                                  history_stream.start : uplink_log_get_first_seq();
+#endif
+    TRACE_I(TRACE_DATA_HISTORY, source, history_stream.start);
+
+    data_service_pump_history();
+    return 0;
+}
+
+
+// queues notifications of the history, until DATA_HISTORY_IN_FLIGHT
+// are queued or the history is over
+void data_service_pump_history()
+{
+    while (history_stream.is_active && history_stream.in_flight < DATA_HISTORY_IN_FLIGHT)
+    {
+        uint8_t chunk[DATA_SERVICE_MTU - 3];
+        size_t max_len = ble_att_mtu(data_conn_handle) - 3;
+
+        // the stream advances only when the notification is queued
+        history_stream_t next_stream = history_stream;
+        size_t chunk_len = form_history_chunk(chunk, max_len < sizeof(chunk) ? max_len : sizeof(chunk), &next_stream);
+
+        struct os_mbuf* om = ble_hs_mbuf_from_flat(chunk, chunk_len);
+        int rc = om != NULL ? ble_gatts_notify_custom(data_conn_handle, data_history_val_handle, om) : BLE_HS_ENOMEM;
+        if (rc != 0)
+        {
+            // no buffers, the stream continues when a queued notification
+            // is sent, and fails if none is queued
+            if (history_stream.in_flight == 0)
+            {
+                TRACE_E(TRACE_DATA_FAIL, 6, rc);
+                history_stream.is_active = false;
+            }
+            return;
+        }
+
+        history_stream = next_stream;
+        history_stream.in_flight++;
+        history_stream.chunks_cnt++;
+        if (chunk_len == 0)     // the empty notification ends the stream
+        {
+            history_stream.is_active = false;
+            TRACE_I(TRACE_DATA_HISTORY_END, history_stream.source, history_stream.chunks_cnt);
+        }
+    }
+}
+
+
+// forms the next notification of the history, the stream is advanced past it
+// returns length of the notification, 0 if the history is over
+size_t form_history_chunk(uint8_t* dest_buff, size_t dest_buff_len, history_stream_t* stream)
+{
+#ifdef CONFIG_AM_UPLINK
+    if (stream->source == HISTORY_SRC_LOG)
+        return uplink_encode_batch(dest_buff, dest_buff_len, stream->next_seq, &stream->next_seq);
+#endif
+
+    return form_samples_chunk(dest_buff, dest_buff_len, stream);
+}
+
+
+// forms the next notification of the RTC sample history: samples of every subject
+// and channel from the oldest one, measured not before the start of the stream
+// returns length of the notification, 0 if no sample is left
+size_t form_samples_chunk(uint8_t* dest_buff, size_t dest_buff_len, history_stream_t* stream)
+{
+    size_t len = 0;
+    for (; stream->subject_id < MAX_SUBJECTS; stream->subject_id++, stream->channel = 0)
+        for (; stream->channel < CHANNEL_CNT; stream->channel++, stream->index = 0)
+        {
+            uint8_t samples_cnt = get_samples_cnt(stream->subject_id, stream->channel);
+            for (; stream->index < samples_cnt; stream->index++)
+            {
+                if (len + DATA_HISTORY_SAMPLE_SIZE > dest_buff_len)
+                    return len;
+
+                sample_t sample;
+                if (get_sample(stream->subject_id, stream->channel, samples_cnt - 1 - stream->index, &sample) != ESP_OK ||
+                    sample.timestamp < stream->start)
+                    continue;
+
+                dest_buff[len++] = stream->subject_id;
+                dest_buff[len++] = stream->channel;
+                dest_buff[len++] = sample.src_index;
+                PUT_BE16(dest_buff + len, sample.value);
+                len += 2;
+                PUT_BE32(dest_buff + len, sample.timestamp);
+                len += 4;
+            }
+        }
+
+    return len;
+}
+
+
+#endif /* MAIN_DATA_SERVICE_H_ */
@@ -0,0 +1,323 @@
+/*
+ * energy.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_ENERGY_H_
+#define MAIN_ENERGY_H_
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "sys/time.h"
+#include "esp_check_err.h"
+#include "trace.h"
+#include "sdkconfig.h"
+#ifdef CONFIG_AM_BATTERY_ADC
+#include "esp_adc/adc_oneshot.h"
+#include "esp_adc/adc_cali.h"
+#include "esp_adc/adc_cali_scheme.h"
+#endif
+
+// Description:
+// The energy accounting estimates the charge of every wake cycle from the time
+// the gateway spends in every power state, so the effect of a scheduler or scan
+// change is seen in numbers reported by the device itself. A cycle consists of
+// the deep sleep before it and of the awake time till the next sleep, which is
+// split into:
+//   scan - radio is receiving, scan time weighted by the scan duty (window / interval)
+//   conn - a connection is open (average current of a connection)
+//   cpu  - the rest of the awake time, radio is off
+// Radio activities are opened with energy_radio_begin() and closed with
+// energy_radio_end(), the sleep time is measured with the RTC clock, which keeps
+// counting in deep sleep, and energy_commit_cycle() must be called right before
+// going to sleep. The charge is a sum of times multiplied by current coefficients
+// (set in Kconfig) in uAs. The last cycle and the totals since power-on are stored
+// in RTC memory, so they persist across deep sleep cycles.
+// A cycle woken from light sleep (see power_mode.h) is opened by energy_begin_cycle(),
+// its sleep is counted as light sleep, with the BLE stack resident and the main
+// crystal on, and its awake time lasts from the wake, not from reset. Light sleep
+// left for deep sleep without a cycle is added by energy_commit_light_sleep().
+// Battery level is measured by ADC on a voltage divider (CONFIG_AM_BATTERY_ADC),
+// without it the level is estimated from the charge consumed since power-on and
+// the battery capacity, as a battery is normally inserted full.
+// Both are read over BLE, the level from the standard Battery Service and the
+// numbers from the custom energy characteristic, see energy_serialize().
+
+#define ENERGY_SCAN_UA      CONFIG_AM_ENERGY_SCAN_UA    // current while scan window is open, in uA
+#define ENERGY_CONN_UA      CONFIG_AM_ENERGY_CONN_UA    // average current while connected, in uA
+#define ENERGY_CPU_UA       CONFIG_AM_ENERGY_CPU_UA     // current while awake and radio is off, in uA
+#define ENERGY_SLEEP_UA     CONFIG_AM_ENERGY_SLEEP_UA   // current in deep sleep, in uA
+#define ENERGY_LIGHT_SLEEP_UA   CONFIG_AM_ENERGY_LIGHT_SLEEP_UA // current in light sleep with resident BLE stack, in uA
+#define BATTERY_CAPACITY_MAH    CONFIG_AM_BATTERY_CAPACITY_MAH  // capacity of the battery
+#define ENERGY_CHR_SIZE     (8 * sizeof(uint32_t) + 1)  // size of serialized energy numbers
+#define ENERGY_FULL_DUTY    1000    // duty of continuous radio activity, in permille
+
+// enum of accounted radio activities
+typedef enum {
+    RADIO_SCAN = 0,     // scanning
+    RADIO_CONN,         // connection
+    RADIO_ACTIVITY_CNT
+} radio_activity_t;
+
+// struct that describes time and charge of one wake cycle
+typedef struct {
+    uint32_t scan_us;       // radio on time of scanning, weighted by scan duty
+    uint32_t conn_us;       // time of connections
+    uint32_t cpu_us;        // awake time without radio activities
+    uint32_t sleep_us;      // deep sleep before the cycle
+    uint32_t light_sleep_us;    // light sleep before the cycle
+    uint32_t charge_uas;    // estimated charge of the cycle, in uAs
+} energy_cycle_t;
+
+
+void energy_init();
+void energy_begin_cycle();
+void energy_commit_light_sleep();
+void energy_radio_begin(radio_activity_t activity, uint16_t duty_permille);
+void energy_radio_end(radio_activity_t activity);
+void energy_commit_cycle();
+int64_t energy_get_rtc_time_us();
+uint32_t energy_get_charge_uas(const energy_cycle_t* cycle);
+uint32_t energy_get_total_uah();
+uint8_t energy_get_battery_level();
+esp_err_t energy_read_battery_mv(uint32_t* battery_mv);
+size_t energy_serialize(uint8_t* dest_buff, size_t dest_buff_len);
+
+
+const char* g_tag_energy = "ENERGY";    // tag used in ESP_CHECK
+energy_cycle_t energy_cur_cycle = {};   // times of the current cycle
+int64_t radio_begin_time[RADIO_ACTIVITY_CNT];           // begin timestamps of open activities
+uint16_t radio_duty[RADIO_ACTIVITY_CNT];                // duty of open activities, in permille
+bool radio_is_on[RADIO_ACTIVITY_CNT] = {};              // flags of open activities
+int64_t energy_cycle_start_us = 0;                      // start of the awake time, 0 - reset
+
+// numbers of the last cycle and since power-on, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR energy_cycle_t energy_last_cycle = {};
+RTC_DATA_ATTR uint64_t energy_total_uas = 0;    // charge of all cycles since power-on
+RTC_DATA_ATTR uint32_t energy_cycles_cnt = 0;   // number of committed cycles since power-on
+RTC_DATA_ATTR int64_t energy_sleep_start_us = 0;    // RTC time of the last sleep start, 0 if unknown
+
+
+// inits energy accounting, takes the sleep before this
+// cycle, must be called at the very beginning of app_main
+void energy_init()
+{
+    if (esp_reset_reason() == ESP_RST_DEEPSLEEP && energy_sleep_start_us != 0)
+    {
+        int64_t sleep_us = energy_get_rtc_time_us() - energy_sleep_start_us - esp_timer_get_time();
+        energy_cur_cycle.sleep_us = sleep_us > 0 ? (sleep_us > UINT32_MAX ? UINT32_MAX : sleep_us) : 0;
+    }
+    energy_sleep_start_us = 0;
+}
+
+
+// opens a cycle woken from light sleep, takes the light sleep before it
+void energy_begin_cycle()
+{
+    memset(&energy_cur_cycle, 0, sizeof(energy_cur_cycle));
+    if (energy_sleep_start_us != 0)
+    {
+        int64_t sleep_us = energy_get_rtc_time_us() - energy_sleep_start_us;
+        energy_cur_cycle.light_sleep_us = sleep_us > 0 ? (sleep_us > UINT32_MAX ? UINT32_MAX : sleep_us) : 0;
+    }
+    energy_sleep_start_us = 0;
+    energy_cycle_start_us = esp_timer_get_time();
+}
+
+
+// adds the light sleep since the last commit to the totals, when light sleep is
+// left without a cycle (e.g. for deep sleep), the next cycle takes the sleep after it
+void energy_commit_light_sleep()
+{
+    if (energy_sleep_start_us == 0)
+        return;
+
+    int64_t now_us = energy_get_rtc_time_us();
+    int64_t sleep_us = now_us - energy_sleep_start_us;
+    energy_cycle_t sleep_cycle = {};
+    sleep_cycle.light_sleep_us = sleep_us > 0 ? (sleep_us > UINT32_MAX ? UINT32_MAX : sleep_us) : 0;
+    energy_total_uas += energy_get_charge_uas(&sleep_cycle);
+    energy_sleep_start_us = now_us;
+}
+
+
+// opens radio activity, duty_permille is the part of time the
+// radio is on (e.g. scan window / scan interval)
+void energy_radio_begin(radio_activity_t activity, uint16_t duty_permille)
+{
+    if (activity >= RADIO_ACTIVITY_CNT || radio_is_on[activity])
+        return;
+
+    radio_begin_time[activity] = esp_timer_get_time();
+    radio_duty[activity] = duty_permille > ENERGY_FULL_DUTY ? ENERGY_FULL_DUTY : duty_permille;
+    radio_is_on[activity] = true;
+}
+
+
+// closes radio activity and adds its time to the current cycle,
+// closing of activity that is not open is ignored
+void energy_radio_end(radio_activity_t activity)
+{
+    if (activity >= RADIO_ACTIVITY_CNT || !radio_is_on[activity])
+        return;
+
+    uint32_t duration_us = esp_timer_get_time() - radio_begin_time[activity];
+    uint32_t radio_on_us = (uint64_t)duration_us * radio_duty[activity] / ENERGY_FULL_DUTY;
+    if (activity == RADIO_SCAN)
+        energy_cur_cycle.scan_us += radio_on_us;
+    else
+        energy_cur_cycle.conn_us += radio_on_us;
+    radio_is_on[activity] = false;
+}
+
+
+// estimates charge of the current cycle and adds it to the totals, the
+// sleep start is remembered, so it must be called right before going to sleep
+void energy_commit_cycle()
+{
+    for (uint8_t i = 0; i < RADIO_ACTIVITY_CNT; i++)
+        energy_radio_end(i);
+
+    // the cycle is awake from reset (or wake) till now
+    uint32_t awake_us = esp_timer_get_time() - energy_cycle_start_us;
+    uint32_t radio_us = energy_cur_cycle.scan_us + energy_cur_cycle.conn_us;
+    energy_cur_cycle.cpu_us = awake_us > radio_us ? awake_us - radio_us : 0;
+    energy_cur_cycle.charge_uas = energy_get_charge_uas(&energy_cur_cycle);
+
+    energy_last_cycle = energy_cur_cycle;
+    energy_total_uas += energy_cur_cycle.charge_uas;
+    energy_cycles_cnt++;
+    TRACE_I(TRACE_ENERGY_CYCLE, energy_cur_cycle.charge_uas, energy_get_total_uah());
+
+    energy_sleep_start_us = energy_get_rtc_time_us();
+}
+
+
+// gets time of the RTC clock, which keeps counting in deep sleep, in us
+int64_t energy_get_rtc_time_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+// estimates charge of a cycle from its times and current coefficients
+// returns charge in uAs
+uint32_t energy_get_charge_uas(const energy_cycle_t* cycle)
+{
+    uint64_t charge = (uint64_t)cycle->scan_us * ENERGY_SCAN_UA + (uint64_t)cycle->conn_us * ENERGY_CONN_UA +
+                      (uint64_t)cycle->cpu_us * ENERGY_CPU_UA + (uint64_t)cycle->sleep_us * ENERGY_SLEEP_UA +
+                      (uint64_t)cycle->light_sleep_us * ENERGY_LIGHT_SLEEP_UA;
+    charge /= 1000000;
+    return charge > UINT32_MAX ? UINT32_MAX : charge;
+}
+
+
+// gets charge of all cycles since power-on, in uAh
+uint32_t energy_get_total_uah()
+{
+    return energy_total_uas / 3600;
+}
+
+
+// gets battery level in %, measured by ADC or estimated
+// from the charge consumed since power-on
+uint8_t energy_get_battery_level()
+{
+#ifdef CONFIG_AM_BATTERY_ADC
+    uint32_t battery_mv;
+    if (energy_read_battery_mv(&battery_mv) == ESP_OK)
+    {
+        if (battery_mv <= CONFIG_AM_BATTERY_EMPTY_MV)
+            return 0;
+        if (battery_mv >= CONFIG_AM_BATTERY_FULL_MV)
+            return 100;
+        return (battery_mv - CONFIG_AM_BATTERY_EMPTY_MV) * 100 / (CONFIG_AM_BATTERY_FULL_MV - CONFIG_AM_BATTERY_EMPTY_MV);
+    }
+#endif
+
+    uint32_t consumed_uah = energy_get_total_uah();
+    uint32_t capacity_uah = (uint32_t)BATTERY_CAPACITY_MAH * 1000;
+    if (consumed_uah >= capacity_uah)
+        return 0;
+    return 100 - (uint64_t)consumed_uah * 100 / capacity_uah;
+}
+
+
+// measures battery voltage by ADC on the voltage divider, in mV
+esp_err_t energy_read_battery_mv(uint32_t* battery_mv)
+{
+#ifdef CONFIG_AM_BATTERY_ADC
+    adc_oneshot_unit_handle_t adc_unit;
+    adc_oneshot_unit_init_cfg_t unit_cfg = {.unit_id = ADC_UNIT_1};
+    if (adc_oneshot_new_unit(&unit_cfg, &adc_unit) != ESP_OK)
+        return ESP_FAIL;
+
+    int raw = 0;
+    int adc_mv = 0;
+    adc_oneshot_chan_cfg_t chan_cfg = {.atten = ADC_ATTEN_DB_11, .bitwidth = ADC_BITWIDTH_DEFAULT};
+    esp_err_t err = adc_oneshot_config_channel(adc_unit, CONFIG_AM_BATTERY_ADC_CHANNEL, &chan_cfg);
+    if (err == ESP_OK)
+        err = adc_oneshot_read(adc_unit, CONFIG_AM_BATTERY_ADC_CHANNEL, &raw);
+
+    // raw value is converted by the calibration of the chip
+    adc_cali_handle_t adc_cali;
+    adc_cali_curve_fitting_config_t cali_cfg = {
+            .unit_id = ADC_UNIT_1,
+            .atten = ADC_ATTEN_DB_11,
+            .bitwidth = ADC_BITWIDTH_DEFAULT
+    };
+    if (err == ESP_OK)
+        err = adc_cali_create_scheme_curve_fitting(&cali_cfg, &adc_cali);
+    if (err == ESP_OK)
+    {
+        err = adc_cali_raw_to_voltage(adc_cali, raw, &adc_mv);
+        adc_cali_delete_scheme_curve_fitting(adc_cali);
+    }
+    adc_oneshot_del_unit(adc_unit);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(g_tag_energy, "Battery measurement failed! Error: %d", err);
+        return ESP_FAIL;
+    }
+    *battery_mv = (uint32_t)adc_mv * CONFIG_AM_BATTERY_DIVIDER;
+    return ESP_OK;
+#else
+    return ESP_FAIL;
+#endif
+}
+
+
+// writes numbers of the last cycle (scan, conn, cpu, sleep us, charge uAs), number of
+// cycles and charge since power-on (uAh), light sleep of the last cycle (us) as
+// little-endian uint32 values, and battery level
+// returns number of written bytes
+size_t energy_serialize(uint8_t* dest_buff, size_t dest_buff_len)
+{
+    if (dest_buff == NULL || dest_buff_len < ENERGY_CHR_SIZE)
+        return 0;
+
+    uint32_t values[] = {energy_last_cycle.scan_us, energy_last_cycle.conn_us, energy_last_cycle.cpu_us,
+                         energy_last_cycle.sleep_us, energy_last_cycle.charge_uas, energy_cycles_cnt,
+                         energy_get_total_uah(), energy_last_cycle.light_sleep_us};
+    size_t len = 0;
+    for (uint8_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        for (uint8_t k = 0; k < sizeof(uint32_t); k++)
+            dest_buff[len++] = (values[i] >> (8 * k)) & 0xFF;
+    dest_buff[len++] = energy_get_battery_level();
+
+    return len;
+}
+
+
+#endif /* MAIN_ENERGY_H_ */
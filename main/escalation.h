@@ -0,0 +1,234 @@
+/*
+ * escalation.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_ESCALATION_H_
+#define MAIN_ESCALATION_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "host/ble_hs.h"
+#include "esp_check_err.h"
+#include "app_packet.h"
+#include "analysis_module.h"
+#include "profiler.h"
+#include "trace.h"
+#include "sdkconfig.h"
+
+// Description:
+// The escalation is the low-latency path of a critical state. Every data packet is
+// analysed right after it is received (see main.c), so a state of ESCALATION_STATE
+// or worse raises the alert without waiting for the end of the scan. The alert is a
+// non-connectable advert with ALERT_HEADER packet (see app_packet.h), so any receiver
+// in range gets it without a connection. The payload of the packet is:
+//   subject (1 byte) | state (1 byte) | total score (1 byte) | round (1 byte) |
+//   latency (2 bytes, big-endian, ms)
+// While the alert is raised, the gateway does not go to sleep, it scans at full duty
+// cycle in rounds of ESCALATION_ROUND_MS instead. Every round has to confirm the
+// state, every confirming sample updates the advert. The first round that does not
+// confirm the state clears the alert and the gateway returns to its sleep cycles.
+// The latency is measured from the receipt of the advert that made the state
+// critical to the start of alert advertising. It is traced, recorded by the profiler
+// (PHASE_ALERT) and sent in the alert (as measured when the alert data is formed).
+
+#define ESCALATION_ROUND_MS     CONFIG_AM_ESCALATION_ROUND_MS   // duration of one confirmation round
+#ifdef CONFIG_AM_ESCALATE_ON_CRITICAL
+#define ESCALATION_STATE        CRITICAL        // state from which the alert is raised
+#else
+#define ESCALATION_STATE        VERY_CRITICAL   // state from which the alert is raised
+#endif
+
+#define ALERT_ADV_ITVL          0x0020  // 20 ms (in 0.625 ms units), minimum of connectionless advert
+#define ALERT_ADV_INSTANCE      0       // extended advertising instance of the alert
+#define ALERT_PAYLOAD_SIZE      6       // subject, state, total score, round, latency
+#define ALERT_ADV_DATA_SIZE     (3 + 2 + HEADER_SIZE + ALERT_PAYLOAD_SIZE)  // flags, mfg data header, packet
+
+// struct that describes raised alert
+typedef struct {
+    uint8_t subject_id;     // subject in the most critical state
+    int8_t state;           // state of the subject (liferate_t)
+    uint8_t total_score;    // total score of the subject
+    uint8_t round;          // number of confirmation rounds
+    uint32_t latency_us;    // latency of the alert
+} alert_t;
+
+
+esp_err_t escalation_raise_alert(uint8_t own_addr_type, uint8_t subject_id, const analysis_result_t* result, int64_t adv_time_us);
+esp_err_t escalation_start_round(liferate_t state);
+esp_err_t escalation_clear_alert();
+bool escalation_is_active();
+uint8_t form_alert_adv_data(uint8_t* dest_buff, const alert_t* alert);
+int alert_adv_start(uint8_t own_addr_type, const uint8_t* data, uint8_t data_len);
+int alert_adv_update(const uint8_t* data, uint8_t data_len);
+int alert_adv_stop();
+
+
+const char* g_tag_esc = "ESC";  // tag used in ESP_CHECK
+
+bool alert_is_raised = false;   // flag to indicate whether the alert is advertised
+alert_t alert;                  // the raised alert
+
+
+// raises the alert for given subject, or updates the raised one
+// adv_time_us is the time the data advert was received at (esp_timer_get_time)
+esp_err_t escalation_raise_alert(uint8_t own_addr_type, uint8_t subject_id, const analysis_result_t* result, int64_t adv_time_us)
+{
+    if (result == NULL || result->state < ESCALATION_STATE)
+        return ESP_FAIL;
+
+    // the alert shows the most critical subject, other subjects may only confirm it
+    if (alert_is_raised && subject_id != alert.subject_id && result->state < alert.state)
+        return ESP_OK;
+
+    alert.subject_id = subject_id;
+    alert.state = result->state;
+    alert.total_score = result->total_score;
+    if (!alert_is_raised)
+        alert.latency_us = (uint32_t)(esp_timer_get_time() - adv_time_us);
+
+    uint8_t adv_data[ALERT_ADV_DATA_SIZE];
+    uint8_t adv_data_len = form_alert_adv_data(adv_data, &alert);
+    if (alert_is_raised)
+        return alert_adv_update(adv_data, adv_data_len) == 0 ? ESP_OK : ESP_FAIL;
+
+    alert.round = 0;
+    int rc = alert_adv_start(own_addr_type, adv_data, adv_data_len);
+    if (rc != 0)
+        return ESP_FAIL;
+
+    // the alert is out, measure the latency once again
+    alert.latency_us = (uint32_t)(esp_timer_get_time() - adv_time_us);
+    alert_is_raised = true;
+    profiler_phase_record(PHASE_ALERT, alert.latency_us);
+    TRACE_I(TRACE_ALERT_RAISED, subject_id | (result->state << 8), alert.latency_us);
+    ESP_LOGW(g_tag_esc, "ALERT! Subject %u, score %u, latency %lu us.", subject_id, result->total_score,
+            (unsigned long)alert.latency_us);
+    return ESP_OK;
+}
+
+
+// counts the next confirmation round of the raised alert
+esp_err_t escalation_start_round(liferate_t state)
+{
+    if (!alert_is_raised)
+        return ESP_FAIL;
+
+    if (alert.round < UINT8_MAX)
+        alert.round++;
+    TRACE_I(TRACE_ESCALATION_ROUND, alert.round, state);
+    return ESP_OK;
+}
+
+
+// clears the alert, when it is not confirmed any more
+esp_err_t escalation_clear_alert()
+{
+    if (!alert_is_raised)
+        return ESP_FAIL;
+
+    alert_adv_stop();
+    alert_is_raised = false;
+    TRACE_I(TRACE_ALERT_CLEARED, alert.round, 0);
+    ESP_LOGI(g_tag_esc, "Alert is cleared after %u rounds.", alert.round);
+    return ESP_OK;
+}
+
+
+// checks if the alert is raised
+bool escalation_is_active()
+{
+    return alert_is_raised;
+}
+
+
+// forms advert data of the alert: flags and manufacturer specific data with
+// ALERT_HEADER packet, returns length of the data
+uint8_t form_alert_adv_data(uint8_t* dest_buff, const alert_t* alert)
+{
+    uint16_t latency_ms = alert->latency_us / 1000 > UINT16_MAX ? UINT16_MAX : alert->latency_us / 1000;
+    uint8_t payload[ALERT_PAYLOAD_SIZE] = {alert->subject_id, (uint8_t)alert->state, alert->total_score,
+                                           alert->round, latency_ms >> 8, latency_ms & 0xFF};
+
+    uint8_t len = 0;
+    dest_buff[len++] = 2;   // flags, length and type
+    dest_buff[len++] = BLE_HS_ADV_TYPE_FLAGS;
+    dest_buff[len++] = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+    dest_buff[len++] = 1 + HEADER_SIZE + ALERT_PAYLOAD_SIZE;  // manufacturer data, length and type
+    dest_buff[len++] = BLE_HS_ADV_TYPE_MFG_DATA;
+    form_packet(dest_buff + len, ALERT_HEADER, payload, sizeof(payload));
+    len += HEADER_SIZE + ALERT_PAYLOAD_SIZE;
+
+    return len;
+}
+
+
+// starts non-connectable advertising of the alert, returns nimble error code
+int alert_adv_start(uint8_t own_addr_type, const uint8_t* data, uint8_t data_len)
+{
+    int rc;
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    struct ble_gap_ext_adv_params adv_params = {0};
+    adv_params.legacy_pdu = 1;          // receivers of any BLE version get the alert
+    adv_params.own_addr_type = own_addr_type;
+    adv_params.primary_phy = BLE_HCI_LE_PHY_1M;
+    adv_params.secondary_phy = BLE_HCI_LE_PHY_1M;
+    adv_params.itvl_min = ALERT_ADV_ITVL;
+    adv_params.itvl_max = ALERT_ADV_ITVL;
+
+    rc = ble_gap_ext_adv_configure(ALERT_ADV_INSTANCE, &adv_params, NULL, NULL, NULL);
+    if (rc == 0)
+        rc = alert_adv_update(data, data_len);
+    if (rc == 0)
+        rc = ble_gap_ext_adv_start(ALERT_ADV_INSTANCE, 0, 0);
+#else
+    struct ble_gap_adv_params adv_params = {0};
+    adv_params.conn_mode = BLE_GAP_CONN_MODE_NON;   // alert needs no connection
+    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+    adv_params.itvl_min = ALERT_ADV_ITVL;
+    adv_params.itvl_max = ALERT_ADV_ITVL;
+
+    rc = alert_adv_update(data, data_len);
+    if (rc == 0)
+        rc = ble_gap_adv_start(own_addr_type, NULL, BLE_HS_FOREVER, &adv_params, NULL, NULL);
+#endif
+    if (rc != 0)
+        TRACE_E(TRACE_ALERT_FAIL, 0, rc);
+    return rc;
+}
+
+
+// sets advert data of the alert, may be called while advertising
+int alert_adv_update(const uint8_t* data, uint8_t data_len)
+{
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    struct os_mbuf* om = ble_hs_mbuf_from_flat(data, data_len);
+    if (om == NULL)
+        return BLE_HS_ENOMEM;
+    int rc = ble_gap_ext_adv_set_data(ALERT_ADV_INSTANCE, om);
+#else
+    int rc = ble_gap_adv_set_data(data, data_len);
+#endif
+    if (rc != 0)
+        TRACE_E(TRACE_ALERT_FAIL, 1, rc);
+    return rc;
+}
+
+
+// stops advertising of the alert
+int alert_adv_stop()
+{
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    return ble_gap_ext_adv_stop(ALERT_ADV_INSTANCE);
+#else
+    return ble_gap_adv_stop();
+#endif
+}
+
+
+#endif /* MAIN_ESCALATION_H_ */
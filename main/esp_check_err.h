@@ -8,16 +8,22 @@
 #ifndef MAIN_ESP_CHECK_ERR_H_
 #define MAIN_ESP_CHECK_ERR_H_
 
+#include "trace.h"
+
 // helper macro to check and output info message
+// success is not logged over UART, it is written into the trace (see more trace.h)
 
 #ifdef DEBUGGING
 #define ESP_CHECK(func, tag) \
     { \
     esp_err_t err = func; \
     if (err != ESP_OK) \
+    { \
         ESP_LOGE(tag, "%s failed! Error: %s [%d]", #func, esp_err_to_name(err), __LINE__); \
+        TRACE_E(TRACE_CHECK_FAIL, __LINE__, err); \
+    } \
     else \
-        ESP_LOGI(tag, "%s succeeded!", #func); \
+        TRACE_I(TRACE_CHECK_OK, __LINE__, (uintptr_t)(tag)); \
     }
 #else
     #define ESP_CHECK(func, tag) \
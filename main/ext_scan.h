@@ -0,0 +1,165 @@
+/*
+ * ext_scan.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_EXT_SCAN_H_
+#define MAIN_EXT_SCAN_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "host/ble_hs.h"
+#include "esp_check_err.h"
+#include "white_list.h"
+#include "energy.h"
+#include "sdkconfig.h"
+
+// Description:
+// The scan engine hides the difference between legacy and BLE 5 extended scanning.
+// With extended advertising enabled (CONFIG_EXAMPLE_EXTENDED_ADV) discovery runs on
+// ble_gap_ext_disc, so a sensor may send its TLV batch in one extended advert of up
+// to EXT_ADV_MAX_DATA_LEN bytes instead of several 31-byte legacy ones. The payload
+// of an extended advert is sent on the secondary PHY (1M or 2M, 2M takes half of the
+// time on air), its primary channel part on 1M or Coded PHY (Coded PHY gives up to
+// four times the range). Coded PHY has to be scanned for separately,
+// which costs scan time, so it is scanned only if some registered sensor advertises
+// on it (or while registering). The PHYs of a sensor are taken from its registration
+// advert and kept in its white list entry (adv_phy), connections to the sensor are
+// initiated on its primary PHY.
+// Extended adverts are handled only when complete, a legacy advert received by the
+// extended scan is handled as legacy one. Without extended advertising everything
+// falls back to legacy scanning on 1M PHY.
+// Scan time is accounted by the energy accounting (see more energy.h), so scans
+// must be cancelled with ext_scan_cancel().
+
+// PHYs of sensor adverts in one byte, BLE_HCI_LE_PHY_* values of primary and
+// secondary PHY, ADV_PHY_LEGACY for legacy adverts
+#define ADV_PHY(prim_phy, sec_phy)  ((uint8_t)((prim_phy) | ((sec_phy) << 4)))
+#define ADV_PHY_PRIMARY(adv_phy)    ((adv_phy) & 0x0F)
+#define ADV_PHY_SECONDARY(adv_phy)  ((adv_phy) >> 4)
+#define ADV_PHY_LEGACY              0
+
+#define EXT_ADV_MAX_DATA_LEN    229     // max advert data in one HCI report, longer adverts are fragmented
+
+
+bool ext_scan_needs_coded_phy();
+int ext_scan_start(uint8_t own_addr_type, int32_t duration_ms, const struct ble_gap_disc_params* disc_params,
+                   bool with_coded_phy, ble_gap_event_fn* gap_event_cb);
+int ext_scan_cancel();
+void ext_scan_on_complete();
+bool ext_scan_get_disc_desc(const struct ble_gap_ext_disc_desc* ext_desc, struct ble_gap_disc_desc* disc_desc,
+                            uint8_t* adv_phy);
+int ext_scan_connect(uint8_t own_addr_type, const ble_addr_t* addr, uint8_t adv_phy, int32_t timeout_ms,
+                     const struct ble_gap_conn_params* conn_params, ble_gap_event_fn* gap_event_cb, void* arg);
+
+
+const char* g_tag_scan = "SCAN";    // tag used in ESP_CHECK
+
+
+// checks if some registered sensor advertises on Coded PHY
+bool ext_scan_needs_coded_phy()
+{
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    for (uint8_t i = 0; i < WHITE_LIST_SIZE; i++)
+        if (!white_list[i].addr_is_empty && ADV_PHY_PRIMARY(white_list[i].adv_phy) == BLE_HCI_LE_PHY_CODED)
+            return true;
+#endif
+    return false;
+}
+
+
+// starts discovery with given parameters, with extended advertising the primary
+// channels are scanned on 1M PHY and, if with_coded_phy, on Coded PHY too
+// returns nimble error code
+int ext_scan_start(uint8_t own_addr_type, int32_t duration_ms, const struct ble_gap_disc_params* disc_params,
+                   bool with_coded_phy, ble_gap_event_fn* gap_event_cb)
+{
+    // interval and window 0 mean defaults of nimble, which scans continuously
+    uint16_t duty = disc_params->itvl == 0 ? ENERGY_FULL_DUTY :
+                    (uint32_t)disc_params->window * ENERGY_FULL_DUTY / disc_params->itvl;
+    if (with_coded_phy) // primary channels are scanned on both PHYs in turn
+        duty = duty * 2 > ENERGY_FULL_DUTY ? ENERGY_FULL_DUTY : duty * 2;
+
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    struct ble_gap_ext_disc_params uncoded_params = {
+            .itvl = disc_params->itvl,
+            .window = disc_params->window,
+            .passive = disc_params->passive
+    };
+    struct ble_gap_ext_disc_params coded_params = uncoded_params;
+
+    // duration is in 10 ms units, 0 - forever
+    uint16_t duration = duration_ms == BLE_HS_FOREVER ? 0 :
+                        duration_ms / 10 > UINT16_MAX ? UINT16_MAX : (duration_ms + 9) / 10;
+    int rc = ble_gap_ext_disc(own_addr_type, duration, 0, disc_params->filter_duplicates, disc_params->filter_policy,
+                              disc_params->limited, &uncoded_params, with_coded_phy ? &coded_params : NULL,
+                              gap_event_cb, NULL);
+#else
+    int rc = ble_gap_disc(own_addr_type, duration_ms, disc_params, gap_event_cb, NULL);
+#endif
+    if (rc == 0)
+        energy_radio_begin(RADIO_SCAN, duty);
+    return rc;
+}
+
+
+// cancels discovery, no BLE_GAP_EVENT_DISC_COMPLETE comes after cancel
+// returns nimble error code
+int ext_scan_cancel()
+{
+    energy_radio_end(RADIO_SCAN);
+    return ble_gap_disc_cancel();
+}
+
+
+// closes scan accounting when discovery is complete,
+// must be called on BLE_GAP_EVENT_DISC_COMPLETE
+void ext_scan_on_complete()
+{
+    energy_radio_end(RADIO_SCAN);
+}
+
+
+// makes legacy discovery descriptor of extended advert, so both are handled
+// the same way, the descriptor points into the advert data
+// returns false if the advert is not complete
+bool ext_scan_get_disc_desc(const struct ble_gap_ext_disc_desc* ext_desc, struct ble_gap_disc_desc* disc_desc,
+                            uint8_t* adv_phy)
+{
+    if (ext_desc->data_status != BLE_GAP_EXT_ADV_DATA_STATUS_COMPLETE)
+        return false;
+
+    disc_desc->event_type = ext_desc->legacy_event_type;
+    disc_desc->length_data = ext_desc->length_data;
+    disc_desc->addr = ext_desc->addr;
+    disc_desc->rssi = ext_desc->rssi;
+    disc_desc->data = ext_desc->data;
+    disc_desc->direct_addr = ext_desc->direct_addr;
+
+    *adv_phy = ext_desc->props & BLE_HCI_ADV_LEGACY_MASK ? ADV_PHY_LEGACY :
+               ADV_PHY(ext_desc->prim_phy, ext_desc->sec_phy);
+    return true;
+}
+
+
+// connects to the sensor on the primary PHY of its adverts
+// returns nimble error code
+int ext_scan_connect(uint8_t own_addr_type, const ble_addr_t* addr, uint8_t adv_phy, int32_t timeout_ms,
+                     const struct ble_gap_conn_params* conn_params, ble_gap_event_fn* gap_event_cb, void* arg)
+{
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    uint8_t phy_mask = ADV_PHY_PRIMARY(adv_phy) == BLE_HCI_LE_PHY_CODED ? BLE_GAP_LE_PHY_CODED_MASK :
+                                                                          BLE_GAP_LE_PHY_1M_MASK;
+    return ble_gap_ext_connect(own_addr_type, addr, timeout_ms, phy_mask, conn_params, conn_params, conn_params,
+                               gap_event_cb, arg);
+#else
+    return ble_gap_connect(own_addr_type, addr, timeout_ms, conn_params, gap_event_cb, arg);
+#endif
+}
+
+
+#endif /* MAIN_EXT_SCAN_H_ */
@@ -13,13 +13,29 @@
 #include "esp_log.h"
 #include "esp_timer.h"
 #include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
 
 #include "esp_check_err.h"
-#include "task_priorities_rtos.h"
+
+// Description:
+// The led shows patterns, a pattern is a list of steps (led level and time) that
+// is played once or in a loop. Patterns are played by one esp_timer that is armed
+// once per step, so a pattern costs no task and wakes the CPU only when the led
+// changes its level. Starting a pattern replaces the one being played, turning
+// the led on or off stops it. Patterns of the gateway:
+//   registration OK   - fast blink
+//   deletion OK       - slow blink
+//   critical alert    - very fast blink
+//   low battery       - double blink every 2 s
+//   background scan   - short blink every 2 s, the mode scans at low duty
+//   mode timeout      - three blinks played once, the mode is exited
+// led_start_blink() plays a custom two-step pattern.
 
 #define GPIO_LED_ON 0   // define active level for led - 0 means the led is ON
 #define GPIO_LED_OFF 1  // define inactive level for led - 1 means the led is OFF
 
+#define LED_PATTERN_MAX_STEPS   8   // max number of steps in one pattern
+
 
 // structure to store blink intervals for the led (on and off time in ms)
 typedef struct {
@@ -28,20 +44,81 @@ typedef struct {
 
 } blink_itvs_t;
 
+// struct that describes one step of pattern
+typedef struct {
+    uint8_t level;          // led level during the step (GPIO_LED_ON or GPIO_LED_OFF)
+    uint16_t duration_ms;   // duration of the step
+} led_step_t;
+
+// struct that describes pattern of the led
+typedef struct {
+    led_step_t steps[LED_PATTERN_MAX_STEPS];    // steps played in order
+    uint8_t steps_cnt;                          // number of steps
+    bool repeat;                                // play in a loop, otherwise the led is off after last step
+} led_pattern_t;
+
+// fast blink, meaning that registration was successful
+const led_pattern_t LED_PATTERN_REGISTRATION_OK = {
+        .steps = { { GPIO_LED_ON, 100 }, { GPIO_LED_OFF, 100 } },
+        .steps_cnt = 2,
+        .repeat = true
+};
+
+// slow blink, meaning that deletion was successful
+const led_pattern_t LED_PATTERN_DELETION_OK = {
+        .steps = { { GPIO_LED_ON, 700 }, { GPIO_LED_OFF, 700 } },
+        .steps_cnt = 2,
+        .repeat = true
+};
+
+// very fast blink, meaning that the alert is raised
+const led_pattern_t LED_PATTERN_CRITICAL_ALERT = {
+        .steps = { { GPIO_LED_ON, 50 }, { GPIO_LED_OFF, 150 } },
+        .steps_cnt = 2,
+        .repeat = true
+};
+
+// double blink every 2 s, meaning that the battery is low
+const led_pattern_t LED_PATTERN_LOW_BATTERY = {
+        .steps = { { GPIO_LED_ON, 50 }, { GPIO_LED_OFF, 150 }, { GPIO_LED_ON, 50 }, { GPIO_LED_OFF, 1750 } },
+        .steps_cnt = 4,
+        .repeat = true
+};
+
+// short blink every 2 s, meaning that the mode scans in background
+const led_pattern_t LED_PATTERN_SCAN_BACKGROUND = {
+        .steps = { { GPIO_LED_ON, 50 }, { GPIO_LED_OFF, 1950 } },
+        .steps_cnt = 2,
+        .repeat = true
+};
+
+// three blinks, meaning that the mode is exited after timeout
+const led_pattern_t LED_PATTERN_MODE_TIMEOUT = {
+        .steps = { { GPIO_LED_ON, 300 }, { GPIO_LED_OFF, 200 }, { GPIO_LED_ON, 300 }, { GPIO_LED_OFF, 200 },
+                   { GPIO_LED_ON, 300 }, { GPIO_LED_OFF, 200 } },
+        .steps_cnt = 6,
+        .repeat = false
+};
+
 const char* g_tag_led = "LED";    // tag used in ESP_CHECK
 
 uint8_t g_gpio_led_num;                 // gpio number for the led
 bool led_is_initialised = false;        // flag to check if the led has been inited
-TaskHandle_t blink_loop_hndl = NULL;    // handle for the blink task
-blink_itvs_t blink_itvs;                // structure holding blink intervals
+esp_timer_handle_t led_timer = NULL;    // timer that plays patterns
+led_pattern_t led_pattern;              // pattern being played, copied so the caller may reuse its own
+bool led_pattern_is_playing = false;    // flag to check if a pattern is being played
+uint8_t led_step_idx = 0;               // index of the step being played
+portMUX_TYPE led_mux = portMUX_INITIALIZER_UNLOCKED;    // pattern is changed by the worker and played by the timer
 
 esp_err_t led_init(uint8_t gpio_led_num);
 esp_err_t led_deinit();
 esp_err_t led_turn_on();
 esp_err_t led_turn_off();
 esp_err_t led_start_blink(uint16_t blink_on_itv, uint16_t blink_off_itv);
+esp_err_t led_start_pattern(const led_pattern_t* pattern);
 esp_err_t led_stop_blink();
-void blink_loop(void* arg);
+uint32_t led_get_pattern_duration_ms(const led_pattern_t* pattern);
+static void led_timer_cb(void* arg);
 
 
 // inits the led by configuring its gpio pin
@@ -57,6 +134,18 @@ esp_err_t led_init(uint8_t gpio_led_num)
     ESP_CHECK(gpio_reset_pin(g_gpio_led_num), g_tag_led);
     ESP_CHECK(gpio_set_direction(g_gpio_led_num, GPIO_MODE_OUTPUT), g_tag_led);
 
+    // create the pattern timer once, it stays created across deinit
+    if (led_timer == NULL)
+    {
+        const esp_timer_create_args_t led_timer_args = {
+            .name = "led timer",
+            .callback = &led_timer_cb,
+            .arg = NULL,
+            .skip_unhandled_events = true   // late step is played once, not caught up
+        };
+        ESP_CHECK(esp_timer_create(&led_timer_args, &led_timer), g_tag_led);
+    }
+
     return ESP_OK;
 }
 
@@ -67,8 +156,8 @@ esp_err_t led_deinit()
     if (!led_is_initialised)     // check if led was not initialised
         return ESP_FAIL;
 
-    // if a blink task is running, stop it before deiniting
-    if (blink_loop_hndl != NULL)
+    // if a pattern is being played, stop it before deiniting
+    if (led_pattern_is_playing)
         led_stop_blink();
 
     led_is_initialised = false;     // mark led as deinitialised
@@ -82,7 +171,7 @@ esp_err_t led_turn_on()
     if (!led_is_initialised)     // check if led was not initialised
         return ESP_FAIL;
 
-    if (blink_loop_hndl != NULL) // stop blinking if it's currently running
+    if (led_pattern_is_playing) // stop blinking if it's currently running
         led_stop_blink();
 
     // set the led gpio level to ON (active level)
@@ -96,7 +185,7 @@ esp_err_t led_turn_off()
     if (!led_is_initialised)     // check if led was not initialised
         return ESP_FAIL;
 
-    if (blink_loop_hndl != NULL) // stop blinking if it's currently running
+    if (led_pattern_is_playing) // stop blinking if it's currently running
         led_stop_blink();
 
     // set the led gpio level to OFF (inactive level)
@@ -107,50 +196,94 @@ esp_err_t led_turn_off()
 // starts blinking the led with specified on and off intervals
 esp_err_t led_start_blink(uint16_t blink_on_itv, uint16_t blink_off_itv)    // in ms
 {
-    if (!led_is_initialised)     // check if led was not initialised
-        return ESP_FAIL;
+    led_pattern_t pattern = {
+            .steps = { { GPIO_LED_ON, blink_on_itv }, { GPIO_LED_OFF, blink_off_itv } },
+            .steps_cnt = 2,
+            .repeat = true
+    };
+    return led_start_pattern(&pattern);
+}
 
-    // store the blink intervals
-    blink_itvs.blink_on_itv = blink_on_itv;
-    blink_itvs.blink_off_itv = blink_off_itv;
 
-    if (blink_loop_hndl != NULL) // stop blinking if it's currently running
-        led_stop_blink();
+// starts playing the pattern from its first step, replaces the pattern
+// being played
+esp_err_t led_start_pattern(const led_pattern_t* pattern)
+{
+    if (!led_is_initialised || led_timer == NULL)   // check if led was not initialised
+        return ESP_FAIL;
 
-    // create a new task to handle the blinking loop
-    BaseType_t res = xTaskCreate(blink_loop, "blink_loop", 2048, (void*)&blink_itvs, tskIDLE_PRIORITY + LOW_TASK_PRIORITY, &blink_loop_hndl);
+    if (pattern->steps_cnt == 0 || pattern->steps_cnt > LED_PATTERN_MAX_STEPS)
+        return ESP_ERR_INVALID_ARG;
 
-    if (res != pdPASS)
-        return ESP_FAIL;
+    esp_timer_stop(led_timer);  // fails if not running, nothing to stop then
 
-    return ESP_OK;
+    portENTER_CRITICAL(&led_mux);
+    led_pattern = *pattern;
+    led_step_idx = 0;
+    led_pattern_is_playing = true;
+    gpio_set_level(g_gpio_led_num, led_pattern.steps[0].level);
+    portEXIT_CRITICAL(&led_mux);
+
+    return esp_timer_start_once(led_timer, (uint64_t)led_pattern.steps[0].duration_ms * 1000);
 }
 
-// stops the blinking of the led
+
+// stops the blinking of the led (the pattern being played),
+// the led keeps its current level
 esp_err_t led_stop_blink()
 {
-    // check if led is initialised and blink task is running
-    if (!led_is_initialised || blink_loop_hndl == NULL)
+    // check if led is initialised and a pattern is being played
+    if (!led_is_initialised || !led_pattern_is_playing)
         return ESP_FAIL;
 
-    // delete the blink task
-    vTaskDelete(blink_loop_hndl);
-    blink_loop_hndl = NULL; // reset task handle
+    // the callback may be running already, it checks the flag
+    portENTER_CRITICAL(&led_mux);
+    led_pattern_is_playing = false;
+    portEXIT_CRITICAL(&led_mux);
+
+    esp_timer_stop(led_timer);
     return ESP_OK;
 }
 
-// handles the blinking loop of the led
-void blink_loop(void* arg)
+
+// returns duration of one play of the pattern, in ms
+uint32_t led_get_pattern_duration_ms(const led_pattern_t* pattern)
 {
-    // get the blink intervals from arguments
-    blink_itvs_t* blink_itvs = (blink_itvs_t*)arg;
-    while (true)
+    uint32_t duration_ms = 0;
+    for (uint8_t i = 0; i < pattern->steps_cnt && i < LED_PATTERN_MAX_STEPS; i++)
+        duration_ms += pattern->steps[i].duration_ms;
+    return duration_ms;
+}
+
+
+// plays the next step of the pattern when the current one is over
+static void led_timer_cb(void* arg)
+{
+    uint64_t next_step_us = 0;
+
+    portENTER_CRITICAL(&led_mux);
+    if (led_pattern_is_playing)
     {
-        ESP_CHECK(gpio_set_level(g_gpio_led_num, GPIO_LED_ON), g_tag_led);  // turn the led ON
-        vTaskDelay(blink_itvs->blink_on_itv / portTICK_PERIOD_MS);      // wait for the specified ON interval
-        ESP_CHECK(gpio_set_level(g_gpio_led_num, GPIO_LED_OFF), g_tag_led); // turn the led OFF
-        vTaskDelay(blink_itvs->blink_off_itv / portTICK_PERIOD_MS);     // wait for the specified OFF interval
+        led_step_idx++;
+        if (led_step_idx >= led_pattern.steps_cnt && led_pattern.repeat)
+            led_step_idx = 0;
+
+        if (led_step_idx < led_pattern.steps_cnt)
+        {
+            gpio_set_level(g_gpio_led_num, led_pattern.steps[led_step_idx].level);
+            next_step_us = (uint64_t)led_pattern.steps[led_step_idx].duration_ms * 1000;
+        }
+        else
+        {
+            // pattern played once is over
+            gpio_set_level(g_gpio_led_num, GPIO_LED_OFF);
+            led_pattern_is_playing = false;
+        }
     }
+    portEXIT_CRITICAL(&led_mux);
+
+    if (next_step_us != 0)
+        esp_timer_start_once(led_timer, next_step_us);
 }
 
 
@@ -0,0 +1,273 @@
+/*
+ * link_stats.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_LINK_STATS_H_
+#define MAIN_LINK_STATS_H_
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_check_err.h"
+#include "white_list.h"
+#include "trace.h"
+#include "sdkconfig.h"
+
+// Description:
+// Link statistics record how well every registered sensor is received. For every
+// white list entry (same index) the gateway keeps in RTC memory:
+//   rssi        - EWMA of RSSI of its data adverts
+//   adv_cnt     - number of its new adverts in the last data scan (repeats are
+//                 dropped before, see seq_dedup.h)
+//   missed      - number of data scans in a row without any advert of it
+//   first_seen  - time from scan start to its first advert in the last scan
+//   latency     - decaying peak of first_seen, how late the sensor is expected
+// A sensor is flagged to re-seat (LINK_FLAG_RESEAT), if it has been missed for
+// LINK_RESEAT_MISSED scans or its RSSI EWMA is below LINK_WEAK_RSSI, the flag is
+// cleared once the link recovers. The periodic data scan is sized by the latency
+// of the slowest sensor (link_stats_get_scan_window_ms) instead of always lasting
+// AM_DATA_SCAN_MAX_DURATION_MS, so a missing sensor does not keep the radio on.
+// Sensors flagged for missing are not waited for, a sensor without statistics yet
+// is waited for the full duration. The window must not feed on itself: a sensor
+// missed by a shortened scan may just have come after its end, so its latency is
+// raised (doubled, at least to the window, at most to the full duration) and the
+// miss does not count to its missed streak. Only scans of the full duration count
+// misses. The statistics can be read over GATT, see link_stats_serialize() for
+// the format.
+
+#define LINK_WEAK_RSSI          CONFIG_AM_LINK_WEAK_RSSI        // RSSI EWMA below which the link is weak, in dBm
+#define LINK_RESEAT_MISSED      CONFIG_AM_LINK_RESEAT_MISSED    // missed scans in a row, after which the sensor is flagged
+#define LINK_RSSI_FRAC_BITS     4       // fractional bits of RSSI EWMA
+#define LINK_RSSI_EWMA_SHIFT    3       // weight of a new RSSI sample is 1/8
+#define LINK_LATENCY_DECAY_SHIFT 3      // latency peak decays by 1/8 of the difference per scan
+#define LINK_NOT_SEEN           UINT16_MAX  // mark for first_seen of sensor not seen in the scan
+#define LINK_WINDOW_MARGIN_MS   100     // added to the latency of the slowest sensor
+#define LINK_WINDOW_MIN_MS      200     // min duration of adaptive data scan
+#define LINK_WINDOW_FULL_MS     CONFIG_AM_DATA_SCAN_MAX_DURATION_MS // scan of this duration counts misses
+#define LINK_ENTRY_SIZE         9       // size of one serialized entry
+#define LINK_CHR_MAX_LEN        (1 + WHITE_LIST_SIZE * LINK_ENTRY_SIZE)   // max size of serialized statistics
+
+// flags of link statistics
+#define LINK_FLAG_SEEN          0x01    // sensor has been seen at least once, rssi and latency are valid
+#define LINK_FLAG_RESEAT        0x02    // sensor should be re-seated (moved, its battery or antenna checked)
+
+// struct that describes link statistics of one white list entry
+typedef struct {
+    int16_t rssi_ewma;          // EWMA of RSSI, in 1/16 dBm
+    uint16_t first_seen_ms;     // time from scan start to the first advert in the last scan
+    uint16_t latency_ms;        // decaying peak of first_seen_ms
+    uint8_t adv_cnt;            // adverts received in the last scan (saturated)
+    uint8_t missed_streak;      // scans in a row without any advert (saturated)
+    uint8_t flags;              // LINK_FLAG_*
+} link_stats_t;
+
+
+void link_stats_reset(int8_t wl_index);
+void link_stats_begin_scan(uint32_t window_ms);
+void link_stats_on_advert(int8_t wl_index, int8_t rssi, int64_t adv_time_us);
+void link_stats_end_scan();
+bool link_stats_needs_reseat(int8_t wl_index);
+uint32_t link_stats_get_scan_window_ms(uint32_t max_window_ms);
+size_t link_stats_serialize(uint8_t* dest_buff, size_t dest_buff_len);
+
+
+const char* g_tag_link = "LINK";    // tag used in ESP_CHECK
+int64_t link_scan_start_us = 0;     // start of the current scan
+uint32_t link_scan_window_ms = 0;   // planned duration of the current scan
+bool link_scan_is_open = false;     // flag to indicate whether adverts are counted
+
+// statistics of white list entries, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR link_stats_t link_stats[WHITE_LIST_SIZE];
+
+
+// resets statistics of white list entry, must be called when a sensor is registered
+void link_stats_reset(int8_t wl_index)
+{
+    if (wl_index < 0 || wl_index >= WHITE_LIST_SIZE)
+        return;
+
+    memset(&link_stats[wl_index], 0, sizeof(link_stats_t));
+    link_stats[wl_index].first_seen_ms = LINK_NOT_SEEN;
+}
+
+
+// starts counting adverts of data scan, window_ms - its planned duration
+void link_stats_begin_scan(uint32_t window_ms)
+{
+    for (uint8_t i = 0; i < WHITE_LIST_SIZE; i++)
+    {
+        link_stats[i].adv_cnt = 0;
+        link_stats[i].first_seen_ms = LINK_NOT_SEEN;
+    }
+
+    link_scan_start_us = esp_timer_get_time();
+    link_scan_window_ms = window_ms;
+    link_scan_is_open = true;
+}
+
+
+// counts advert of registered sensor, adv_time_us - time of its receipt
+void link_stats_on_advert(int8_t wl_index, int8_t rssi, int64_t adv_time_us)
+{
+    if (!link_scan_is_open || wl_index < 0 || wl_index >= WHITE_LIST_SIZE)
+        return;
+
+    link_stats_t* stats = &link_stats[wl_index];
+    if (stats->adv_cnt < UINT8_MAX)
+        stats->adv_cnt++;
+
+    // EWMA of rssi in fixed point, the first sample is taken as is
+    int16_t scaled_rssi = (int16_t)rssi * (1 << LINK_RSSI_FRAC_BITS);
+    if (!(stats->flags & LINK_FLAG_SEEN))
+        stats->rssi_ewma = scaled_rssi;
+    else
+        stats->rssi_ewma += (scaled_rssi - stats->rssi_ewma) >> LINK_RSSI_EWMA_SHIFT;
+
+    // latency is taken from the first advert of the scan
+    if (stats->first_seen_ms == LINK_NOT_SEEN)
+    {
+        int64_t first_seen_ms = (adv_time_us - link_scan_start_us) / 1000;
+        stats->first_seen_ms = first_seen_ms < 0 ? 0 : first_seen_ms >= LINK_NOT_SEEN ? LINK_NOT_SEEN - 1 : first_seen_ms;
+
+        // peak follows later adverts at once and decays slowly after earlier ones
+        if (!(stats->flags & LINK_FLAG_SEEN) || stats->first_seen_ms >= stats->latency_ms)
+            stats->latency_ms = stats->first_seen_ms;
+        else
+            stats->latency_ms -= (stats->latency_ms - stats->first_seen_ms) >> LINK_LATENCY_DECAY_SHIFT;
+    }
+
+    stats->flags |= LINK_FLAG_SEEN;
+}
+
+
+// closes counting of data scan: updates missed streaks and re-seat flags
+void link_stats_end_scan()
+{
+    if (!link_scan_is_open)
+        return;
+    link_scan_is_open = false;
+    bool is_full = link_scan_window_ms >= LINK_WINDOW_FULL_MS;
+
+    for (uint8_t i = 0; i < WHITE_LIST_SIZE; i++)
+    {
+        if (white_list[i].addr_is_empty)
+            continue;
+
+        link_stats_t* stats = &link_stats[i];
+        if (stats->adv_cnt > 0)
+            stats->missed_streak = 0;
+        else if (!is_full)
+        {
+            // the sensor may have come after the shortened scan, wait longer next time
+            uint32_t latency_ms = stats->latency_ms > link_scan_window_ms ? stats->latency_ms : link_scan_window_ms;
+            latency_ms *= 2;
+            stats->latency_ms = latency_ms > LINK_WINDOW_FULL_MS ? LINK_WINDOW_FULL_MS : latency_ms;
+        }
+        else if (stats->missed_streak < UINT8_MAX)
+            stats->missed_streak++;
+
+        bool is_weak = (stats->flags & LINK_FLAG_SEEN) &&
+                       (stats->rssi_ewma >> LINK_RSSI_FRAC_BITS) < LINK_WEAK_RSSI;
+        bool needs_reseat = is_weak || stats->missed_streak >= LINK_RESEAT_MISSED;
+        if (needs_reseat && !(stats->flags & LINK_FLAG_RESEAT))
+        {
+            ESP_LOGW(g_tag_link, "Sensor %u should be re-seated (rssi %d dBm, missed %u).",
+                     i, stats->rssi_ewma >> LINK_RSSI_FRAC_BITS, stats->missed_streak);
+            TRACE_I(TRACE_LINK_RESEAT, i, (uint8_t)(stats->rssi_ewma >> LINK_RSSI_FRAC_BITS) | (stats->missed_streak << 8));
+        }
+
+        if (needs_reseat)
+            stats->flags |= LINK_FLAG_RESEAT;
+        else
+            stats->flags &= ~LINK_FLAG_RESEAT;
+    }
+}
+
+
+// checks if sensor is flagged to re-seat
+bool link_stats_needs_reseat(int8_t wl_index)
+{
+    if (wl_index < 0 || wl_index >= WHITE_LIST_SIZE)
+        return false;
+
+    return link_stats[wl_index].flags & LINK_FLAG_RESEAT;
+}
+
+
+// returns duration of data scan, long enough for the slowest sensor that is
+// not missing, at most max_window_ms
+uint32_t link_stats_get_scan_window_ms(uint32_t max_window_ms)
+{
+    uint32_t slowest_ms = 0;
+    bool is_waited = false;     // some sensor is to be waited for
+    for (uint8_t i = 0; i < WHITE_LIST_SIZE; i++)
+    {
+        if (white_list[i].addr_is_empty || link_stats[i].missed_streak >= LINK_RESEAT_MISSED)
+            continue;
+
+        // latency of sensor without statistics is not known yet
+        if (!(link_stats[i].flags & LINK_FLAG_SEEN))
+            return max_window_ms;
+
+        if (link_stats[i].latency_ms > slowest_ms)
+            slowest_ms = link_stats[i].latency_ms;
+        is_waited = true;
+    }
+
+    // every sensor is missing, scan in full to find them
+    if (!is_waited)
+        return max_window_ms;
+
+    uint32_t window_ms = slowest_ms + LINK_WINDOW_MARGIN_MS;
+    if (window_ms < LINK_WINDOW_MIN_MS)
+        window_ms = LINK_WINDOW_MIN_MS;
+    return window_ms > max_window_ms ? max_window_ms : window_ms;
+}
+
+
+// serializes statistics of registered sensors,
+// format: number of entries (1 byte), then per entry:
+//   white list index (1), flags (1), rssi EWMA in dBm (1, signed), adverts in
+//   last scan (1), missed streak (1), first seen in last scan in ms (2, LE,
+//   0xFFFF - not seen), latency in ms (2, LE)
+// returns number of written bytes
+size_t link_stats_serialize(uint8_t* dest_buff, size_t dest_buff_len)
+{
+    if (dest_buff_len < 1)
+        return 0;
+
+    size_t len = 1;
+    uint8_t entries_cnt = 0;
+    for (uint8_t i = 0; i < WHITE_LIST_SIZE; i++)
+    {
+        if (white_list[i].addr_is_empty)
+            continue;
+        if (len + LINK_ENTRY_SIZE > dest_buff_len)
+            break;
+
+        const link_stats_t* stats = &link_stats[i];
+        dest_buff[len++] = i;
+        dest_buff[len++] = stats->flags;
+        dest_buff[len++] = (uint8_t)(int8_t)(stats->rssi_ewma >> LINK_RSSI_FRAC_BITS);
+        dest_buff[len++] = stats->adv_cnt;
+        dest_buff[len++] = stats->missed_streak;
+        dest_buff[len++] = stats->first_seen_ms & 0xFF;
+        dest_buff[len++] = stats->first_seen_ms >> 8;
+        dest_buff[len++] = stats->latency_ms & 0xFF;
+        dest_buff[len++] = stats->latency_ms >> 8;
+        entries_cnt++;
+    }
+
+    dest_buff[0] = entries_cnt;
+    return len;
+}
+
+
+#endif /* MAIN_LINK_STATS_H_ */
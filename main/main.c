@@ -9,6 +9,7 @@
 #include "esp_log.h"
 #include "esp_timer.h"
 #include "esp_sleep.h"
+#include "esp_system.h"
 #include "driver/gpio.h"
 #include "freertos/FreeRTOS.h"
 #include "nvs_flash.h"
@@ -26,18 +27,62 @@
 #include "button.h"
 #include "led.h"
 #include "white_list.h"
+#include "white_list_storage.h"
+#include "ext_scan.h"
+#include "scan_policy.h"
+#include "link_stats.h"
+#include "seq_dedup.h"
+#include "sample_history.h"
 #include "analysis_module.h"
+#include "sleep_scheduler.h"
+#include "power_mode.h"
 #include "app_packet.h"
+#include "profiler.h"
+#include "energy.h"
+#include "time_sync.h"
+#include "adv_prefilter.h"
+#include "trace.h"
+#include "escalation.h"
+#include "uplink.h"
+#include "data_service.h"
+#include "backlog_sync.h"
+#include "bench.h"
+#include "worker.h"
 
 
 #define DEBUGGING   // enables ESP_CHECK macro (see more esp_check_err.h)
 #define GPIO_LED    GPIO_NUM_8
 #define GPIO_BUTTON GPIO_NUM_3
 
-#define RSSI_ACCEPTABLE_LVL     -50         // acceptable rssi level for connection
-#define DEEP_SLEEP_CYCLE_TIME   5 * 1000000 // in us (5 s)
-
 #define MAC_STR_SIZE 3 * 6
+#define MODE_CONNECT_TIMEOUT_MS 5000   // connection for registration or deletion, then the mode scan is resumed
+
+// UUID of the custom wake cycle profiler characteristic
+#define PROFILER_CHR_UUID128 BLE_UUID128_DECLARE(0x01, 0x00, 0x5e, 0xa1, 0x6b, 0x3c, 0x4e, 0x9a, \
+                                                 0x8f, 0x21, 0x7d, 0x5c, 0x4b, 0xa0, 0x3e, 0x6d)
+// UUID of the custom wake schedule characteristic
+#define SCHEDULE_CHR_UUID128 BLE_UUID128_DECLARE(0x02, 0x00, 0x5e, 0xa1, 0x6b, 0x3c, 0x4e, 0x9a, \
+                                                 0x8f, 0x21, 0x7d, 0x5c, 0x4b, 0xa0, 0x3e, 0x6d)
+// UUID of the custom trace characteristic
+#define TRACE_CHR_UUID128    BLE_UUID128_DECLARE(0x03, 0x00, 0x5e, 0xa1, 0x6b, 0x3c, 0x4e, 0x9a, \
+                                                 0x8f, 0x21, 0x7d, 0x5c, 0x4b, 0xa0, 0x3e, 0x6d)
+// UUID of the custom energy characteristic
+#define ENERGY_CHR_UUID128   BLE_UUID128_DECLARE(0x04, 0x00, 0x5e, 0xa1, 0x6b, 0x3c, 0x4e, 0x9a, \
+                                                 0x8f, 0x21, 0x7d, 0x5c, 0x4b, 0xa0, 0x3e, 0x6d)
+// UUID of the custom link statistics characteristic
+#define LINK_CHR_UUID128     BLE_UUID128_DECLARE(0x05, 0x00, 0x5e, 0xa1, 0x6b, 0x3c, 0x4e, 0x9a, \
+                                                 0x8f, 0x21, 0x7d, 0x5c, 0x4b, 0xa0, 0x3e, 0x6d)
+
+// UUID of the custom data service and its characteristics (see more data_service.h)
+#define DATA_SVC_UUID128     BLE_UUID128_DECLARE(0x10, 0x00, 0x5e, 0xa1, 0x6b, 0x3c, 0x4e, 0x9a, \
+                                                 0x8f, 0x21, 0x7d, 0x5c, 0x4b, 0xa0, 0x3e, 0x6d)
+#define STATE_CHR_UUID128    BLE_UUID128_DECLARE(0x11, 0x00, 0x5e, 0xa1, 0x6b, 0x3c, 0x4e, 0x9a, \
+                                                 0x8f, 0x21, 0x7d, 0x5c, 0x4b, 0xa0, 0x3e, 0x6d)
+#define HISTORY_CHR_UUID128  BLE_UUID128_DECLARE(0x12, 0x00, 0x5e, 0xa1, 0x6b, 0x3c, 0x4e, 0x9a, \
+                                                 0x8f, 0x21, 0x7d, 0x5c, 0x4b, 0xa0, 0x3e, 0x6d)
+
+#define TRACE_CHR_MAX_LEN   512 // max length of attribute value, the latest records are sent
+#define MODE_EXIT_RETRY_US  (100 * 1000)    // retry delay of mode exit, if it can't be posted to the worker
 
 // enumeration of possible modes for this device
 // these modes determine the current state or functionality of the device
@@ -56,26 +101,127 @@ g_device_mode_t g_device_mode = UNSPECIFIED_MODE; // current mode, UNSPECIFIED_M
 uint8_t g_ble_addr_type;        // addr type, set automatically in ble_hs_id_infer_auto()
 const char* g_tag_am = "AM";    // tag used in ESP_CHECK
 
+uint32_t g_cycle_reported[(WHITE_LIST_SIZE + 31) / 32] = {};  // bitmap of white list slots that reported data in this cycle
+uint8_t g_cycle_reported_cnt = 0;               // number of white list entries that reported data in this cycle
+bool g_fast_wake = false;       // flag to indicate data cycle boot (observer role only, see app_main)
+uint32_t g_controller_wl_generation = 0;    // white list generation programmed into the controller
+bool g_controller_wl_is_set = false;        // flag to indicate whether controller white list is programmed
+int64_t g_last_data_time_us = 0;            // receipt time of the latest data advert (esp_timer_get_time)
+scan_policy_t g_data_scan_policy;           // policy of data scan, its duration is sized by link statistics
+bool g_data_scan_is_open = false;           // flag to indicate whether data adverts are taken (data or escalation scan)
+esp_timer_handle_t g_mode_exit_timer = NULL;    // timer that exits the mode when its timeout pattern is played
+
 
 // button process callbacks (see more button.h)
 void on_short_button_press();
 void on_medium_button_press();
 void on_long_button_press();
 
-void init_ble();
+void init_ble(bool with_gatt_server);
 void ble_app_on_sync(void);
+void start_data_scan();
+uint16_t get_data_scan_window_ms();
+void start_resident_cycle();
+void sync_controller_white_list();
 void host_task();
+adv_filter_mode_t get_adv_filter_mode();
 static int ble_gap_event(struct ble_gap_event *event, void *arg);
-void connect_if_interesting(struct ble_hs_adv_fields *fields, struct ble_gap_disc_desc *disc_desc);
-void delete_if_reachable(struct ble_hs_adv_fields *fields, struct ble_gap_disc_desc *disc_desc);
+static int handle_gap_event(struct ble_gap_event *event, void *arg);
+void handle_advert(struct ble_gap_disc_desc *disc_desc, uint8_t adv_phy);
+void connect_if_interesting(struct ble_hs_adv_fields *fields, const packet_view_t *packet, struct ble_gap_disc_desc *disc_desc, uint8_t adv_phy);
+void delete_if_reachable(const packet_view_t *packet, struct ble_gap_disc_desc *disc_desc, uint8_t adv_phy);
 static int read_time(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int read_profiler_stats(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int read_schedule(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int read_trace(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int read_link_stats(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int read_state(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int read_battery_level(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int read_energy(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int request_history(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 void get_mac_str(uint8_t* addr, char (*mac_str)[MAC_STR_SIZE]);
+void mark_reported(uint8_t wl_index);
+uint8_t process_data_packet(const packet_view_t* packet, uint8_t wl_index, uint32_t packet_time);
+void finish_data_scan();
+void finish_data_cycle();
+bool continue_escalation(liferate_t state, uint8_t subject_id);
+void raise_alert(uint8_t subject_id, int64_t adv_time_us);
+void start_escalation_scan();
+void exit_mode();
+void exit_mode_after_pattern(const led_pattern_t* pattern);
+static void mode_exit_timer_cb(void* arg);
 
 
 void app_main(void)
 {
+    // init wake cycle profiler (see more profiler.h)
+    profiler_init();
+
+    // init energy accounting, takes the sleep before this cycle (see more energy.h)
+    energy_init();
+
+    // start worker task, gap events and button presses are handled
+    // in it, off the nimble host task (see more worker.h)
+    ESP_CHECK(worker_init(), g_tag_am);
+
+    //init white list (see more white_list.h)
+    init_white_list();
+
+    // get wakeup cause, it decides which boot path to take
+    esp_sleep_wakeup_cause_t wakeup_cause = esp_sleep_get_wakeup_cause();
+    TRACE_I(TRACE_WAKEUP, wakeup_cause, 0);
+
+#ifdef CONFIG_AM_BENCHMARK
+    // benchmark build measures the data path instead of the normal
+    // operation and sleeps until reset (see more bench.h)
+    ESP_CHECK(bench_run(process_data_packet), g_tag_am);
+    esp_deep_sleep_start();
+#endif
+
+    if (wakeup_cause == ESP_SLEEP_WAKEUP_TIMER)
+    {
+        // wakeup from timer means that device periodically collects data.
+        // data cycle needs observer role only, so it takes fast-wake path:
+        // no gatt server, no button handling (only gpio wakeup is enabled
+        // again, it does not persist across deep sleep), scan is started
+        // as soon as the ble stack is synchronised (see ble_app_on_sync)
+        g_fast_wake = true;
+
+#ifdef CONFIG_AM_DATA_CYCLE_LED
+        profiler_phase_begin(PHASE_LED_INIT);
+        led_init(GPIO_LED);
+        profiler_phase_end(PHASE_LED_INIT);
+        led_turn_on(); // turn on to show that device is awaken
+#endif
+
+        button_enable_wakeup(GPIO_BUTTON);
+
+#ifdef CONFIG_AM_LIGHT_SLEEP
+        // short intervals are slept in light sleep with the ble
+        // stack kept, the cycle itself stays awake (see more power_mode.h)
+        ESP_CHECK(power_mode_init(GPIO_BUTTON, start_resident_cycle), g_tag_am);
+#endif
+
+        profiler_phase_begin(PHASE_NVS_INIT);
+        ESP_CHECK(nvs_flash_init(), g_tag_am);
+        profiler_phase_end(PHASE_NVS_INIT);
+
+#ifdef CONFIG_AM_UPLINK
+        uplink_log_init();  // log of results and samples for the CDC (see more uplink_log.h)
+#endif
+
+        profiler_phase_begin(PHASE_BLE_INIT);
+        init_ble(false);
+        profiler_phase_end(PHASE_BLE_INIT);
+
+        // timer wakeup is enabled after analysis (see finish_data_cycle)
+        return;
+    }
+
     // inits led (see more led.h)
+    profiler_phase_begin(PHASE_LED_INIT);
     led_init(GPIO_LED);
+    profiler_phase_end(PHASE_LED_INIT);
 
     // set up button cnfg and init button (see more button.h)
     button_cnfg_t button_cnfg = {
@@ -87,19 +233,36 @@ void app_main(void)
             .on_medium_button_press_cb = on_medium_button_press,
             .on_long_button_press_cb  = on_long_button_press
     };
+    profiler_phase_begin(PHASE_BUTTON_INIT);
     button_init(button_cnfg);
-
-    //init white list (see more white_list.h)
-    init_white_list();
+    profiler_phase_end(PHASE_BUTTON_INIT);
 
     // init NVS
+    profiler_phase_begin(PHASE_NVS_INIT);
     ESP_CHECK(nvs_flash_init(), g_tag_am);
+    profiler_phase_end(PHASE_NVS_INIT);
 
-    // init BLE
-    init_ble();
+    // RTC memory survives deep sleep only, after power loss (or any other
+    // reset) the white list is restored from NVS (see more white_list_storage.h)
+    if (esp_reset_reason() != ESP_RST_DEEPSLEEP)
+        wl_storage_restore();
+
+#ifdef CONFIG_AM_UPLINK
+    // log of results and samples for the CDC, its head is recovered
+    // from flash after power loss (see more uplink_log.h)
+    uplink_log_init();
+#endif
+
+#ifdef CONFIG_AM_FIXED_POINT_SELF_CHECK
+    // checks fixed-point data pipeline against the float one (see more analysis_module.h)
+    ESP_CHECK(fixed_point_self_check(), g_tag_am);
+#endif
+
+    // init BLE with gatt server
+    profiler_phase_begin(PHASE_BLE_INIT);
+    init_ble(true);
+    profiler_phase_end(PHASE_BLE_INIT);
 
-    // get wakeup cause and do corresponding actions
-    esp_sleep_wakeup_cause_t wakeup_cause = esp_sleep_get_wakeup_cause();
     switch (wakeup_cause)
     {
         case ESP_SLEEP_WAKEUP_GPIO:
@@ -107,51 +270,22 @@ void app_main(void)
             // wakeup from gpio means that device was asleep and user
             // pressed on a button. next actions could be: registration,
             // deletion or just wakeup (needed for debug now)
+            // low battery is shown until the led is used by a mode
+            if (energy_get_battery_level() <= CONFIG_AM_LOW_BATTERY_LEVEL)
+                led_start_pattern(&LED_PATTERN_LOW_BATTERY);
             force_interupt();
-            ESP_LOGI(g_tag_am, "Waking up from GPIO.");
-
-            break;
-        }
-        case ESP_SLEEP_WAKEUP_TIMER:
-        {
-            // wakeup from timer means that device is periodically sends data
-            ESP_LOGI(g_tag_am, "Waking up from timer.");
-            led_turn_on(); // turn on to show that device is awaken
-
-            // set discovery parameters
-            ESP_LOGI(g_tag_am, "Scanning for data.......");
-            struct ble_gap_disc_params disc_params;
-            disc_params.itvl = 0x0040;          // interval between window start
-            disc_params.window = 0x0020;        // scan window duration
-            disc_params.filter_policy = 1;      // scan only devices from white list
-            disc_params.limited = 0;            // any discovery mode
-            disc_params.passive = 1;            // no scan requests
-            disc_params.filter_duplicates = 0;  // all packages, even duplicates
-
-            // get white list with addrs to set in ble_gap_wl_set for scan
-            ble_addr_t *wl_addrs;
-            get_addr_white_list(&wl_addrs);
-            ESP_CHECK(ble_gap_wl_set(wl_addrs, white_list_len), g_tag_am);
-            free(wl_addrs);
-
-            // start scanning for 1 s
-            int32_t scan_duration_ms = 1 * 1000;
-            ble_gap_disc(g_ble_addr_type, scan_duration_ms, &disc_params, ble_gap_event, NULL);
-
-            // if white list is not empty, then we have registered
-            // devices to get data from => enable timer wakeup
-            // if not, we will just go to deepsleep until gpio wakeup
-            if (!white_list_is_empty())
-                ESP_CHECK(esp_sleep_enable_timer_wakeup(DEEP_SLEEP_CYCLE_TIME), g_tag_am);
 
             break;
         }
         default:
         {
             // if we woke up from another cause, that means something
-            // went wrong, so go back to sleep
+            // went wrong (e.g. power loss), so go back to sleep. if
+            // the white list was restored, data cycles are resumed
             ESP_LOGI(g_tag_am, "Waking up from other cause.");
             ESP_LOGI(g_tag_am, "Go to sleep.");
+            scheduler_enable_wakeup(UNDEFINED, white_list_len, white_list_len);
+            energy_commit_cycle();
             esp_deep_sleep_start();
             break;
         }
@@ -159,45 +293,178 @@ void app_main(void)
 }
 
 
+// gatt server configuration, nimble keeps pointers to it until
+// the server is started, so it is not placed on the stack
+static const struct ble_gatt_svc_def gatt_svc_cnfgs[] = {
+        {
+            .type = BLE_GATT_SVC_TYPE_PRIMARY,
+            .uuid = BLE_UUID16_DECLARE(0x180A), // UUID Device Information
+            .characteristics = (struct ble_gatt_chr_def[]) {
+                {
+                    .uuid = BLE_UUID16_DECLARE(0x2A2B),   // UUID Current Time
+                    .access_cb = read_time,
+                    .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE // readable and writable characteristic
+                },
+                {
+                    .uuid = SCHEDULE_CHR_UUID128,       // custom UUID for wake schedule
+                    .access_cb = read_schedule,
+                    .flags = BLE_GATT_CHR_F_READ        // readable characteristic
+                },
+                {
+                    .uuid = PROFILER_CHR_UUID128,       // custom UUID for wake cycle profiler
+                    .access_cb = read_profiler_stats,
+                    .flags = BLE_GATT_CHR_F_READ        // readable characteristic
+                },
+                {
+                    .uuid = TRACE_CHR_UUID128,          // custom UUID for trace
+                    .access_cb = read_trace,
+                    .flags = BLE_GATT_CHR_F_READ        // readable characteristic
+                },
+                {
+                    .uuid = LINK_CHR_UUID128,           // custom UUID for link statistics
+                    .access_cb = read_link_stats,
+                    .flags = BLE_GATT_CHR_F_READ        // readable characteristic
+                },
+                {0}
+            }
+        },
+        {
+            .type = BLE_GATT_SVC_TYPE_PRIMARY,
+            .uuid = BLE_UUID16_DECLARE(0x180F), // UUID Battery Service
+            .characteristics = (struct ble_gatt_chr_def[]) {
+                {
+                    .uuid = BLE_UUID16_DECLARE(0x2A19),   // UUID Battery Level
+                    .access_cb = read_battery_level,
+                    .flags = BLE_GATT_CHR_F_READ        // readable characteristic
+                },
+                {
+                    .uuid = ENERGY_CHR_UUID128,         // custom UUID for energy accounting
+                    .access_cb = read_energy,
+                    .flags = BLE_GATT_CHR_F_READ        // readable characteristic
+                },
+                {0}
+            }
+        },
+        {
+            .type = BLE_GATT_SVC_TYPE_PRIMARY,
+            .uuid = DATA_SVC_UUID128,           // custom UUID for data service
+            .characteristics = (struct ble_gatt_chr_def[]) {
+                {
+                    .uuid = STATE_CHR_UUID128,          // custom UUID for current state
+                    .access_cb = read_state,
+                    .val_handle = &data_state_val_handle,
+                    .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY    // readable and notifiable characteristic
+                },
+                {
+                    .uuid = HISTORY_CHR_UUID128,        // custom UUID for history download
+                    .access_cb = request_history,
+                    .val_handle = &data_history_val_handle,
+                    .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY   // writable and notifiable characteristic
+                },
+                {0}
+            }
+        },
+        {0}
+};
+
 
-// inits nimble, gap & gatt services
-void init_ble()
+// inits nimble, gap & gatt services (if gatt server is needed)
+void init_ble(bool with_gatt_server)
 {
     nimble_port_init();
-    ble_svc_gap_device_name_set("Nemivika-AM");
-    ble_svc_gap_init();
-    ble_svc_gatt_init();
-
-    // configure gatt characteristics
-    const struct ble_gatt_chr_def gatt_chr_time = {
-            .uuid = BLE_UUID16_DECLARE(0x2A2B),   // UUID Current Time
-            .access_cb = read_time,
-            .flags = BLE_GATT_CHR_F_READ};    // readable characteristic
-
-    // TODO add battery info chr
-    // configure gatt services
-    const struct ble_gatt_svc_def gatt_svc_cnfg = {
-            .type = BLE_GATT_SVC_TYPE_PRIMARY,
-            .uuid = BLE_UUID16_DECLARE(0x180A), // UUID Device Information
-            .characteristics = (struct ble_gatt_chr_def[]){gatt_chr_time, {0}}};
 
+    if (with_gatt_server)
+    {
+        ble_svc_gap_device_name_set("Nemivika-AM");
+        ble_svc_gap_init();
+        ble_svc_gatt_init();
 
-    // set configuration
-    struct ble_gatt_svc_def gatt_svc_cnfgs[] = {gatt_svc_cnfg, {0}};
-    ble_gatts_count_cfg(gatt_svc_cnfgs);
-    ble_gatts_add_svcs(gatt_svc_cnfgs);
+        // set configuration
+        ble_gatts_count_cfg(gatt_svc_cnfgs);
+        ble_gatts_add_svcs(gatt_svc_cnfgs);
+
+        // history is downloaded in notifications as large as
+        // the client accepts (see more data_service.h)
+        ble_att_set_preferred_mtu(DATA_SERVICE_MTU);
+    }
 
     // set the callback function to be executed when the ble stack is synchronised
     ble_hs_cfg.sync_cb = ble_app_on_sync;
 
     // init FreeRTOS task for nimble
+    profiler_phase_begin(PHASE_BLE_SYNC);
     nimble_port_freertos_init(host_task);
 }
 
 void ble_app_on_sync(void)
 {
+    profiler_phase_end(PHASE_BLE_SYNC);
+
     // infer and set the ble addr type
     ble_hs_id_infer_auto(0, &g_ble_addr_type);
+
+    // data scan may start only now, when addr type is known
+    // and the controller accepts commands, it is started by the
+    // worker task as everything the scan leads to
+    if (g_fast_wake)
+        worker_post_call(start_data_scan);
+}
+
+
+// starts periodic scan for data from registered devices
+void start_data_scan()
+{
+    // program white list addrs into the controller for scan (if changed)
+    sync_controller_white_list();
+
+    // scan lasts until the slowest sensor is expected (see link_stats.h)
+    g_data_scan_policy = SCAN_POLICY_DATA;
+    g_data_scan_policy.stages[0].duration_ms = get_data_scan_window_ms();
+
+    // start scanning, scan is stopped earlier if all
+    // registered devices have reported their data (see scan_policy.h)
+    profiler_phase_begin(PHASE_SCAN);
+    int64_t wake_delay_us = esp_timer_get_time() - power_mode_get_cycle_start_us();
+    if (power_mode_is_resident())
+        profiler_phase_record(PHASE_RESUME, wake_delay_us);     // light sleep wake has no boot phases
+    time_sync_set_scan_delay(wake_delay_us / 1000);             // publish delay from wakeup to scan start
+    link_stats_begin_scan(g_data_scan_policy.stages[0].duration_ms);
+    seq_dedup_start_cycle();    // first packets of this cycle may reveal restarted sensors
+    g_data_scan_is_open = true;
+    scan_policy_start(g_ble_addr_type, &g_data_scan_policy, ble_gap_event);
+
+    // advertise wake schedule while scanning, so sensors learn when the next
+    // scan is (see more time_sync.h)
+    schedule_adv_start(g_ble_addr_type, scheduler_get_next_wakeup_ms() + scheduler_get_interval_ms(),
+                       g_data_scan_policy.stages[0].duration_ms, scheduler_get_interval_ms());
+}
+
+
+// gets duration of data scan, sized to the slowest sensor if enabled (see link_stats.h)
+uint16_t get_data_scan_window_ms()
+{
+#ifdef CONFIG_AM_DATA_SCAN_ADAPTIVE
+    return link_stats_get_scan_window_ms(CONFIG_AM_DATA_SCAN_MAX_DURATION_MS);
+#else
+    return CONFIG_AM_DATA_SCAN_MAX_DURATION_MS;
+#endif
+}
+
+
+// starts periodic data cycle woken from light sleep, the ble stack is
+// synchronised already, so the scan is started at once (see more power_mode.h)
+void start_resident_cycle()
+{
+    // per-cycle state starts empty, as after deep sleep
+    memset(g_cycle_reported, 0, sizeof(g_cycle_reported));
+    g_cycle_reported_cnt = 0;
+    memset(&g_adv_filter_stats, 0, sizeof(g_adv_filter_stats));
+
+#ifdef CONFIG_AM_DATA_CYCLE_LED
+    led_turn_on(); // turn on to show that device is awaken
+#endif
+
+    start_data_scan();
 }
 
 // main nimble host task, handles the ble stack processing
@@ -208,78 +475,105 @@ void host_task()
 }
 
 
-// gap event handler
+// programs white list addrs into the filter accept list of the controller,
+// only if the white list has changed since the last programming. the
+// controller loses its list in deep sleep, so the programmed generation
+// is tracked in RAM and not in RTC memory
+void sync_controller_white_list()
+{
+    if (g_controller_wl_is_set && g_controller_wl_generation == get_white_list_generation())
+        return;
+
+    const ble_addr_t *wl_addrs;
+    if (get_addr_white_list(&wl_addrs) != ESP_OK)
+        return;
+
+    int rc = ble_gap_wl_set(wl_addrs, white_list_len);
+    if (rc != 0)    // the list will be programmed again before the next scan
+    {
+        ESP_LOGE(g_tag_am, "ble_gap_wl_set failed! Error: %d", rc);
+        return;
+    }
+    g_controller_wl_generation = get_white_list_generation();
+    g_controller_wl_is_set = true;
+}
+
+
+// returns prefilter mode for current device mode
+adv_filter_mode_t get_adv_filter_mode()
+{
+    return g_device_mode == REGISTRATION_MODE ? ADV_FILTER_REGISTRATION :
+           g_device_mode == DELETION_MODE ? ADV_FILTER_DELETION : ADV_FILTER_DATA;
+}
+
+
+// gap event callback, runs in the host task, so the event is
+// only posted to the worker task (see more worker.h)
+// adverts which are not candidates by their content are dropped here,
+// not to fill the worker queue in a crowded air (see more adv_prefilter.h)
 static int ble_gap_event(struct ble_gap_event *event, void *arg)
+{
+    if (event->type == BLE_GAP_EVENT_DISC &&
+        !adv_prefilter_is_candidate(event->disc.data, event->disc.length_data, event->disc.rssi,
+                                    get_adv_filter_mode()))
+        return 0;
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    if (event->type == BLE_GAP_EVENT_EXT_DISC &&
+        event->ext_disc.data_status == BLE_GAP_EXT_ADV_DATA_STATUS_COMPLETE &&
+        !adv_prefilter_is_candidate(event->ext_disc.data, event->ext_disc.length_data, event->ext_disc.rssi,
+                                    get_adv_filter_mode()))
+        return 0;
+#endif
+    return worker_post_gap_event(event, handle_gap_event, arg);
+}
+
+
+// gap event handler, runs in the worker task
+static int handle_gap_event(struct ble_gap_event *event, void *arg)
 {
     switch (event->type)
     {
         case BLE_GAP_EVENT_DISC:
+            handle_advert(&event->disc, ADV_PHY_LEGACY);
+            break;
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+        case BLE_GAP_EVENT_EXT_DISC:
         {
-            // if new device was discovered, we may:
-            // - connect for registration
-            // - connect for deletion
-            // - get data from sensor
-            ESP_LOGI(g_tag_am, "DISCOVERED new device!");
-
-            struct ble_gap_disc_desc *disc_desc = &event->disc;
-            struct ble_hs_adv_fields fields;
-            ble_hs_adv_parse_fields(&fields, disc_desc->data, disc_desc->length_data);
-
-            if (fields.name_len > 0)
-                ESP_LOGI(g_tag_am, "Name: %.*s", fields.name_len, fields.name);
-
-            char mac_str[MAC_STR_SIZE];
-            get_mac_str(disc_desc->addr.val, &mac_str);
-            ESP_LOGI(g_tag_am, "MAC: %s", mac_str);
-            ESP_LOGI(g_tag_am, "RSSI: %d", disc_desc->rssi);
-
-            ESP_LOGI(g_tag_am, "Packet len = %d", fields.mfg_data_len);
-            ESP_LOGI(g_tag_am, "Header = 0x%x%x", fields.mfg_data[0], fields.mfg_data[1]);
-
-            // if this device is in registration mode try to connect
-            // if this device is in deletion mode try to connect
-            if(g_device_mode == REGISTRATION_MODE)
-                connect_if_interesting(&fields, disc_desc);
-            else if(g_device_mode == DELETION_MODE)
-                delete_if_reachable(&fields, disc_desc);
-            else
-            {
-                // if this device is in unspecified mode try to get data
-                // firstly, check package format, header must be DATA_HEADER meaning
-                // discovered device has data to retrieve
-                uint16_t header;
-                uint8_t buffer[fields.mfg_data_len - HEADER_SIZE];
-                if(open_packet(&header, buffer, fields.mfg_data, fields.mfg_data_len) == -1)
-                {
-                    ESP_LOGE(g_tag_am, "Error opening packet!!!");
-                    ESP_LOGE(g_tag_am, "Header: %d", header);
-                }
-                else if (header == DATA_HEADER)
-                {
-                    // now we can get only temperature data, so go
-                    // straight to conversation
-                    ESP_LOGI(g_tag_am, "Header: %d", header);
-                    ESP_LOGI(g_tag_am, "Temp: %f", convert_temp_data_to_float(buffer[0], buffer[1]));
-                    ESP_LOGI(g_tag_am, "Temp raw: msb = %x lsb = %x\n", buffer[0], buffer[1]);
-
-                    // push temperature data for storage (see file analysis_module.h)
-                    ESP_CHECK(push_temp_data(convert_temp_data_to_float(buffer[0], buffer[1])), g_tag_am);
-                }
-            }
+            // extended adverts are converted to legacy descriptor, so
+            // both are handled the same way (see more ext_scan.h)
+            struct ble_gap_disc_desc disc_desc;
+            uint8_t adv_phy;
+            if (ext_scan_get_disc_desc(&event->ext_disc, &disc_desc, &adv_phy))
+                handle_advert(&disc_desc, adv_phy);
             break;
         }
+#endif
         case BLE_GAP_EVENT_CONNECT:
         {
             // if device is connected, we may:
             // - register new device (sensor)
             // - delete registered device (sensor)
+            // - serve data client (the gateway is advertising, see data_service.h)
             struct ble_gap_conn_desc conn_desc;
             ble_gap_conn_find(event->connect.conn_handle, &conn_desc);
 
+            // in unspecified mode the gateway connects to nobody,
+            // so a client has connected to the data service
+            if (g_device_mode == UNSPECIFIED_MODE)
+            {
+                if (event->connect.status == 0)
+                {
+                    ESP_LOGI(g_tag_am, "Data client is connected.");
+                    data_service_on_connect(event->connect.conn_handle);
+                }
+                break;
+            }
+
             // check status, if everything okay, then
             if (event->connect.status == 0)
             {
                 ESP_LOGI(g_tag_am, "CONNECTION established!");
+                energy_radio_begin(RADIO_CONN, ENERGY_FULL_DUTY);
 
                 char our_mac[MAC_STR_SIZE];
                 char peer_mac[MAC_STR_SIZE];
@@ -293,8 +587,9 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
                 if (g_device_mode == REGISTRATION_MODE)
                 {
                     // start fast blink, meaning that registration was successful
-                    led_start_blink(100, 100);
+                    led_start_pattern(&LED_PATTERN_REGISTRATION_OK);
                     ESP_LOGI(g_tag_am, "Registration is completed.");
+                    wl_storage_save();  // persist new entry (see more white_list_storage.h)
                 }
                 else if (g_device_mode == DELETION_MODE && white_list_contains_addr(&conn_desc.peer_id_addr))
                 {
@@ -303,8 +598,9 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
                     if (deleted)
                     {
                         // start slow blink, meaning that deletion was successful
-                        led_start_blink(700, 700);
+                        led_start_pattern(&LED_PATTERN_DELETION_OK);
                         ESP_LOGI(g_tag_am, "Deletion is completed.");
+                        wl_storage_save();  // persist removed entry (see more white_list_storage.h)
                     }
                     else
                     {
@@ -319,15 +615,19 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
             {
                 ESP_LOGI(g_tag_am, "CONNECTION is NOT established!");
                 remove_from_white_list_by_addr(&conn_desc.peer_id_addr);
+
+                // scan for other devices
+                scan_policy_resume();
             }
 
             // print info about white list
             ESP_LOGI(g_tag_am, "White List: len = %u", white_list_len);
-            for(int i = 0; i < white_list_len; i++)
+            for(int pos = 0; pos < white_list_len; pos++)
             {
+                int8_t i = get_white_list_index_by_pos(pos);
                 char wl_mac[MAC_STR_SIZE];
                 get_mac_str(white_list[i].device_addr.val, &wl_mac);
-                ESP_LOGI(g_tag_am, "WL[%d] = {%s}", i, wl_mac);
+                ESP_LOGI(g_tag_am, "WL[%d] = {%s}%s", i, wl_mac, link_stats_needs_reseat(i) ? " (re-seat)" : "");
             }
 
             break;
@@ -338,35 +638,68 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
             char peer_mac[MAC_STR_SIZE];
             get_mac_str(event->disconnect.conn.peer_id_addr.val, &peer_mac);
             ESP_LOGI(g_tag_am, "DISCONNECTED with %s! The reason - %d.", peer_mac, event->disconnect.reason);
+            energy_radio_end(RADIO_CONN);
+            data_service_on_disconnect(event->disconnect.conn.conn_handle);
 
+            // in registration and deletion mode the scan is resumed for other
+            // devices, the mode timeout is counted from now (see scan_policy.h)
+            if (g_device_mode == REGISTRATION_MODE ||
+                (g_device_mode == DELETION_MODE && !white_list_is_empty()))
+            {
+                scan_policy_resume();
+            }
+            else if (g_device_mode == DELETION_MODE)
+            {
+                // nothing to delete any more
+                ESP_LOGI(g_tag_am, "White list is empty, quiting deletion mode.");
+                exit_mode();
+            }
+
+            break;
+        }
+        case BLE_GAP_EVENT_SUBSCRIBE:
+        {
+            // data client has (un)subscribed to notifications (see more data_service.h)
+            data_service_on_subscribe(event);
+            break;
+        }
+        case BLE_GAP_EVENT_NOTIFY_TX:
+        {
+            // notification is sent, the history download goes on (see more data_service.h)
+            data_service_on_notify_tx(event);
+            break;
+        }
+        case BLE_GAP_EVENT_MTU:
+        {
+            ESP_LOGI(g_tag_am, "MTU is %u.", event->mtu.value);
+            break;
+        }
+        case BLE_GAP_EVENT_ADV_COMPLETE:
+        {
+            ESP_LOGI(g_tag_am, "Data service is not advertised any more.");
             break;
         }
         case BLE_GAP_EVENT_DISC_COMPLETE:
         {
             // if device completed scan, we may:
+            // - scan the next stage of scan policy (see scan_policy.h)
+            // - go to sleep (if it was scanning for registration or deletion for too long)
             // - start analysis (if it was periodic scan for data)
-            // - go to sleep (TODO if it was scanning for registration or deletion for too long)
-
-            ESP_LOGI(g_tag_am, "Scanning is complete. Start analysis...");
-            // start analysis of human state (see file analysis_module.h)
-            liferate_t state = start_analysis();
-            if (state == NORMAL)
-                ESP_LOGI(g_tag_am, "State is NORMAL. The code is: %d", state);
-            else if (state == CRITICAL)
-                ESP_LOGI(g_tag_am, "State is CRITICAL. The code is: %d", state);
-            else if (state == VERY_CRITICAL)
-                ESP_LOGI(g_tag_am, "State is VERY CRITICAL. The code is: %d", state);
-            else
-            {
-                ESP_LOGW(g_tag_am, "State is UNKNOWN. The code is: %d", state);
-                ESP_LOGW(g_tag_am, "No new data was recorded.");
-            }
 
-            // turn led off before sleep
-            led_turn_off();
+            TRACE_I(TRACE_SCAN_COMPLETE, event->disc_complete.reason, 0);
+            ext_scan_on_complete();
+            if (scan_policy_next_stage())
+                break;
 
-            ESP_LOGI(g_tag_am, "Go to sleep...");
-            esp_deep_sleep_start();
+            if (g_device_mode == REGISTRATION_MODE || g_device_mode == DELETION_MODE)
+            {
+                // nobody has come during the whole policy, exit the mode
+                ESP_LOGI(g_tag_am, "Scan timeout, quiting mode.");
+                TRACE_I(TRACE_MODE_TIMEOUT, g_device_mode, 0);
+                exit_mode_after_pattern(&LED_PATTERN_MODE_TIMEOUT);
+            }
+            else
+                finish_data_scan();
             break;
         }
         default:
@@ -377,6 +710,228 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
 }
 
 
+// finishes scan of periodic data cycle: stops scan profiling and syncs
+// sensors with backlog (if any) before the data cycle is finished
+void finish_data_scan()
+{
+    // adverts queued in the worker before the scan was cancelled may still
+    // come, the scan is finished only once (the worker keeps running in
+    // light sleep, see more power_mode.h)
+    if (!g_data_scan_is_open)
+        return;
+    g_data_scan_is_open = false;
+    schedule_adv_stop();
+
+    profiler_phase_end(PHASE_SCAN);
+    link_stats_end_scan();  // missed streaks and re-seat flags (see file link_stats.h)
+
+    // store how many adverts passed the prefilter (see file adv_prefilter.h)
+    TRACE_I(TRACE_ADV_STATS, g_adv_filter_stats.seen_cnt, g_adv_filter_stats.passed_cnt);
+
+#ifdef CONFIG_AM_BACKLOG_SYNC
+    // sensors with backlog are connected one by one, the data cycle is
+    // finished after the last one (see file backlog_sync.h), escalation
+    // does not wait for backlog
+    if (!escalation_is_active() && backlog_sync_start(g_ble_addr_type, process_data_packet, finish_data_cycle))
+        return;
+#endif
+
+    finish_data_cycle();
+}
+
+
+// finishes periodic data cycle: analyses collected data and
+// sends device to sleep
+void finish_data_cycle()
+{
+    // start analysis of human state of every subject with registered
+    // devices, the most critical state of all (see file analysis_module.h)
+    profiler_phase_begin(PHASE_ANALYSIS);
+    liferate_t state = UNDEFINED;
+    uint8_t worst_subject_id = 0;   // subject in the most critical state
+    for (uint8_t subject_id = 0; subject_id < MAX_SUBJECTS; subject_id++)
+        if (get_subject_sensors_cnt(subject_id) > 0)
+        {
+            liferate_t subject_state = start_analysis(subject_id);
+            TRACE_I(TRACE_SUBJECT_STATE, subject_id, subject_state);
+#ifdef CONFIG_AM_UPLINK
+            uplink_log_result(subject_id, subject_state, subject_results[subject_id].total_score, get_rtc_time_s());
+#endif
+            data_service_notify_state(subject_id);  // only if a data client is subscribed
+            if (subject_state > state)
+                worst_subject_id = subject_id;
+            state = get_worst_state(state, subject_state);
+        }
+    profiler_phase_end(PHASE_ANALYSIS);
+
+#ifdef CONFIG_AM_UPLINK
+    // forward the log to the CDC if it is due, at once if the state
+    // is critical (see file uplink.h)
+    uplink_poll(state >= CRITICAL);
+#endif
+
+#ifdef CONFIG_AM_ESCALATION
+    // critical state keeps the device awake, until it is not
+    // confirmed any more (see file escalation.h)
+    if (continue_escalation(state, worst_subject_id))
+        return;
+#endif
+
+    // if white list is not empty, then we have registered
+    // devices to get data from => enable timer wakeup with
+    // interval chosen from the most critical state (see sleep_scheduler.h)
+    // if not, we will just go to deepsleep until gpio wakeup
+    esp_err_t wakeup_status = scheduler_enable_wakeup(state, g_cycle_reported_cnt, white_list_len);
+
+    // turn led off before sleep
+    led_turn_off();
+
+    // store durations and charge of this cycle (see files profiler.h and energy.h)
+    profiler_commit_cycle();
+    energy_commit_cycle();
+
+#ifdef CONFIG_AM_LIGHT_SLEEP
+    // short interval costs less in light sleep, the ble stack and the
+    // white list are kept, the next cycle is woken by timer (see more power_mode.h)
+    if (wakeup_status == ESP_OK && power_mode_light_sleep(scheduler_get_interval_ms()))
+        return;
+#endif
+
+    esp_deep_sleep_start();
+}
+
+
+// continues escalation of critical state: raises the alert (if data packets
+// have not raised it yet) and starts the next confirmation round, or clears
+// the alert if the state is not confirmed
+// returns true if device stays awake
+bool continue_escalation(liferate_t state, uint8_t subject_id)
+{
+    if (state < ESCALATION_STATE)
+    {
+        // turn off alert blinking, device goes to sleep
+        if (escalation_clear_alert() == ESP_OK)
+            led_turn_off();
+        return false;
+    }
+
+    if (!escalation_is_active())
+        raise_alert(subject_id, g_last_data_time_us);
+
+    escalation_start_round(state);
+    start_escalation_scan();
+    return true;
+}
+
+
+// raises the alert for given subject by the result of its last analysis
+// (see more escalation.h)
+void raise_alert(uint8_t subject_id, int64_t adv_time_us)
+{
+    analysis_result_t result;
+    if (get_subject_result(subject_id, &result) != ESP_OK)
+        return;
+
+    bool was_active = escalation_is_active();
+    schedule_adv_stop();    // the alert takes the advertising over (see more time_sync.h)
+    if (escalation_raise_alert(g_ble_addr_type, subject_id, &result, adv_time_us) != ESP_OK || was_active)
+        return;
+
+    // start very fast blink, meaning that the alert is raised
+    // (led is not inited in data cycle, see app_main)
+    led_init(GPIO_LED);
+    led_start_pattern(&LED_PATTERN_CRITICAL_ALERT);
+}
+
+
+// starts confirmation round of escalation, scan of registered
+// devices at full duty cycle
+void start_escalation_scan()
+{
+    profiler_phase_begin(PHASE_SCAN);
+    link_stats_begin_scan(SCAN_POLICY_ESCALATION.stages[0].duration_ms);
+    g_data_scan_is_open = true;
+    scan_policy_start(g_ble_addr_type, &SCAN_POLICY_ESCALATION, ble_gap_event);
+}
+
+
+// pushes samples of data packet for storage (see file sample_history.h),
+// packet_time is the RTC time the packet was sent at
+// returns number of pushed samples
+uint8_t process_data_packet(const packet_view_t* packet, uint8_t wl_index, uint32_t packet_time)
+{
+    uint8_t pushed_cnt = 0;
+    uint8_t subject_id = white_list[wl_index].subject_id;  // samples are stored per subject
+
+    if (packet->header == DATA_HEADER && packet->payload_len >= TEMP_DATA_SIZE)
+    {
+        // DATA_HEADER packet carries one value in temperature format,
+        // its channel is defined by kind of source device
+        sensor_kind_t kind = get_sensor_kind_by_uuid16(&white_list[wl_index].device_uuid);
+        sample_channel_t channel = get_default_channel_by_kind(kind);
+        int16_t value = decode_data_value(channel, packet->payload[0], packet->payload[1]);
+        if (push_sample(subject_id, channel, value, wl_index, packet_time) == ESP_OK)
+        {
+            pushed_cnt++;
+#ifdef CONFIG_AM_UPLINK
+            uplink_log_sample(subject_id, channel, value, wl_index, packet_time);
+#endif
+        }
+        TRACE_I(TRACE_PACKET_DATA, wl_index, pushed_cnt);
+    }
+    else if (packet->header == DATA_TLV_HEADER)
+    {
+        // DATA_TLV_HEADER packet carries a batch of samples of
+        // several measurement types (see more app_packet.h)
+        tlv_packet_view_t tlv;
+        if (parse_tlv_packet(&tlv, packet) == -1)
+        {
+            TRACE_E(TRACE_PACKET_ERROR, packet->header, packet->payload_len);
+            return 0;
+        }
+        TRACE_I(TRACE_PACKET_TLV, tlv.seq, tlv.records_len);
+
+#ifdef CONFIG_AM_BACKLOG_SYNC
+        // sensor has more samples, connect to it after the scan
+        // (packets of the sync itself do not count)
+        if ((tlv.flags & TLV_FLAG_BACKLOG) && !backlog_sync_is_active())
+            backlog_sync_mark(wl_index);
+#endif
+
+        tlv_iter_t iter;
+        tlv_sample_t sample;
+        tlv_iter_init(&iter, &tlv);
+        while (tlv_iter_next(&iter, &sample))
+        {
+            // time offset is counted back from the moment the packet was sent
+            uint32_t timestamp = packet_time >= sample.time_offset_s ? packet_time - sample.time_offset_s : 0;
+            int16_t value = decode_meas_value(&sample);
+            sample_channel_t channel = get_channel_by_meas_type(sample.type);
+            if (push_sample(subject_id, channel, value, wl_index, timestamp) == ESP_OK)
+            {
+                pushed_cnt++;
+#ifdef CONFIG_AM_UPLINK
+                uplink_log_sample(subject_id, channel, value, wl_index, timestamp);
+#endif
+            }
+        }
+    }
+
+    return pushed_cnt;
+}
+
+
+// marks white list entry with given index as reported in this cycle
+void mark_reported(uint8_t wl_index)
+{
+    if (wl_index >= WHITE_LIST_SIZE || (g_cycle_reported[wl_index / 32] & (1UL << (wl_index % 32))))
+        return;
+
+    g_cycle_reported[wl_index / 32] |= 1UL << (wl_index % 32);
+    g_cycle_reported_cnt++;
+}
+
+
 // pressing on button during 1 - 5 s causes entering or exiting
 // registration mode
 void on_medium_button_press()
@@ -389,39 +944,24 @@ void on_medium_button_press()
         g_device_mode = REGISTRATION_MODE;
         led_turn_on();
 
+        // new devices belong to the first subject without devices,
+        // short button press switches to the next subject
+        int8_t subject_id = get_free_subject_id();
+        set_registration_subject(subject_id != -1 ? subject_id : 0);
+
         ESP_LOGI(g_tag_am, "Entering register mode.");
+        ESP_LOGI(g_tag_am, "Registering devices of subject %u.", get_registration_subject());
         ESP_LOGI(g_tag_am, "Scanning for registration.......");
 
-        // for registration, device starts discovery
-        struct ble_gap_disc_params disc_params;
-        disc_params.itvl = 0x0040;
-        disc_params.window = 0x0020;
-        disc_params.filter_policy = 0;      // scan all devices
-        disc_params.limited = 0;            // any discovery mode
-        disc_params.passive = 1;            // no scan requests
-        disc_params.filter_duplicates = 0;  // all packages, even duplicates
-
-        // set duration to forever (TODO not forever but some time) until device is found
-        int32_t scan_duration_ms = BLE_HS_FOREVER;
-        ble_gap_disc(g_ble_addr_type, scan_duration_ms, &disc_params, ble_gap_event, NULL);
+        // for registration, device starts discovery, fast at first, then
+        // in background, until timeout (see scan_policy.h)
+        scan_policy_start(g_ble_addr_type, &SCAN_POLICY_REGISTRATION, ble_gap_event);
     }
     else if (g_device_mode == REGISTRATION_MODE)
     {
         // if device is in registration mode now, that means user exit this mode
         ESP_LOGI(g_tag_am, "Quiting register mode.");
-
-        // if white list is not empty, then we have registered
-        // devices to get data from => enable timer wakeup.
-        // if not, we will just go to deepsleep until gpio wakeup
-        if (!white_list_is_empty())
-            ESP_CHECK(esp_sleep_enable_timer_wakeup(DEEP_SLEEP_CYCLE_TIME), g_tag_am);
-
-        // turn led off as signal for exiting registration mode
-        led_turn_off();
-
-        // set device into unspecified mode and go to sleep
-        g_device_mode = UNSPECIFIED_MODE;
-        esp_deep_sleep_start();
+        exit_mode();
     }
 }
 
@@ -441,56 +981,181 @@ void on_long_button_press()
         ESP_LOGI(g_tag_am, "Entering deletion mode.");
         ESP_LOGI(g_tag_am, "Scanning for deletion.......");
 
-        // for deletion, device starts discovery
-        struct ble_gap_disc_params disc_params;
-        disc_params.itvl = 0;
-        disc_params.window = 0;
-        disc_params.filter_policy = 1;      // scan only devices from white list (we can delete only registrated ones)
-        disc_params.limited = 0;            // any discovery mode
-        disc_params.passive = 1;            // no scan requests
-        disc_params.filter_duplicates = 0;  // all packages, even duplicates
-
-        // get white list with addrs to set in ble_gap_wl_set for scan
-        ble_addr_t *wl_addrs;
-        get_addr_white_list(&wl_addrs);
-        ESP_CHECK(ble_gap_wl_set(wl_addrs, white_list_len), g_tag_am);
-        free(wl_addrs);
-
-        // set duration to forever (TODO not forever but some time) until device is found
-        int32_t scan_duration_ms = BLE_HS_FOREVER;
-        ble_gap_disc(g_ble_addr_type, scan_duration_ms, &disc_params, ble_gap_event, NULL);
+        // program white list addrs into the controller for scan (if changed)
+        sync_controller_white_list();
+
+        // for deletion, device starts discovery of registered devices (we can
+        // delete only registrated ones), fast at first, then in background,
+        // until timeout (see scan_policy.h)
+        scan_policy_start(g_ble_addr_type, &SCAN_POLICY_DELETION, ble_gap_event);
     }
     else if (g_device_mode == DELETION_MODE)
     {
         // if device is in deletion mode now, that means user exit this mode
         ESP_LOGI(g_tag_am, "Quiting deletion mode.");
+        exit_mode();
+    }
+}
+
+
+// exits registration or deletion mode and goes to sleep, if white list
+// is not empty data cycles go on
+void exit_mode()
+{
+    adv_prefilter_log_stats();
+
+    // persist changes of the white list, if any were not saved yet
+    wl_storage_save();
+
+    // if white list is not empty, then we have registered
+    // devices to get data from => enable timer wakeup.
+    // if not, we will just go to deepsleep until gpio wakeup
+    // no data was collected yet, so the state is undefined
+    // and no sensor is treated as missing (see sleep_scheduler.h)
+    scheduler_enable_wakeup(UNDEFINED, white_list_len, white_list_len);
+
+    // turn led off as signal for exiting the mode
+    led_turn_off();
 
-        // if white list is not empty, then we have registered
-        // devices to get data from => enable timer wakeup.
-        // if not, we will just go to deepsleep until gpio wakeup
-        if (!white_list_is_empty())
-            ESP_CHECK(esp_sleep_enable_timer_wakeup(DEEP_SLEEP_CYCLE_TIME), g_tag_am);
+    // set device into unspecified mode and go to sleep
+    g_device_mode = UNSPECIFIED_MODE;
+    energy_commit_cycle();
+    esp_deep_sleep_start();
+}
 
-        // turn led off as signal for exiting registration mode
-        led_turn_off();
 
-        // set device into unspecified mode and go to sleep
-        g_device_mode = UNSPECIFIED_MODE;
-        esp_deep_sleep_start();
+// plays the led pattern and exits the mode when it ends, the worker is not
+// blocked meanwhile, the mode is exited by a timer posting exit_mode()
+void exit_mode_after_pattern(const led_pattern_t* pattern)
+{
+    if (g_mode_exit_timer == NULL)
+    {
+        const esp_timer_create_args_t mode_exit_timer_args = {
+            .name = "mode exit timer",
+            .callback = &mode_exit_timer_cb,
+            .arg = NULL
+        };
+        ESP_CHECK(esp_timer_create(&mode_exit_timer_args, &g_mode_exit_timer), g_tag_am);
     }
+
+    led_start_pattern(pattern);
+    if (g_mode_exit_timer == NULL ||
+        esp_timer_start_once(g_mode_exit_timer, (uint64_t)led_get_pattern_duration_ms(pattern) * 1000) != ESP_OK)
+        exit_mode();    // no timer, the pattern is cut short
+}
+
+
+// mode exit timer callback, runs in the esp_timer task, so exit_mode() is
+// posted to the worker, if it can't be posted it is retried a bit later
+static void mode_exit_timer_cb(void* arg)
+{
+    if (worker_post_call(exit_mode) != ESP_OK)
+        ESP_CHECK(esp_timer_start_once(g_mode_exit_timer, MODE_EXIT_RETRY_US), g_tag_am);
 }
 
 
-// no action on button press under 1 s
+// pressing on button under 1 s switches registration to the next subject
+// in registration mode, otherwise dumps the trace over UART (see more trace.h)
+// and advertises the data service (see more data_service.h)
 void on_short_button_press()
 {
+    if (g_device_mode == REGISTRATION_MODE)
+    {
+        set_registration_subject((get_registration_subject() + 1) % MAX_SUBJECTS);
+        TRACE_I(TRACE_REG_SUBJECT, get_registration_subject(), 0);
+        ESP_LOGI(g_tag_am, "Registering devices of subject %u.", get_registration_subject());
+    }
+    else if (g_device_mode == UNSPECIFIED_MODE)
+    {
+        trace_dump();
+        data_service_adv_start(g_ble_addr_type, ble_gap_event);
+    }
+}
+
+
+// handles discovered advert, adv_phy - PHYs the advert was received on
+// if new device was discovered, we may:
+// - connect for registration
+// - connect for deletion
+// - get data from sensor
+void handle_advert(struct ble_gap_disc_desc *disc_desc, uint8_t adv_phy)
+{
+    int64_t adv_time_us = esp_timer_get_time();   // alert latency is measured from here
+
+    // drop uninteresting adverts before full parsing and logging, the advert
+    // is already a candidate by its content (see more adv_prefilter.h)
+    adv_filter_mode_t filter_mode = get_adv_filter_mode();
+    if (!adv_prefilter(disc_desc, filter_mode))
+        return;
+
+    TRACE_I(TRACE_ADV_CANDIDATE,
+            disc_desc->addr.val[0] | (disc_desc->addr.val[1] << 8) |
+            (disc_desc->addr.val[2] << 16) | ((uint32_t)disc_desc->addr.val[3] << 24),
+            disc_desc->addr.val[4] | (disc_desc->addr.val[5] << 8) | ((uint8_t)disc_desc->rssi << 16));
 
+    struct ble_hs_adv_fields fields;
+    ble_hs_adv_parse_fields(&fields, disc_desc->data, disc_desc->length_data);
+
+    // check package format, packet view points into advert data (see more app_packet.h)
+    packet_view_t packet;
+    if (parse_packet_view(&packet, fields.mfg_data, fields.mfg_data_len) == -1)
+    {
+        TRACE_E(TRACE_PACKET_ERROR, 0, fields.mfg_data_len);
+        return;
+    }
+
+    // if this device is in registration mode try to connect
+    // if this device is in deletion mode try to connect
+    if(g_device_mode == REGISTRATION_MODE)
+        connect_if_interesting(&fields, &packet, disc_desc, adv_phy);
+    else if(g_device_mode == DELETION_MODE)
+        delete_if_reachable(&packet, disc_desc, adv_phy);
+    else
+    {
+        // if this device is in unspecified mode try to get data
+        // header must be DATA_HEADER or DATA_TLV_HEADER meaning
+        // discovered device has data to retrieve, adverts left
+        // in the queue after the scan is finished are dropped
+        if (!g_data_scan_is_open)
+            return;
+
+        int8_t wl_index = get_white_list_index_by_addr(&disc_desc->addr); // index of source device
+        link_stats_on_advert(wl_index, disc_desc->rssi, adv_time_us);     // see more link_stats.h
+        if (wl_index != -1 && process_data_packet(&packet, wl_index, get_rtc_time_s()) > 0)
+        {
+            // samples are stored, repeats of the packet are duplicates from now on
+            uint16_t seq;
+            if (get_packet_seq(&seq, fields.mfg_data, fields.mfg_data_len) == 0)
+                seq_dedup_mark(wl_index, seq);
+
+            // mark sensor as reported, if every registered sensor has
+            // reported, there is no reason to scan further
+            mark_reported(wl_index);
+#ifdef CONFIG_AM_ESCALATION
+            // analyse the subject right away, so a critical state is alerted
+            // without waiting for the end of scan (see more escalation.h)
+            uint8_t subject_id = white_list[wl_index].subject_id;
+            g_last_data_time_us = adv_time_us;
+            if (start_analysis(subject_id) >= ESCALATION_STATE)
+                raise_alert(subject_id, adv_time_us);
+#endif
+#ifdef CONFIG_AM_DATA_SCAN_EARLY_STOP
+            // confirmation rounds of escalation always scan till the end
+            if (g_cycle_reported_cnt == white_list_len && !escalation_is_active())
+            {
+                TRACE_I(TRACE_SCAN_EARLY_STOP, g_cycle_reported_cnt, white_list_len);
+                scan_policy_cancel();   // no BLE_GAP_EVENT_DISC_COMPLETE after cancel
+                finish_data_scan();
+            }
+#endif
+        }
+    }
 }
 
 
 // check if device (sensor) is reachable and interesting to
 // connect for registration (adds sensor to white list)
-void connect_if_interesting(struct ble_hs_adv_fields *fields, struct ble_gap_disc_desc *disc_desc)
+void connect_if_interesting(struct ble_hs_adv_fields *fields, const packet_view_t *packet, struct ble_gap_disc_desc *disc_desc, uint8_t adv_phy)
 {
     // check rssi
     if (disc_desc->rssi < RSSI_ACCEPTABLE_LVL)
@@ -511,29 +1176,21 @@ void connect_if_interesting(struct ble_hs_adv_fields *fields, struct ble_gap_dis
     {
         // check package format, header must be REG_HEADER meaning
         // discovered device wants registration too
-        uint16_t header;
-        uint8_t* buffer = NULL;
-        if(open_packet(&header, buffer, fields->mfg_data, fields->mfg_data_len) == -1)
-        {
-            ESP_LOGE(g_tag_am, "Error opening packet!!!");
-            ESP_LOGE(g_tag_am, "Header: %d", header);
-            return;
-        }
-
-        ESP_LOGI(g_tag_am, "Header: %d", header);
-
         // if header is REG_HEADER, stop discovery and connect
         // connection establishment needed for reliability and
         // confirmation of devices on both sides
-        if (header == REG_HEADER)
+        if (packet->header == REG_HEADER)
         {
             char mac_str[MAC_STR_SIZE];
             get_mac_str(disc_desc->addr.val, &mac_str);
             ESP_LOGI(g_tag_am, "Device %s is interesting.", mac_str);
 
-            ble_gap_disc_cancel(); // stop scan before connection initialisation
-            push_to_white_list(fields->uuids16[uuid_in_inter_index], disc_desc->addr); // add to white list new addr
-            ble_gap_connect(g_ble_addr_type, &disc_desc->addr, BLE_HS_FOREVER, NULL, ble_gap_event, NULL); // connect
+            scan_policy_cancel(); // stop scan before connection initialisation, resumed after disconnect
+            push_to_white_list(fields->uuids16[uuid_in_inter_index], disc_desc->addr, adv_phy); // add to white list new addr
+            int8_t wl_index = get_white_list_index_by_addr(&disc_desc->addr);
+            link_stats_reset(wl_index);     // new link has no statistics yet
+            seq_dedup_reset(wl_index);      // nor received sequence numbers
+            ext_scan_connect(g_ble_addr_type, &disc_desc->addr, adv_phy, MODE_CONNECT_TIMEOUT_MS, NULL, ble_gap_event, NULL); // connect
         }
     }
 }
@@ -541,7 +1198,7 @@ void connect_if_interesting(struct ble_hs_adv_fields *fields, struct ble_gap_dis
 
 // check if device (sensor) is reachable and connect for
 // deletion (deletes sensor from white list)
-void delete_if_reachable(struct ble_hs_adv_fields *fields, struct ble_gap_disc_desc *disc_desc)
+void delete_if_reachable(const packet_view_t *packet, struct ble_gap_disc_desc *disc_desc, uint8_t adv_phy)
 {
     // check rssi
     if (disc_desc->rssi < RSSI_ACCEPTABLE_LVL)
@@ -554,37 +1211,137 @@ void delete_if_reachable(struct ble_hs_adv_fields *fields, struct ble_gap_disc_d
 
     // check package format, header must be DEL_HEADER meaning
     // discovered device wants deletion too
-    uint16_t header;
-    uint8_t* buffer = NULL;
-    if(open_packet(&header, buffer, fields->mfg_data, fields->mfg_data_len) == -1)
-    {
-        ESP_LOGE(g_tag_am, "Error opening packet!!!");
-        ESP_LOGE(g_tag_am, "Header: %d", header);
-        return;
-    }
-
-    ESP_LOGI(g_tag_am, "Header: %d", header);
-
     // if header is DEL_HEADER, stop discovery and connect
     // connection establishment needed for reliability and
     // confirmation of devices on both sides
-    if (header == DEL_HEADER)
+    if (packet->header == DEL_HEADER)
     {
-        ble_gap_disc_cancel();
-        ble_gap_connect(g_ble_addr_type, &disc_desc->addr, BLE_HS_FOREVER, NULL, ble_gap_event, NULL);
+        scan_policy_cancel();   // resumed after disconnect
+        ext_scan_connect(g_ble_addr_type, &disc_desc->addr, adv_phy, MODE_CONNECT_TIMEOUT_MS, NULL, ble_gap_event, NULL);
     }
 }
 
 
 // callback for accessing time of analysis module-gateway
-// to synchronise sensors
+// to synchronise sensors (see more time_sync.h)
 static int read_time(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
-    // TODO get time for reading and further synchronisation
-    ESP_LOGI("TIME", "Start reading time....");
+    uint8_t time_buff[CURRENT_TIME_SIZE];
+
+    // set time, if written
+    if (ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR)
+    {
+        uint16_t time_len;
+        if (OS_MBUF_PKTLEN(ctxt->om) != CURRENT_TIME_SIZE)
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+        ble_hs_mbuf_to_flat(ctxt->om, time_buff, sizeof(time_buff), &time_len);
+        if (time_sync_set_current_time(time_buff, time_len) != ESP_OK)
+            return BLE_ATT_ERR_UNLIKELY;
+
+        ESP_LOGI("TIME", "Time is set.");
+        return 0;
+    }
+
+    size_t time_len = time_sync_serialize_current_time(time_buff, sizeof(time_buff));
+    int rc = os_mbuf_append(ctxt->om, time_buff, time_len);
+    return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+
+// callback for reading wake schedule of analysis module-gateway,
+// so sensors can advertise only when gateway scans (see more time_sync.h)
+static int read_schedule(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t schedule_buff[WAKE_SCHEDULE_SIZE];
+    size_t schedule_len = time_sync_serialize_schedule(schedule_buff, sizeof(schedule_buff),
+            scheduler_get_next_wakeup_ms(), get_data_scan_window_ms(), scheduler_get_interval_ms());
+
+    int rc = os_mbuf_append(ctxt->om, schedule_buff, schedule_len);
+    return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+
+// callback for reading min/avg/max durations of wake cycle phases
+// (see more profiler.h)
+static int read_profiler_stats(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t stats_buff[PHASE_CNT * PROFILER_STATS_ENTRY_SIZE];
+    size_t stats_len = profiler_serialize_stats(stats_buff, sizeof(stats_buff));
+
+    int rc = os_mbuf_append(ctxt->om, stats_buff, stats_len);
+    return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+
+// callback for reading the latest trace records (see more trace.h)
+static int read_trace(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t trace_buff[TRACE_CHR_MAX_LEN];
+    size_t trace_len = trace_serialize(trace_buff, sizeof(trace_buff));
+
+    int rc = os_mbuf_append(ctxt->om, trace_buff, trace_len);
+    return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+
+// callback for reading link statistics of registered sensors (see more link_stats.h)
+static int read_link_stats(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t link_buff[LINK_CHR_MAX_LEN];
+    size_t link_len = link_stats_serialize(link_buff, sizeof(link_buff));
+
+    int rc = os_mbuf_append(ctxt->om, link_buff, link_len);
+    return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+
+// callback for reading the current state of every subject (see more data_service.h)
+static int read_state(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t state_buff[DATA_STATE_MAX_LEN];
+    size_t state_len = data_service_serialize_state(state_buff, sizeof(state_buff));
+
+    int rc = os_mbuf_append(ctxt->om, state_buff, state_len);
+    return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+
+// callback for requesting history download, the history is
+// streamed in notifications (see more data_service.h)
+static int request_history(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR)
+        return BLE_ATT_ERR_REQ_NOT_SUPPORTED;
+
+    uint8_t request[DATA_HISTORY_REQ_SIZE];
+    uint16_t request_len;
+    if (OS_MBUF_PKTLEN(ctxt->om) != DATA_HISTORY_REQ_SIZE)
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+    ble_hs_mbuf_to_flat(ctxt->om, request, sizeof(request), &request_len);
+    return data_service_start_history(conn_handle, request, request_len);
+}
+
+
+// callback for reading battery level in % (see more energy.h)
+static int read_battery_level(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t battery_level = energy_get_battery_level();
+
+    int rc = os_mbuf_append(ctxt->om, &battery_level, sizeof(battery_level));
+    return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+
+// callback for reading times and charge of the last cycle and
+// the charge since power-on (see more energy.h)
+static int read_energy(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t energy_buff[ENERGY_CHR_SIZE];
+    size_t energy_len = energy_serialize(energy_buff, sizeof(energy_buff));
 
-    const char* str = "Hello from the server";
-    int rc = os_mbuf_append(ctxt->om, str, strlen(str));
+    int rc = os_mbuf_append(ctxt->om, energy_buff, energy_len);
     return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
 }
 
@@ -0,0 +1,293 @@
+/*
+ * power_mode.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_POWER_MODE_H_
+#define MAIN_POWER_MODE_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_sleep.h"
+#include "esp_pm.h"
+#include "esp_attr.h"
+#include "driver/gpio.h"
+#include "esp_check_err.h"
+#include "profiler.h"
+#include "energy.h"
+#include "sleep_scheduler.h"
+#include "worker.h"
+#include "trace.h"
+#include "sdkconfig.h"
+
+// Description:
+// Every deep sleep wake is a reboot: boot, nvs, nimble init and host sync are paid
+// again before the scan starts. For short intervals this costs more than sleeping
+// lightly, so the gateway has a second power mode, light sleep with the NimBLE stack
+// (and the controller white list) kept resident. The cycle is awake while it holds
+// a pm lock, between cycles the lock is released and the chip enters light sleep
+// from idle automatically, the controller sleeps in modem sleep. The next cycle is
+// woken by an esp_timer, which posts it to the worker (see worker.h).
+// The mode is chosen before every sleep by the interval of the scheduler:
+//   deep sleep  - interval * SLEEP_UA + reboot * CPU_UA
+//   light sleep - interval * LIGHT_SLEEP_UA
+// both cost the same at the crossover interval reboot * CPU_UA / (LIGHT_SLEEP_UA -
+// SLEEP_UA), shorter intervals are slept in light sleep. The reboot is the sum of
+// average durations of the boot phases measured by the profiler (see profiler.h) on
+// deep sleep wakes, until it is measured AM_LIGHT_SLEEP_CROSSOVER_MS is used. The
+// profiler records the resume phase of light sleep wakes, so both paths can be
+// compared. A button press wakes from light sleep and is handed over to the full
+// boot: the gateway goes to deep sleep, the still pressed button wakes it at once,
+// and the press is handled as after any gpio wakeup.
+
+#define POWER_CROSSOVER_MS          CONFIG_AM_LIGHT_SLEEP_CROSSOVER_MS  // crossover until the reboot is measured
+#define POWER_BUTTON_DEBOUNCE_US    (10 * 1000) // debounce of button press, as in button.h
+#define POWER_WAKE_RETRY_US         (100 * 1000)    // retry of the wake, if the worker queue is full
+
+_Static_assert(ENERGY_LIGHT_SLEEP_UA > ENERGY_SLEEP_UA, "light sleep must cost more than deep sleep");
+
+// enum of reasons to give up the resident ble stack
+typedef enum {
+    POWER_EXIT_BUTTON = 0,          // button is pressed, handled after full boot
+    POWER_EXIT_LONG_INTERVAL        // interval is longer than the crossover
+} power_exit_reason_t;
+
+
+esp_err_t power_mode_init(gpio_num_t button_gpio, worker_call_fn* wake_cb);
+uint32_t power_mode_get_crossover_ms();
+bool power_mode_light_sleep(uint32_t interval_ms);
+bool power_mode_is_resident();
+int64_t power_mode_get_cycle_start_us();
+static void power_on_wake();
+static void power_on_button_press();
+static void power_wake_timer_cb(void* arg);
+static void power_button_timer_cb(void* arg);
+static void IRAM_ATTR power_button_isr_handler(void* arg);
+
+
+const char* g_tag_power = "POWER";  // tag used in ESP_CHECK
+
+bool power_is_initialised = false;              // flag to indicate whether light sleep may be used
+bool power_is_resident = false;                 // flag to indicate that the cycle was woken from light sleep
+bool power_is_sleeping = false;                 // flag to indicate that no cycle is open, light sleep till the wake
+esp_pm_lock_handle_t power_awake_lock = NULL;   // held while a cycle is awake
+esp_timer_handle_t power_wake_timer = NULL;     // timer that wakes the next cycle
+esp_timer_handle_t power_button_timer = NULL;   // timer for debouncing of button press
+gpio_num_t power_button_gpio;                   // gpio of the button
+worker_call_fn* power_wake_cb = NULL;           // starts the cycle, called by the worker
+int64_t power_wake_time_us = 0;                 // time of the last wake from light sleep
+uint32_t power_resident_cycles_cnt = 0;         // number of cycles woken from light sleep since boot
+
+// reboot duration measured on deep sleep wakes, stored in RTC memory, as the profiler
+// window may hold light sleep wakes only, 0 if not measured yet
+RTC_DATA_ATTR uint32_t power_reboot_us = 0;
+
+
+// inits light sleep: the pm lock is taken at once, so the chip does not enter light
+// sleep during the cycle, button wakes from light sleep, wake_cb starts the next cycle
+// must be called in the data cycle boot, before the ble stack is inited
+esp_err_t power_mode_init(gpio_num_t button_gpio, worker_call_fn* wake_cb)
+{
+    if (power_is_initialised)   // check if already initialised
+        return ESP_FAIL;
+
+    power_button_gpio = button_gpio;
+    power_wake_cb = wake_cb;
+
+    // without the lock the cycle can't be kept awake, light sleep is not used then
+    if (esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "cycle", &power_awake_lock) != ESP_OK)
+        return ESP_FAIL;
+    ESP_CHECK(esp_pm_lock_acquire(power_awake_lock), g_tag_power);
+
+    // cpu frequency is not scaled, so scan timing is the same as after deep sleep wake
+    esp_pm_config_t pm_cnfg = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .light_sleep_enable = true
+    };
+    if (esp_pm_configure(&pm_cnfg) != ESP_OK)
+        return ESP_FAIL;
+
+    // wake timer must not skip events, such timers do not wake the chip
+    const esp_timer_create_args_t wake_timer_args = {
+        .name = "wake timer",
+        .callback = &power_wake_timer_cb,
+        .arg = NULL,
+        .skip_unhandled_events = false
+    };
+    ESP_CHECK(esp_timer_create(&wake_timer_args, &power_wake_timer), g_tag_power);
+
+    const esp_timer_create_args_t button_timer_args = {
+        .name = "power button timer",
+        .callback = &power_button_timer_cb,
+        .arg = NULL
+    };
+    ESP_CHECK(esp_timer_create(&button_timer_args, &power_button_timer), g_tag_power);
+
+    // button is pressed as long as its level is high, the level wakes from light sleep
+    gpio_config_t gpio_button_cnfg = {};
+    gpio_button_cnfg.pin_bit_mask = (1ULL << button_gpio);
+    gpio_button_cnfg.mode = GPIO_MODE_INPUT;
+    gpio_button_cnfg.pull_up_en = GPIO_PULLUP_DISABLE;      // low level on release
+    gpio_button_cnfg.pull_down_en = GPIO_PULLDOWN_ENABLE;   // high level on press
+    gpio_button_cnfg.intr_type = GPIO_INTR_HIGH_LEVEL;
+    ESP_CHECK(gpio_config(&gpio_button_cnfg), g_tag_power);
+
+    gpio_install_isr_service(0);   // fails if installed already, it is used as is then
+    ESP_CHECK(gpio_isr_handler_add(button_gpio, power_button_isr_handler, NULL), g_tag_power);
+    ESP_CHECK(gpio_wakeup_enable(button_gpio, GPIO_INTR_HIGH_LEVEL), g_tag_power);
+    ESP_CHECK(esp_sleep_enable_gpio_wakeup(), g_tag_power);
+
+    power_is_initialised = true;
+    return ESP_OK;
+}
+
+
+// gets the interval up to which light sleep costs less than deep sleep
+uint32_t power_mode_get_crossover_ms()
+{
+    // reboot of deep sleep wake, till the scan may start
+    const profiler_phase_t reboot_phases[] = {PHASE_BOOT, PHASE_NVS_INIT, PHASE_BLE_INIT, PHASE_BLE_SYNC};
+    uint32_t reboot_us = 0;
+    bool is_measured = true;
+    for (uint8_t i = 0; i < sizeof(reboot_phases) / sizeof(reboot_phases[0]); i++)
+    {
+        phase_stats_t stats;
+        profiler_get_stats(reboot_phases[i], &stats);
+        if (stats.cycles_cnt == 0)
+        {
+            is_measured = false;
+            break;
+        }
+        reboot_us += stats.avg_us;
+    }
+    if (is_measured)
+        power_reboot_us = reboot_us;
+
+    if (power_reboot_us == 0)
+        return POWER_CROSSOVER_MS;
+
+    uint64_t crossover_ms = (uint64_t)power_reboot_us * ENERGY_CPU_UA / (ENERGY_LIGHT_SLEEP_UA - ENERGY_SLEEP_UA) / 1000;
+    return crossover_ms > UINT32_MAX ? UINT32_MAX : crossover_ms;
+}
+
+
+// goes to light sleep till the next cycle, if the interval is not longer than
+// the crossover, the current cycle must be committed already
+// returns false if deep sleep costs less, the caller goes to deep sleep then
+bool power_mode_light_sleep(uint32_t interval_ms)
+{
+    if (!power_is_initialised)
+        return false;
+
+    uint32_t crossover_ms = power_mode_get_crossover_ms();
+    if (interval_ms > crossover_ms)
+    {
+        if (power_is_resident)
+            TRACE_I(TRACE_RESIDENT_EXIT, POWER_EXIT_LONG_INTERVAL, power_resident_cycles_cnt);
+        return false;
+    }
+
+    if (esp_timer_start_once(power_wake_timer, (uint64_t)interval_ms * 1000) != ESP_OK)
+        return false;
+
+    ESP_LOGI(g_tag_power, "Light sleep for %lu ms (crossover %lu ms).", (unsigned long)interval_ms,
+             (unsigned long)crossover_ms);
+    TRACE_I(TRACE_LIGHT_SLEEP, interval_ms, crossover_ms);
+
+    // idle task enters light sleep as soon as the lock is released
+    power_is_sleeping = true;
+    ESP_CHECK(esp_pm_lock_release(power_awake_lock), g_tag_power);
+    return true;
+}
+
+
+// checks if the current cycle was woken from light sleep
+bool power_mode_is_resident()
+{
+    return power_is_resident;
+}
+
+
+// gets start of the current cycle (esp_timer_get_time), 0 if it started with reset
+int64_t power_mode_get_cycle_start_us()
+{
+    return power_is_resident ? power_wake_time_us : 0;
+}
+
+
+// opens the cycle woken from light sleep and starts it
+static void power_on_wake()
+{
+    power_is_resident = true;
+    power_is_sleeping = false;
+    power_resident_cycles_cnt++;
+    TRACE_I(TRACE_WAKEUP, ESP_SLEEP_WAKEUP_TIMER, power_resident_cycles_cnt);
+
+    // durations and charge are counted from the wake (see files profiler.h and energy.h)
+    profiler_begin_cycle(power_wake_time_us);
+    energy_begin_cycle();
+
+    power_wake_cb();
+}
+
+
+// hands the button press over to the full boot, the button is still pressed,
+// so the gpio wakeup of deep sleep wakes the gateway at once
+static void power_on_button_press()
+{
+    ESP_LOGI(g_tag_power, "Button is pressed, go to deep sleep to handle it.");
+    TRACE_I(TRACE_RESIDENT_EXIT, POWER_EXIT_BUTTON, power_resident_cycles_cnt);
+
+    // if the button is released before, data cycles go on after the shortest interval
+    ESP_CHECK(esp_sleep_enable_timer_wakeup((uint64_t)SCHED_MIN_INTERVAL_MS * 1000), g_tag_power);
+
+    // between cycles the last one is committed already, only the light sleep is added
+    if (power_is_sleeping)
+        energy_commit_light_sleep();
+    else
+        energy_commit_cycle();
+    esp_deep_sleep_start();
+}
+
+
+// callback of the wake timer, the cycle is kept awake from now on, if the
+// cycle can't be posted, the gateway sleeps again and the wake is retried
+static void power_wake_timer_cb(void* arg)
+{
+    ESP_CHECK(esp_pm_lock_acquire(power_awake_lock), g_tag_power);
+    power_wake_time_us = esp_timer_get_time();
+    if (worker_post_call(power_on_wake) == ESP_OK)
+        return;
+
+    ESP_CHECK(esp_timer_start_once(power_wake_timer, POWER_WAKE_RETRY_US), g_tag_power);
+    ESP_CHECK(esp_pm_lock_release(power_awake_lock), g_tag_power);
+}
+
+
+// callback for the debounce timer, the press is handed over if the
+// button is still pressed, otherwise it is waited for again
+static void power_button_timer_cb(void* arg)
+{
+    if (gpio_get_level(power_button_gpio) == 1)
+        worker_post_call(power_on_button_press);
+    else
+        gpio_intr_enable(power_button_gpio);
+}
+
+
+// interrupt service routine handler for the button gpio, level interrupt
+// is disabled until the debounce is over
+static void power_button_isr_handler(void* arg)
+{
+    gpio_intr_disable(power_button_gpio);
+    esp_timer_start_once(power_button_timer, POWER_BUTTON_DEBOUNCE_US);
+}
+
+
+#endif /* MAIN_POWER_MODE_H_ */
@@ -0,0 +1,226 @@
+/*
+ * profiler.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_PROFILER_H_
+#define MAIN_PROFILER_H_
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_timer.h"
+#include "esp_check_err.h"
+#include "sdkconfig.h"
+
+// Description:
+// The profiler measures how long every phase of a wake cycle takes. A phase is
+// opened with profiler_phase_begin() and closed with profiler_phase_end(), both
+// take a timestamp from esp_timer_get_time(), so the durations are in us since
+// boot (the boot phase itself is measured from 0 to the entry of app_main). The
+// durations of the current cycle are kept in RAM and are moved to a rolling
+// window of the last PROFILER_WINDOW_CYCLES cycles by profiler_commit_cycle(),
+// which must be called right before going to sleep. The window is stored in RTC
+// memory, so it persists across deep sleep cycles. Phases that did not run in a
+// cycle are marked as not measured and are ignored in the statistics.
+// A cycle woken from light sleep has no boot (see power_mode.h), it is opened by
+// profiler_begin_cycle() instead, so the boot phases are measured on deep sleep
+// wakes only and the resume phase on light sleep wakes only.
+
+#define PROFILER_WINDOW_CYCLES      CONFIG_AM_PROFILER_WINDOW_CYCLES
+#define PROFILER_NOT_MEASURED       UINT32_MAX  // mark for phase that did not run in a cycle
+#define PROFILER_STATS_ENTRY_SIZE   (3 * sizeof(uint32_t))  // min, avg, max in serialized form
+
+// enum of profiled phases of the wake cycle
+typedef enum {
+    PHASE_BOOT = 0,     // from reset to the entry of app_main
+    PHASE_LED_INIT,     // led_init
+    PHASE_BUTTON_INIT,  // button_init
+    PHASE_NVS_INIT,     // nvs_flash_init
+    PHASE_BLE_INIT,     // nimble port init and gatt registration
+    PHASE_BLE_SYNC,     // from host task start to ble_app_on_sync
+    PHASE_SCAN,         // from ble_gap_disc to the end of scanning
+    PHASE_ANALYSIS,     // start_analysis
+    PHASE_CYCLE,        // whole cycle, from reset (or light sleep wake) to sleep start
+    PHASE_ALERT,        // from receipt of the critical data advert to the alert (see escalation.h)
+    PHASE_BACKLOG,      // backlog sync of every marked sensor (see backlog_sync.h)
+    PHASE_RESUME,       // from light sleep wake to the start of scanning (see power_mode.h)
+    PHASE_CNT
+} profiler_phase_t;
+
+// struct that describes statistics of a phase over the window
+typedef struct {
+    uint32_t min_us;
+    uint32_t avg_us;
+    uint32_t max_us;
+    uint8_t cycles_cnt; // number of cycles in which the phase was measured
+} phase_stats_t;
+
+
+esp_err_t profiler_init();
+esp_err_t profiler_begin_cycle(int64_t cycle_start_us);
+void profiler_phase_begin(profiler_phase_t phase);
+void profiler_phase_end(profiler_phase_t phase);
+void profiler_phase_record(profiler_phase_t phase, uint32_t duration_us);
+esp_err_t profiler_commit_cycle();
+esp_err_t profiler_get_stats(profiler_phase_t phase, phase_stats_t* stats);
+size_t profiler_serialize_stats(uint8_t* dest_buff, size_t dest_buff_len);
+
+
+bool profiler_is_initialised = false;       // flag to indicate whether profiler has been inited
+int64_t phase_begin_time[PHASE_CNT];        // begin timestamps of phases in current cycle
+uint32_t phase_cur_durations[PHASE_CNT];    // durations of phases in current cycle
+int64_t profiler_cycle_start_us = 0;        // start of current cycle, 0 - reset
+
+// rolling window of phase durations, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR uint32_t phase_durations[PROFILER_WINDOW_CYCLES][PHASE_CNT];
+RTC_DATA_ATTR uint8_t profiler_head = 0;        // index of the window slot to write next
+RTC_DATA_ATTR uint8_t profiler_cycles_cnt = 0;  // number of filled window slots
+
+
+// inits the profiler, must be called at the very beginning of app_main
+esp_err_t profiler_init()
+{
+    if (profiler_is_initialised)    // check if already initialised
+        return ESP_FAIL;
+
+    for (uint8_t i = 0; i < PHASE_CNT; i++)
+    {
+        phase_begin_time[i] = 0;
+        phase_cur_durations[i] = PROFILER_NOT_MEASURED;
+    }
+
+    // boot phase ends right now, cycle phase started at reset
+    phase_cur_durations[PHASE_BOOT] = (uint32_t)esp_timer_get_time();
+
+    profiler_is_initialised = true;
+    return ESP_OK;
+}
+
+
+// opens a cycle that does not start with reset (wake from light sleep),
+// every phase is not measured until it runs again
+esp_err_t profiler_begin_cycle(int64_t cycle_start_us)
+{
+    if (!profiler_is_initialised)   // check if already initialised
+        return ESP_FAIL;
+
+    for (uint8_t i = 0; i < PHASE_CNT; i++)
+        phase_cur_durations[i] = PROFILER_NOT_MEASURED;
+
+    profiler_cycle_start_us = cycle_start_us;
+    return ESP_OK;
+}
+
+
+// opens a phase by storing its begin timestamp
+void profiler_phase_begin(profiler_phase_t phase)
+{
+    if (phase >= PHASE_CNT)
+        return;
+
+    phase_begin_time[phase] = esp_timer_get_time();
+}
+
+
+// closes a phase by storing its duration
+void profiler_phase_end(profiler_phase_t phase)
+{
+    if (phase >= PHASE_CNT)
+        return;
+
+    phase_cur_durations[phase] = (uint32_t)(esp_timer_get_time() - phase_begin_time[phase]);
+}
+
+
+// stores duration of a phase measured elsewhere, e.g. from a timestamp of an event
+void profiler_phase_record(profiler_phase_t phase, uint32_t duration_us)
+{
+    if (phase >= PHASE_CNT)
+        return;
+
+    phase_cur_durations[phase] = duration_us;
+}
+
+
+// moves durations of the current cycle to the rolling window
+esp_err_t profiler_commit_cycle()
+{
+    if (!profiler_is_initialised)   // check if already initialised
+        return ESP_FAIL;
+
+    // the cycle lasts from reset (or wake) till now
+    phase_cur_durations[PHASE_CYCLE] = (uint32_t)(esp_timer_get_time() - profiler_cycle_start_us);
+
+    memcpy(phase_durations[profiler_head], phase_cur_durations, sizeof(phase_cur_durations));
+    profiler_head = (profiler_head + 1) % PROFILER_WINDOW_CYCLES;
+    if (profiler_cycles_cnt < PROFILER_WINDOW_CYCLES)
+        profiler_cycles_cnt++;
+
+    return ESP_OK;
+}
+
+
+// calculates min, avg and max duration of a phase over the window
+esp_err_t profiler_get_stats(profiler_phase_t phase, phase_stats_t* stats)
+{
+    if (phase >= PHASE_CNT || stats == NULL)
+        return ESP_FAIL;
+
+    uint64_t sum = 0;
+    stats->min_us = UINT32_MAX;
+    stats->max_us = 0;
+    stats->cycles_cnt = 0;
+    for (uint8_t i = 0; i < profiler_cycles_cnt; i++)
+    {
+        uint32_t duration = phase_durations[i][phase];
+        if (duration == PROFILER_NOT_MEASURED)  // skip cycles in which phase did not run
+            continue;
+
+        if (duration < stats->min_us)
+            stats->min_us = duration;
+        if (duration > stats->max_us)
+            stats->max_us = duration;
+        sum += duration;
+        stats->cycles_cnt++;
+    }
+
+    if (stats->cycles_cnt == 0) // phase was never measured
+    {
+        stats->min_us = 0;
+        stats->avg_us = 0;
+        return ESP_OK;
+    }
+
+    stats->avg_us = (uint32_t)(sum / stats->cycles_cnt);
+    return ESP_OK;
+}
+
+
+// writes min, avg and max of every phase as little-endian uint32 values
+// returns number of written bytes
+size_t profiler_serialize_stats(uint8_t* dest_buff, size_t dest_buff_len)
+{
+    if (dest_buff == NULL || dest_buff_len < PHASE_CNT * PROFILER_STATS_ENTRY_SIZE)
+        return 0;
+
+    size_t len = 0;
+    for (uint8_t i = 0; i < PHASE_CNT; i++)
+    {
+        phase_stats_t stats;
+        profiler_get_stats(i, &stats);
+
+        uint32_t values[] = {stats.min_us, stats.avg_us, stats.max_us};
+        for (uint8_t j = 0; j < 3; j++)
+            for (uint8_t k = 0; k < sizeof(uint32_t); k++)
+                dest_buff[len++] = (values[j] >> (8 * k)) & 0xFF;
+    }
+
+    return len;
+}
+
+
+#endif /* MAIN_PROFILER_H_ */
@@ -0,0 +1,347 @@
+/*
+ * sample_history.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_SAMPLE_HISTORY_H_
+#define MAIN_SAMPLE_HISTORY_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "sys/time.h"
+#include "host/ble_hs.h"
+#include "esp_check_err.h"
+#include "app_packet.h"
+#include "white_list.h"
+#include "sdkconfig.h"
+
+// Description:
+// The sample history is a set of fixed-capacity ring buffers, one per measurement
+// channel (temperature, SpO2, heart rate, activity). The channels belong to the
+// sensor kinds of the white list: temperature sensor (0x1809) measures temperature,
+// pulseox (0x1822) measures SpO2 and heart rate, physical activity monitor (0x183E)
+// measures activity. Every slot of a ring buffer holds a sample, the RTC time (in s)
+// it was measured at and the index of the source device in the white list. Pushing
+// overwrites the oldest sample when the buffer is full, so it is always O(1). The
+// buffers are stored in RTC memory to persist across sleep cycles, so the analysis
+// has the history of the last SAMPLE_HISTORY_LEN samples per channel and may check
+// how fresh the latest one is. Every subject served by the gateway has its own set
+// of ring buffers (see white_list.h), so samples of one subject never displace
+// samples of another one.
+// The target has no FPU, so samples are kept as fixed-point integers end to end:
+// temperature in Q8.8 format (1/256 °C), SpO2 (%), heart rate (bpm) and activity
+// level as plain integers. Float values are only made for display.
+// Besides raw samples, every channel keeps streaming trend statistics, updated in
+// O(1) by every pushed sample, so their cost does not depend on the history length:
+//   - EWMA (exponentially weighted moving average) with alpha = 1 / 2^TREND_EWMA_SHIFT
+//   - exponentially weighted variance of samples around the EWMA
+//   - slope, the change of the EWMA over the last TREND_WINDOW_S, measured once a
+//     window against the EWMA at the window start (the anchor)
+// The EWMA is kept with TREND_FRAC_BITS extra fractional bits, the variance is in
+// squared channel units, the slope is in channel units per window. A gap of two
+// windows without samples invalidates the slope, it is measured again from the
+// next sample. The statistics of one channel take TREND_SIZE bytes: the anchor is
+// rounded to channel units, the slope is saturated to 16 bits and the variance to
+// 30 bits, the flags take the rest of its word. So the trends of the maximum of
+// 32 subjects fit into TREND_RTC_BUDGET.
+
+#define SAMPLE_HISTORY_LEN          CONFIG_AM_SAMPLE_HISTORY_LEN
+#define SAMPLE_HISTORY_RTC_BUDGET   4096    // max amount of RTC memory for the history, in bytes
+
+#define TREND_EWMA_SHIFT            CONFIG_AM_TREND_EWMA_SHIFT
+#define TREND_WINDOW_S              CONFIG_AM_TREND_WINDOW_S
+#define TREND_FRAC_BITS             8       // number of extra fractional bits of EWMA
+#define TREND_VARIANCE_MAX          0x3FFFFFFF  // max variance, field of 30 bits
+#define TREND_SIZE                  16      // size of trend statistics of one channel, in bytes
+#define TREND_RTC_BUDGET            2048    // max amount of RTC memory for the trend statistics, in bytes
+
+#define TEMP_FRAC_BITS              8       // number of fractional bits of temperature (Q8.8)
+#define TEMP_FIXED(temp)            ((int16_t)((temp) * (1 << TEMP_FRAC_BITS)))   // temperature constant in Q8.8
+
+// enum of sensor kinds, one per interesting uuid
+typedef enum {
+    SENSOR_KIND_UNKNOWN = -1,
+    SENSOR_KIND_TEMP = 0,       // 0x1809 - temperature
+    SENSOR_KIND_PULSEOX = 1,    // 0x1822 - pulseox
+    SENSOR_KIND_ACTIVITY = 2,   // 0x183E - physical activity monitor
+    SENSOR_KIND_CNT
+} sensor_kind_t;
+
+// enum of measurement channels, every channel has its own ring buffer
+typedef enum {
+    CHANNEL_UNKNOWN = -1,
+    CHANNEL_TEMP = 0,       // temperature, from temperature sensor
+    CHANNEL_SPO2 = 1,       // blood oxygen saturation, from pulseox
+    CHANNEL_HEART_RATE = 2, // heart rate, from pulseox
+    CHANNEL_ACTIVITY = 3,   // activity level, from physical activity monitor
+    CHANNEL_CNT
+} sample_channel_t;
+
+// struct that describes one slot of the ring buffer
+typedef struct {
+    int16_t value;      // sample value, fixed-point (Q8.8 for temperature)
+    uint8_t src_index;  // index of the source device in the white list
+    uint32_t timestamp; // RTC time of measurement, in s
+} sample_t;
+
+// struct that describes ring buffer of one channel
+typedef struct {
+    sample_t samples[SAMPLE_HISTORY_LEN];
+    uint8_t head;   // index of the slot to write next
+    uint8_t cnt;    // number of filled slots
+} sample_ring_t;
+
+// struct that describes streaming trend statistics of one channel
+typedef struct {
+    int32_t ewma;                   // EWMA, with TREND_FRAC_BITS extra fractional bits
+    uint32_t variance : 30;         // exponentially weighted variance, in squared channel units (saturated)
+    uint32_t is_started : 1;        // flag to indicate whether the channel has received any sample
+    uint32_t slope_is_valid : 1;    // flag to indicate whether the slope has been measured
+    uint32_t anchor_ts;             // RTC time of the start of the current window (and of the slope), in s
+    int16_t anchor_ewma;            // EWMA at the start of the current window, in channel units (rounded)
+    int16_t slope;                  // change of EWMA over the last complete window, in channel units (saturated)
+} trend_t;
+
+_Static_assert(sizeof(trend_t) == TREND_SIZE, "trend statistics must stay compact, they are kept per subject in RTC memory");
+
+
+esp_err_t push_sample(uint8_t subject_id, sample_channel_t channel, int16_t value, uint8_t src_index, uint32_t timestamp);
+void update_trend(trend_t* trend, int16_t value, uint32_t timestamp);
+esp_err_t get_trend(uint8_t subject_id, sample_channel_t channel, trend_t* trend);
+esp_err_t get_sample(uint8_t subject_id, sample_channel_t channel, uint8_t age, sample_t* sample);
+esp_err_t get_latest_sample(uint8_t subject_id, sample_channel_t channel, sample_t* sample);
+uint8_t get_samples_cnt(uint8_t subject_id, sample_channel_t channel);
+uint32_t get_sample_age_s(const sample_t* sample);
+sensor_kind_t get_sensor_kind_by_uuid16(const ble_uuid16_t* uuid);
+sample_channel_t get_default_channel_by_kind(sensor_kind_t kind);
+sample_channel_t get_channel_by_meas_type(uint8_t type);
+sensor_kind_t get_sensor_kind_by_channel(sample_channel_t channel);
+ble_uuid16_t get_uuid16_by_sensor_kind(sensor_kind_t kind);
+float sample_value_to_float(sample_channel_t channel, int16_t value);
+uint32_t get_rtc_time_s();
+
+
+// ring buffers of samples, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR sample_ring_t sample_history[MAX_SUBJECTS][CHANNEL_CNT];
+
+// trend statistics, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR trend_t trends[MAX_SUBJECTS][CHANNEL_CNT];
+
+_Static_assert(sizeof(sample_history) <= SAMPLE_HISTORY_RTC_BUDGET,
+               "sample history exceeds RTC memory budget, reduce number of subjects or history length");
+_Static_assert(sizeof(trends) <= TREND_RTC_BUDGET, "trend statistics exceed RTC memory budget, reduce number of subjects");
+// 32 is the maximum of AM_MAX_SUBJECTS (see Kconfig.projbuild)
+_Static_assert(32 * CHANNEL_CNT * TREND_SIZE <= TREND_RTC_BUDGET, "trend statistics of every allowed number of subjects must fit");
+
+
+// pushes sample measured at given RTC time to the ring buffer of given subject
+// and channel, the oldest sample is overwritten if the buffer is full
+esp_err_t push_sample(uint8_t subject_id, sample_channel_t channel, int16_t value, uint8_t src_index, uint32_t timestamp)
+{
+    if (subject_id >= MAX_SUBJECTS || channel < 0 || channel >= CHANNEL_CNT)  // check if subject and channel are valid
+        return ESP_FAIL;
+
+    sample_ring_t* ring = &sample_history[subject_id][channel];
+    ring->samples[ring->head].value = value;
+    ring->samples[ring->head].timestamp = timestamp;
+    ring->samples[ring->head].src_index = src_index;
+
+    ring->head = (ring->head + 1) % SAMPLE_HISTORY_LEN;
+    if (ring->cnt < SAMPLE_HISTORY_LEN)
+        ring->cnt++;
+
+    update_trend(&trends[subject_id][channel], value, timestamp);
+    return ESP_OK;
+}
+
+
+// updates trend statistics of a channel by new sample, in O(1) and integers only
+void update_trend(trend_t* trend, int16_t value, uint32_t timestamp)
+{
+    int32_t scaled_value = (int32_t)value << TREND_FRAC_BITS;
+    if (!trend->is_started)
+    {
+        trend->ewma = scaled_value;
+        trend->variance = 0;
+        trend->anchor_ewma = value;
+        trend->anchor_ts = timestamp;
+        trend->is_started = true;
+        trend->slope_is_valid = false;
+        return;
+    }
+
+    // EWMA and variance: var = (1 - alpha) * (var + alpha * diff^2)
+    int32_t diff = scaled_value - trend->ewma;
+    trend->ewma += diff / (1 << TREND_EWMA_SHIFT);
+
+    int64_t diff_units = diff / (1 << TREND_FRAC_BITS);
+    int64_t variance = trend->variance + diff_units * diff_units / (1 << TREND_EWMA_SHIFT);
+    variance -= variance / (1 << TREND_EWMA_SHIFT);
+    trend->variance = variance > TREND_VARIANCE_MAX ? TREND_VARIANCE_MAX : (uint32_t)variance;
+
+    // slope, measured once a window (samples of TLV records may come out of order)
+    uint32_t elapsed_s = timestamp > trend->anchor_ts ? timestamp - trend->anchor_ts : 0;
+    if (elapsed_s < TREND_WINDOW_S)
+        return;
+
+    if (elapsed_s < 2 * TREND_WINDOW_S)
+    {
+        // the window may be a bit longer than TREND_WINDOW_S, scale to one window
+        int64_t change = ((int64_t)trend->ewma - ((int32_t)trend->anchor_ewma << TREND_FRAC_BITS)) *
+                         TREND_WINDOW_S / elapsed_s / (1 << TREND_FRAC_BITS);
+        trend->slope = change > INT16_MAX ? INT16_MAX : change < INT16_MIN ? INT16_MIN : change;
+        trend->slope_is_valid = true;
+    }
+    else    // too long gap, the EWMA has not followed the data
+        trend->slope_is_valid = false;
+
+    // the EWMA is an average of 16-bit samples, so it fits into the anchor
+    trend->anchor_ewma = (trend->ewma + (1 << (TREND_FRAC_BITS - 1))) >> TREND_FRAC_BITS;
+    trend->anchor_ts = timestamp;
+}
+
+
+// gets trend statistics of given subject and channel
+esp_err_t get_trend(uint8_t subject_id, sample_channel_t channel, trend_t* trend)
+{
+    if (subject_id >= MAX_SUBJECTS || channel < 0 || channel >= CHANNEL_CNT || trend == NULL)
+        return ESP_FAIL;
+
+    if (!trends[subject_id][channel].is_started)
+        return ESP_FAIL;
+
+    *trend = trends[subject_id][channel];
+    return ESP_OK;
+}
+
+
+// gets sample of given subject and channel by its age (0 - the latest one)
+esp_err_t get_sample(uint8_t subject_id, sample_channel_t channel, uint8_t age, sample_t* sample)
+{
+    if (subject_id >= MAX_SUBJECTS || channel < 0 || channel >= CHANNEL_CNT || sample == NULL)
+        return ESP_FAIL;
+
+    sample_ring_t* ring = &sample_history[subject_id][channel];
+    if (age >= ring->cnt)   // check if there is such an old sample
+        return ESP_FAIL;
+
+    *sample = ring->samples[(ring->head + SAMPLE_HISTORY_LEN - 1 - age) % SAMPLE_HISTORY_LEN];
+    return ESP_OK;
+}
+
+
+// gets the latest sample of given subject and channel
+esp_err_t get_latest_sample(uint8_t subject_id, sample_channel_t channel, sample_t* sample)
+{
+    return get_sample(subject_id, channel, 0, sample);
+}
+
+
+// gets number of stored samples of given subject and channel
+uint8_t get_samples_cnt(uint8_t subject_id, sample_channel_t channel)
+{
+    if (subject_id >= MAX_SUBJECTS || channel < 0 || channel >= CHANNEL_CNT)
+        return 0;
+
+    return sample_history[subject_id][channel].cnt;
+}
+
+
+// calculates how many seconds ago the sample was received
+uint32_t get_sample_age_s(const sample_t* sample)
+{
+    uint32_t now = get_rtc_time_s();
+    return now >= sample->timestamp ? now - sample->timestamp : 0;
+}
+
+
+// maps service uuid of a device to the kind of its samples
+sensor_kind_t get_sensor_kind_by_uuid16(const ble_uuid16_t* uuid)
+{
+    switch (uuid->value)
+    {
+        case 0x1809: return SENSOR_KIND_TEMP;
+        case 0x1822: return SENSOR_KIND_PULSEOX;
+        case 0x183E: return SENSOR_KIND_ACTIVITY;
+        default:     return SENSOR_KIND_UNKNOWN;
+    }
+}
+
+
+// maps sensor kind to the channel of its DATA_HEADER packets,
+// which carry one value only
+sample_channel_t get_default_channel_by_kind(sensor_kind_t kind)
+{
+    switch (kind)
+    {
+        case SENSOR_KIND_TEMP:      return CHANNEL_TEMP;
+        case SENSOR_KIND_PULSEOX:   return CHANNEL_SPO2;
+        case SENSOR_KIND_ACTIVITY:  return CHANNEL_ACTIVITY;
+        default:                    return CHANNEL_UNKNOWN;
+    }
+}
+
+
+// maps measurement type of TLV record to the channel (see more app_packet.h)
+sample_channel_t get_channel_by_meas_type(uint8_t type)
+{
+    switch (type)
+    {
+        case MEAS_TEMP:         return CHANNEL_TEMP;
+        case MEAS_SPO2:         return CHANNEL_SPO2;
+        case MEAS_HEART_RATE:   return CHANNEL_HEART_RATE;
+        case MEAS_ACTIVITY:     return CHANNEL_ACTIVITY;
+        default:                return CHANNEL_UNKNOWN;
+    }
+}
+
+
+// maps channel to the kind of sensor that measures it
+sensor_kind_t get_sensor_kind_by_channel(sample_channel_t channel)
+{
+    switch (channel)
+    {
+        case CHANNEL_TEMP:          return SENSOR_KIND_TEMP;
+        case CHANNEL_SPO2:          return SENSOR_KIND_PULSEOX;
+        case CHANNEL_HEART_RATE:    return SENSOR_KIND_PULSEOX;
+        case CHANNEL_ACTIVITY:      return SENSOR_KIND_ACTIVITY;
+        default:                    return SENSOR_KIND_UNKNOWN;
+    }
+}
+
+
+// maps sensor kind to service uuid of its devices
+ble_uuid16_t get_uuid16_by_sensor_kind(sensor_kind_t kind)
+{
+    switch (kind)
+    {
+        case SENSOR_KIND_TEMP:      return (ble_uuid16_t)BLE_UUID16_INIT(0x1809);
+        case SENSOR_KIND_PULSEOX:   return (ble_uuid16_t)BLE_UUID16_INIT(0x1822);
+        case SENSOR_KIND_ACTIVITY:  return (ble_uuid16_t)BLE_UUID16_INIT(0x183E);
+        default:                    return (ble_uuid16_t)BLE_UUID16_INIT(0);
+    }
+}
+
+
+// converts fixed-point sample value of given channel to float, for display only
+float sample_value_to_float(sample_channel_t channel, int16_t value)
+{
+    if (channel == CHANNEL_TEMP)
+        return value / (float)(1 << TEMP_FRAC_BITS);
+    return value;
+}
+
+
+// gets RTC time in s, RTC time keeps running during deep sleep
+uint32_t get_rtc_time_s()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint32_t)tv.tv_sec;
+}
+
+
+#endif /* MAIN_SAMPLE_HISTORY_H_ */
@@ -0,0 +1,208 @@
+/*
+ * scan_policy.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_SCAN_POLICY_H_
+#define MAIN_SCAN_POLICY_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "host/ble_hs.h"
+#include "esp_check_err.h"
+#include "ext_scan.h"
+#include "led.h"
+#include "escalation.h"
+#include "trace.h"
+#include "sdkconfig.h"
+
+// Description:
+// A scan policy is a list of scan stages, every stage has its own interval, window
+// and duration. The stages are scanned one after another, the next one is started
+// on BLE_GAP_EVENT_DISC_COMPLETE of the previous one (scan_policy_next_stage), the
+// policy is over after the last stage. So every scan of the gateway is bounded:
+//   registration, deletion - scan at 50 % duty for AM_MODE_SCAN_FAST_MS, while the
+//                            user is likely to bring the sensor, then at low duty in
+//                            background, the mode is exited when the policy is over
+//                            (AM_MODE_SCAN_TIMEOUT_MS after the last activity)
+//   data                   - one stage of at most AM_DATA_SCAN_MAX_DURATION_MS
+//   escalation             - one confirmation round at full duty
+// A stage may start a led pattern, so the user can see that the mode scans in
+// background. The scan of a stage may be cancelled (e.g. before connection) and
+// the policy resumed from its first stage later.
+// Data and escalation scans let the controller drop repeats of the same advert
+// (filter_duplicates), a new data packet differs by its sequence number, so only
+// bare repeats are dropped (see more seq_dedup.h). Registration and deletion scans
+// see every advert, the scan is restarted after a failed connection anyway.
+
+#define SCAN_POLICY_MAX_STAGES  4   // max number of stages in one policy
+
+#define MODE_SCAN_FAST_MS       CONFIG_AM_MODE_SCAN_FAST_MS     // duration of fast stage of mode scan
+#define MODE_SCAN_TIMEOUT_MS    CONFIG_AM_MODE_SCAN_TIMEOUT_MS  // duration of whole mode scan
+
+_Static_assert(MODE_SCAN_TIMEOUT_MS > MODE_SCAN_FAST_MS, "mode scan timeout must be longer than its fast stage");
+
+// struct that describes one stage of scan
+typedef struct {
+    uint16_t itvl;                          // interval between window start, in 0.625 ms
+    uint16_t window;                        // scan window duration, in 0.625 ms
+    int32_t duration_ms;                    // duration of the stage
+    const led_pattern_t* led_pattern;       // pattern started with the stage, NULL - led is not changed
+} scan_stage_t;
+
+// struct that describes scan policy
+typedef struct {
+    scan_stage_t stages[SCAN_POLICY_MAX_STAGES];    // stages scanned in order
+    uint8_t stages_cnt;                             // number of stages
+    uint8_t filter_policy;                          // 0 - scan all devices, 1 - only devices from white list
+    uint8_t filter_duplicates;                      // 1 - controller drops repeats of the same advert
+    bool always_coded_phy;                          // scan Coded PHY even if no registered sensor uses it
+} scan_policy_t;
+
+// registration, new device may advertise on any PHY, so Coded PHY is scanned too
+const scan_policy_t SCAN_POLICY_REGISTRATION = {
+        .stages = {
+            { 0x0040, 0x0020, MODE_SCAN_FAST_MS, NULL },
+            { 0x0800, 0x0030, MODE_SCAN_TIMEOUT_MS - MODE_SCAN_FAST_MS, &LED_PATTERN_SCAN_BACKGROUND }
+        },
+        .stages_cnt = 2,
+        .filter_policy = 0,
+        .filter_duplicates = 0,
+        .always_coded_phy = true
+};
+
+// deletion, only registered devices can be deleted
+const scan_policy_t SCAN_POLICY_DELETION = {
+        .stages = {
+            { 0x0040, 0x0020, MODE_SCAN_FAST_MS, NULL },
+            { 0x0800, 0x0030, MODE_SCAN_TIMEOUT_MS - MODE_SCAN_FAST_MS, &LED_PATTERN_SCAN_BACKGROUND }
+        },
+        .stages_cnt = 2,
+        .filter_policy = 1,
+        .filter_duplicates = 0,
+        .always_coded_phy = false
+};
+
+// periodic data scan, stopped earlier if all registered devices have reported
+const scan_policy_t SCAN_POLICY_DATA = {
+        .stages = {
+            { 0x0040, 0x0020, CONFIG_AM_DATA_SCAN_MAX_DURATION_MS, NULL }
+        },
+        .stages_cnt = 1,
+        .filter_policy = 1,
+        .filter_duplicates = 1,
+        .always_coded_phy = false
+};
+
+// confirmation round of escalation, window equals interval, scan continuously
+const scan_policy_t SCAN_POLICY_ESCALATION = {
+        .stages = {
+            { 0x0010, 0x0010, ESCALATION_ROUND_MS, NULL }
+        },
+        .stages_cnt = 1,
+        .filter_policy = 1,
+        .filter_duplicates = 1,
+        .always_coded_phy = false
+};
+
+
+int scan_policy_start(uint8_t own_addr_type, const scan_policy_t* policy, ble_gap_event_fn* gap_event_cb);
+int scan_policy_resume();
+bool scan_policy_next_stage();
+int scan_policy_cancel();
+static int scan_policy_start_stage();
+
+
+const char* g_tag_policy = "POLICY";    // tag used in ESP_CHECK
+
+const scan_policy_t* scan_policy = NULL;        // policy being scanned
+uint8_t scan_stage_idx = 0;                     // index of the stage being scanned
+uint8_t scan_own_addr_type;                     // own address type of the scan
+ble_gap_event_fn* scan_gap_event_cb = NULL;     // gap event handler of the scan
+
+
+// starts scanning the policy from its first stage
+// returns nimble error code
+int scan_policy_start(uint8_t own_addr_type, const scan_policy_t* policy, ble_gap_event_fn* gap_event_cb)
+{
+    if (policy->stages_cnt == 0 || policy->stages_cnt > SCAN_POLICY_MAX_STAGES)
+        return BLE_HS_EINVAL;
+
+    scan_policy = policy;
+    scan_own_addr_type = own_addr_type;
+    scan_gap_event_cb = gap_event_cb;
+    scan_stage_idx = 0;
+    return scan_policy_start_stage();
+}
+
+
+// starts scanning the last policy from its first stage again
+// (e.g. after connection to the found device)
+// returns nimble error code
+int scan_policy_resume()
+{
+    if (scan_policy == NULL)
+        return BLE_HS_EINVAL;
+
+    scan_stage_idx = 0;
+    return scan_policy_start_stage();
+}
+
+
+// starts the next stage of the policy, must be called on BLE_GAP_EVENT_DISC_COMPLETE
+// (after ext_scan_on_complete)
+// returns true if the next stage is started, false if the policy is over
+bool scan_policy_next_stage()
+{
+    if (scan_policy == NULL)
+        return false;
+
+    if (scan_stage_idx + 1 >= scan_policy->stages_cnt)
+        return false;
+
+    scan_stage_idx++;
+    return scan_policy_start_stage() == 0;
+}
+
+
+// cancels scan of the stage, the policy may be resumed
+// returns nimble error code
+int scan_policy_cancel()
+{
+    return ext_scan_cancel();
+}
+
+
+// starts scan of the current stage
+// returns nimble error code
+static int scan_policy_start_stage()
+{
+    const scan_stage_t* stage = &scan_policy->stages[scan_stage_idx];
+
+    // set discovery parameters
+    struct ble_gap_disc_params disc_params;
+    disc_params.itvl = stage->itvl;
+    disc_params.window = stage->window;
+    disc_params.filter_policy = scan_policy->filter_policy;
+    disc_params.limited = 0;            // any discovery mode
+    disc_params.passive = 1;            // no scan requests
+    disc_params.filter_duplicates = scan_policy->filter_duplicates;
+
+    if (stage->led_pattern != NULL)
+        led_start_pattern(stage->led_pattern);
+
+    TRACE_D(TRACE_SCAN_STAGE, scan_stage_idx, (uint32_t)stage->window * 1000 / stage->itvl);
+
+    bool with_coded_phy = scan_policy->always_coded_phy || ext_scan_needs_coded_phy();
+    int rc = ext_scan_start(scan_own_addr_type, stage->duration_ms, &disc_params, with_coded_phy, scan_gap_event_cb);
+    if (rc != 0)
+        ESP_LOGE(g_tag_policy, "Scan stage %u is not started, error %d.", scan_stage_idx, rc);
+    return rc;
+}
+
+
+#endif /* MAIN_SCAN_POLICY_H_ */
@@ -0,0 +1,128 @@
+/*
+ * seq_dedup.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_SEQ_DEDUP_H_
+#define MAIN_SEQ_DEDUP_H_
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_attr.h"
+#include "white_list.h"
+#include "sdkconfig.h"
+
+// Description:
+// A sensor repeats every data advert until it has new data, so during one scan the
+// same packet is received many times. Data packets carry a 16-bit sequence number
+// (see more app_packet.h), and for every white list entry (same index) the gateway
+// remembers which of the latest SEQ_DEDUP_WINDOW sequence numbers it has received:
+//   last_seq - the highest sequence number received
+//   window   - bit i is set, if sequence number last_seq - i has been received
+// A packet whose sequence number is marked in the window is a duplicate and is
+// dropped by the prefilter, before any parsing or decoding (see adv_prefilter.h).
+// The prefilter only checks the window, the number is marked after the packet
+// has been processed (samples stored), so a packet dropped later (e.g. queued
+// when the scan was closed) is taken again from its repeats in the next cycle.
+// Sequence numbers are compared in serial number arithmetic, so they may wrap
+// around. The windows are kept in RTC memory, so a packet repeated in the next
+// cycle is dropped too.
+// A sensor only ever advertises its latest packet, so in a new data cycle (see
+// seq_dedup_start_cycle()) its packets have the same sequence number as before
+// (a repeat) or a higher one. A lower number before any packet of the sensor is
+// marked in the cycle, or a number
+// older than the window at any time, is taken as a restart of the sensor (e.g.
+// after battery change) and the window starts again from it, so the restarted
+// sensor is dropped at most until the end of the cycle it restarted in.
+
+#define SEQ_DEDUP_WINDOW    32  // number of the latest sequence numbers remembered, bits of window
+
+// struct that describes dedup window of one white list entry
+typedef struct {
+    uint32_t window;    // received sequence numbers, bit i - last_seq - i, 0 if nothing received yet
+    uint16_t last_seq;  // the highest sequence number received
+    uint8_t cycle;      // data cycle of the latest marked packet, see seq_dedup_cycle
+} seq_dedup_t;
+
+
+void seq_dedup_reset(int8_t wl_index);
+void seq_dedup_start_cycle();
+bool seq_dedup_is_new(int8_t wl_index, uint16_t seq);
+void seq_dedup_mark(int8_t wl_index, uint16_t seq);
+
+
+// dedup windows of white list entries, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR seq_dedup_t seq_dedup[WHITE_LIST_SIZE];
+RTC_DATA_ATTR uint8_t seq_dedup_cycle = 0;  // number of the current data cycle, wraps around
+
+
+// resets dedup window of white list entry, must be called when a sensor is registered
+void seq_dedup_reset(int8_t wl_index)
+{
+    if (wl_index < 0 || wl_index >= WHITE_LIST_SIZE)
+        return;
+
+    memset(&seq_dedup[wl_index], 0, sizeof(seq_dedup_t));
+}
+
+
+// starts a new data cycle, must be called before the data scan of every cycle
+void seq_dedup_start_cycle()
+{
+    seq_dedup_cycle++;
+}
+
+
+// checks if the packet with given sequence number is new, the window is not changed
+// returns false if it is a duplicate
+bool seq_dedup_is_new(int8_t wl_index, uint16_t seq)
+{
+    if (wl_index < 0 || wl_index >= WHITE_LIST_SIZE)
+        return true;
+
+    const seq_dedup_t* dedup = &seq_dedup[wl_index];
+    int16_t diff = (int16_t)(seq - dedup->last_seq);    // serial number arithmetic
+    bool is_new_cycle = dedup->cycle != seq_dedup_cycle;
+
+    // the first packet, a newer one, or a restart of the sensor
+    if (dedup->window == 0 || diff > 0 || -diff >= SEQ_DEDUP_WINDOW || (diff < 0 && is_new_cycle))
+        return true;
+
+    // an older one in the window
+    return !(dedup->window & (1UL << (-diff)));
+}
+
+
+// marks the packet with given sequence number as received, must be called only
+// for a new packet (see seq_dedup_is_new()) once it has been processed
+void seq_dedup_mark(int8_t wl_index, uint16_t seq)
+{
+    if (wl_index < 0 || wl_index >= WHITE_LIST_SIZE)
+        return;
+
+    seq_dedup_t* dedup = &seq_dedup[wl_index];
+    int16_t diff = (int16_t)(seq - dedup->last_seq);    // serial number arithmetic
+    bool is_new_cycle = dedup->cycle != seq_dedup_cycle;
+    dedup->cycle = seq_dedup_cycle;
+
+    // the first packet, a newer one, or a restart of the sensor
+    if (dedup->window == 0 || diff > 0 || -diff >= SEQ_DEDUP_WINDOW || (diff < 0 && is_new_cycle))
+    {
+        if (dedup->window == 0 || diff <= 0)
+            dedup->window = 1;
+        else
+            dedup->window = diff < SEQ_DEDUP_WINDOW ? (dedup->window << diff) | 1 : 1;
+        dedup->last_seq = seq;
+        return;
+    }
+
+    // an older one in the window
+    dedup->window |= 1UL << (-diff);
+}
+
+
+#endif /* MAIN_SEQ_DEDUP_H_ */
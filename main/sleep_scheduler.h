@@ -0,0 +1,169 @@
+/*
+ * sleep_scheduler.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_SLEEP_SCHEDULER_H_
+#define MAIN_SLEEP_SCHEDULER_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_check_err.h"
+#include "analysis_module.h"
+#include "time_sync.h"
+#include "trace.h"
+#include "sdkconfig.h"
+
+// Description:
+// The sleep scheduler chooses the interval of the next timer wakeup. The base
+// interval depends on the last analysis result: long while the state is NORMAL,
+// short while it is CRITICAL or VERY_CRITICAL. If some registered sensors have
+// not reported in the cycle, the interval is linearly shortened towards the
+// minimum, so the missing data is retried sooner. If no sensor has reported at
+// all, the data is not fresh and the network is probably out of range, so the
+// interval is doubled for every such cycle in a row (exponential back-off). The
+// result is always clamped to the configured bounds. Every chosen interval is
+// logged into a ring buffer in RTC memory together with the inputs it was
+// chosen from. The time of the next wakeup is stored as well, so it can be
+// published to sensors (see time_sync.h).
+
+#define SCHED_MIN_INTERVAL_MS           CONFIG_AM_SLEEP_MIN_INTERVAL_MS
+#define SCHED_MAX_INTERVAL_MS           CONFIG_AM_SLEEP_MAX_INTERVAL_MS
+#define SCHED_NORMAL_INTERVAL_MS        CONFIG_AM_SLEEP_NORMAL_INTERVAL_MS
+#define SCHED_CRITICAL_INTERVAL_MS      CONFIG_AM_SLEEP_CRITICAL_INTERVAL_MS
+#define SCHED_VERY_CRITICAL_INTERVAL_MS CONFIG_AM_SLEEP_VERY_CRITICAL_INTERVAL_MS
+#define SCHED_UNDEFINED_INTERVAL_MS     CONFIG_AM_SLEEP_UNDEFINED_INTERVAL_MS
+#define SCHED_BACKOFF_MAX_SHIFT         CONFIG_AM_SLEEP_BACKOFF_MAX_SHIFT
+#define SCHED_HISTORY_LEN               CONFIG_AM_SLEEP_HISTORY_LEN
+
+// struct that describes one scheduling decision
+typedef struct {
+    uint32_t interval_ms;   // chosen interval
+    int8_t state;           // analysis result the interval was chosen from (liferate_t)
+    uint8_t reported_cnt;   // number of sensors that reported in the cycle
+    uint8_t registered_cnt; // number of registered sensors
+} sched_record_t;
+
+
+uint32_t scheduler_get_base_interval_ms(liferate_t state);
+uint32_t scheduler_next_interval_ms(liferate_t state, uint8_t reported_cnt, uint8_t registered_cnt);
+esp_err_t scheduler_enable_wakeup(liferate_t state, uint8_t reported_cnt, uint8_t registered_cnt);
+esp_err_t scheduler_get_record(uint8_t age, sched_record_t* record);
+uint64_t scheduler_get_next_wakeup_ms();
+uint32_t scheduler_get_interval_ms();
+
+
+const char* g_tag_sched = "SCHED";  // tag used in ESP_CHECK
+
+// scheduler state and history, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR uint8_t sched_silent_streak = 0;  // number of cycles in a row without any fresh data
+RTC_DATA_ATTR sched_record_t sched_history[SCHED_HISTORY_LEN];
+RTC_DATA_ATTR uint8_t sched_history_head = 0;   // index of the slot to write next
+RTC_DATA_ATTR uint8_t sched_history_cnt = 0;    // number of filled slots
+RTC_DATA_ATTR uint64_t sched_next_wakeup_ms = 0;    // time of the next timer wakeup, in ms since epoch
+RTC_DATA_ATTR uint32_t sched_interval_ms = 0;       // interval of the next timer wakeup
+
+
+// gets base interval for given analysis result
+uint32_t scheduler_get_base_interval_ms(liferate_t state)
+{
+    switch (state)
+    {
+        case NORMAL:        return SCHED_NORMAL_INTERVAL_MS;
+        case CRITICAL:      return SCHED_CRITICAL_INTERVAL_MS;
+        case VERY_CRITICAL: return SCHED_VERY_CRITICAL_INTERVAL_MS;
+        default:            return SCHED_UNDEFINED_INTERVAL_MS;
+    }
+}
+
+
+// chooses interval of the next timer wakeup and logs it in the history
+uint32_t scheduler_next_interval_ms(liferate_t state, uint8_t reported_cnt, uint8_t registered_cnt)
+{
+    uint64_t interval_ms = scheduler_get_base_interval_ms(state);
+
+    if (registered_cnt > 0 && reported_cnt == 0)
+    {
+        // no fresh data at all, back off exponentially
+        if (sched_silent_streak < SCHED_BACKOFF_MAX_SHIFT)
+            sched_silent_streak++;
+        interval_ms <<= sched_silent_streak;
+    }
+    else
+    {
+        sched_silent_streak = 0;
+
+        // some sensors are missing, retry sooner
+        if (reported_cnt < registered_cnt && interval_ms > SCHED_MIN_INTERVAL_MS)
+            interval_ms -= (interval_ms - SCHED_MIN_INTERVAL_MS) * (registered_cnt - reported_cnt) / registered_cnt;
+    }
+
+    // clamp to the bounds
+    if (interval_ms < SCHED_MIN_INTERVAL_MS)
+        interval_ms = SCHED_MIN_INTERVAL_MS;
+    if (interval_ms > SCHED_MAX_INTERVAL_MS)
+        interval_ms = SCHED_MAX_INTERVAL_MS;
+
+    // log the decision
+    sched_record_t* record = &sched_history[sched_history_head];
+    record->interval_ms = (uint32_t)interval_ms;
+    record->state = state;
+    record->reported_cnt = reported_cnt;
+    record->registered_cnt = registered_cnt;
+    sched_history_head = (sched_history_head + 1) % SCHED_HISTORY_LEN;
+    if (sched_history_cnt < SCHED_HISTORY_LEN)
+        sched_history_cnt++;
+
+    return (uint32_t)interval_ms;
+}
+
+
+// enables timer wakeup with interval chosen by the scheduler
+// if there are no registered sensors, timer wakeup is not enabled and
+// device will sleep until gpio wakeup
+esp_err_t scheduler_enable_wakeup(liferate_t state, uint8_t reported_cnt, uint8_t registered_cnt)
+{
+    if (registered_cnt == 0)
+        return ESP_FAIL;
+
+    uint32_t interval_ms = scheduler_next_interval_ms(state, reported_cnt, registered_cnt);
+    TRACE_I(TRACE_SLEEP, interval_ms, state);
+
+    ESP_CHECK(esp_sleep_enable_timer_wakeup((uint64_t)interval_ms * 1000), g_tag_sched);
+    sched_next_wakeup_ms = get_time_ms() + interval_ms;
+    sched_interval_ms = interval_ms;
+    return ESP_OK;
+}
+
+
+// gets scheduling decision by its age (0 - the latest one)
+esp_err_t scheduler_get_record(uint8_t age, sched_record_t* record)
+{
+    if (record == NULL || age >= sched_history_cnt)
+        return ESP_FAIL;
+
+    *record = sched_history[(sched_history_head + SCHED_HISTORY_LEN - 1 - age) % SCHED_HISTORY_LEN];
+    return ESP_OK;
+}
+
+
+// gets time of the next timer wakeup, in ms since epoch
+uint64_t scheduler_get_next_wakeup_ms()
+{
+    return sched_next_wakeup_ms;
+}
+
+
+// gets interval of the next timer wakeup
+uint32_t scheduler_get_interval_ms()
+{
+    return sched_interval_ms;
+}
+
+
+#endif /* MAIN_SLEEP_SCHEDULER_H_ */
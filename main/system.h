@@ -14,12 +14,37 @@
 #define L_ENDIAN    0x01
 #define B_ENDIAN    0x00
 
+// endianness of the target, decided at compile time
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define SYSTEM_ENDIANNESS   B_ENDIAN
+#else
+#define SYSTEM_ENDIANNESS   L_ENDIAN
+#endif
+
+// reads big-endian (network order) 16-bit value from buffer,
+// independent of the endianness of the target
+#define GET_BE16(buff)  ((uint16_t)(((buff)[0] << 8) | (buff)[1]))
+
+// reads big-endian (network order) 32-bit value from buffer
+#define GET_BE32(buff)  (((uint32_t)GET_BE16(buff) << 16) | GET_BE16((buff) + 2))
+
+// writes 16-bit value to buffer in big-endian (network order)
+#define PUT_BE16(buff, value) \
+    do { \
+        (buff)[0] = ((value) >> 8) & 0xFF; \
+        (buff)[1] = (value) & 0xFF; \
+    } while (0)
+
+// writes 32-bit value to buffer in big-endian (network order)
+#define PUT_BE32(buff, value) \
+    do { \
+        PUT_BE16(buff, (value) >> 16); \
+        PUT_BE16((buff) + 2, (value) & 0xFFFF); \
+    } while (0)
+
 uint8_t check_endianness()
 {
-    unsigned int one = 1;
-    char* first_byte = (char*)&one;
-
-    return *first_byte;
+    return SYSTEM_ENDIANNESS;
 }
 
 void reverse_bytes(uint8_t* data, size_t size) {
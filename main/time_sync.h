@@ -0,0 +1,265 @@
+/*
+ * time_sync.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_TIME_SYNC_H_
+#define MAIN_TIME_SYNC_H_
+
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "sys/time.h"
+#include "host/ble_hs.h"
+#include "esp_check_err.h"
+#include "app_packet.h"
+#include "trace.h"
+#include "sdkconfig.h"
+
+// Description:
+// The gateway is the time reference of the network. Its time is kept by the RTC
+// timer, which keeps running during deep sleep, and is read with gettimeofday().
+// The time may be set over GATT by writing the Current Time characteristic
+// (0x2A2B), the fact of synchronisation and the adjust reason are stored in RTC
+// memory. The Current Time value follows the Bluetooth SIG format: Exact Time 256
+// (year, month, day, hours, minutes, seconds, day of week, 1/256 fractions of a
+// second) followed by the adjust reason. The wake schedule value lets sensors
+// align their adverts with the next scan window of the gateway, it contains (all
+// little-endian): current time (u32 s, u16 ms), next wakeup time (u32 s, u16 ms),
+// delay from wakeup to scan start (u16 ms), scan window (u16 ms) and the
+// interval between wakeups (u32 ms).
+// Sensors get the schedule in normal operation too: during every data scan the
+// gateway advertises it non-connectable in a SCHEDULE_HEADER packet (see
+// app_packet.h), so a sensor that listens shortly after sending its data advert
+// receives it without a connection. The scan window is the one of the running
+// scan (sized by link statistics, see link_stats.h), the next wakeup is the
+// current one plus the interval, as the interval of the next cycle is decided
+// only after analysis. A changed interval is thus published one cycle late. The
+// advert is stopped when the scan is finished and before the alert is raised,
+// which takes the advertising instance over (see escalation.h).
+
+#define CURRENT_TIME_SIZE   10  // size of Current Time characteristic value
+#define WAKE_SCHEDULE_SIZE  20  // size of wake schedule characteristic value
+
+#define SCHEDULE_ADV_ITVL_MS    CONFIG_AM_SCHEDULE_ADV_ITVL_MS  // interval of schedule advert, 0 - not advertised
+#define SCHEDULE_ADV_MIN_ITVL_MS 20     // minimum interval of connectionless advert
+#define SCHEDULE_ADV_INSTANCE   0       // extended advertising instance, shared with the alert
+#define SCHEDULE_ADV_DATA_SIZE  (3 + 2 + HEADER_SIZE + WAKE_SCHEDULE_SIZE)  // flags, mfg data header, packet
+
+// adjust reason flags of Current Time characteristic
+#define TIME_ADJUST_MANUAL      0x01    // manual time update
+#define TIME_ADJUST_EXTERNAL    0x02    // external reference time update
+#define TIME_ADJUST_TIMEZONE    0x04    // change of time zone
+#define TIME_ADJUST_DST         0x08    // change of DST
+
+
+uint64_t get_time_ms();
+bool time_is_synced();
+size_t time_sync_serialize_current_time(uint8_t* dest_buff, size_t dest_buff_len);
+esp_err_t time_sync_set_current_time(const uint8_t* time_buff, size_t time_buff_len);
+void time_sync_set_scan_delay(uint16_t scan_delay_ms);
+size_t time_sync_serialize_schedule(uint8_t* dest_buff, size_t dest_buff_len, uint64_t next_wakeup_ms,
+                                    uint16_t scan_window_ms, uint32_t interval_ms);
+int schedule_adv_start(uint8_t own_addr_type, uint64_t next_wakeup_ms, uint16_t scan_window_ms,
+                       uint32_t interval_ms);
+int schedule_adv_stop();
+
+
+// synchronisation state, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR bool ts_is_synced = false;        // flag to indicate whether time has been set over GATT
+RTC_DATA_ATTR uint8_t ts_adjust_reason = 0;     // adjust reason of the last time update
+RTC_DATA_ATTR uint16_t ts_scan_delay_ms = 0;    // delay from wakeup to scan start in the last data cycle
+bool ts_schedule_is_advertised = false;         // flag to indicate whether the schedule advert is running
+
+
+// gets current time in ms since epoch
+uint64_t get_time_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+// checks if time has been set over GATT since power on
+bool time_is_synced()
+{
+    return ts_is_synced;
+}
+
+
+// writes current time in Current Time characteristic format
+// returns number of written bytes
+size_t time_sync_serialize_current_time(uint8_t* dest_buff, size_t dest_buff_len)
+{
+    if (dest_buff == NULL || dest_buff_len < CURRENT_TIME_SIZE)
+        return 0;
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct tm tm_time;
+    gmtime_r(&tv.tv_sec, &tm_time);
+
+    uint16_t year = tm_time.tm_year + 1900;
+    dest_buff[0] = year & 0xFF;
+    dest_buff[1] = (year >> 8) & 0xFF;
+    dest_buff[2] = tm_time.tm_mon + 1;                          // 1 - 12
+    dest_buff[3] = tm_time.tm_mday;                             // 1 - 31
+    dest_buff[4] = tm_time.tm_hour;
+    dest_buff[5] = tm_time.tm_min;
+    dest_buff[6] = tm_time.tm_sec;
+    dest_buff[7] = tm_time.tm_wday == 0 ? 7 : tm_time.tm_wday;  // 1 - monday, 7 - sunday
+    dest_buff[8] = (uint8_t)((tv.tv_usec * 256) / 1000000);     // fractions of second
+    dest_buff[9] = ts_adjust_reason;
+
+    return CURRENT_TIME_SIZE;
+}
+
+
+// sets current time from value in Current Time characteristic format
+esp_err_t time_sync_set_current_time(const uint8_t* time_buff, size_t time_buff_len)
+{
+    if (time_buff == NULL || time_buff_len < CURRENT_TIME_SIZE)
+        return ESP_FAIL;
+
+    struct tm tm_time = {};
+    tm_time.tm_year = (time_buff[0] | (time_buff[1] << 8)) - 1900;
+    tm_time.tm_mon = time_buff[2] - 1;
+    tm_time.tm_mday = time_buff[3];
+    tm_time.tm_hour = time_buff[4];
+    tm_time.tm_min = time_buff[5];
+    tm_time.tm_sec = time_buff[6];
+
+    // check if the time is valid (year 0 and month 0 mean unknown)
+    if (tm_time.tm_year < 70 || tm_time.tm_mon < 0 || tm_time.tm_mon > 11 || tm_time.tm_mday < 1 ||
+        tm_time.tm_mday > 31 || tm_time.tm_hour > 23 || tm_time.tm_min > 59 || tm_time.tm_sec > 59)
+        return ESP_FAIL;
+
+    // the time is UTC, default time zone of the system is UTC as well
+    time_t epoch = mktime(&tm_time);
+    if (epoch == (time_t)-1)
+        return ESP_FAIL;
+
+    struct timeval tv = {.tv_sec = epoch, .tv_usec = (time_buff[8] * 1000000) / 256};
+    if (settimeofday(&tv, NULL) != 0)
+        return ESP_FAIL;
+
+    ts_is_synced = true;
+    ts_adjust_reason = time_buff[9] | TIME_ADJUST_EXTERNAL;
+    return ESP_OK;
+}
+
+
+// stores delay from wakeup to scan start, to be published in wake schedule
+void time_sync_set_scan_delay(uint16_t scan_delay_ms)
+{
+    ts_scan_delay_ms = scan_delay_ms;
+}
+
+
+// writes wake schedule of the gateway
+// returns number of written bytes
+size_t time_sync_serialize_schedule(uint8_t* dest_buff, size_t dest_buff_len, uint64_t next_wakeup_ms,
+                                    uint16_t scan_window_ms, uint32_t interval_ms)
+{
+    if (dest_buff == NULL || dest_buff_len < WAKE_SCHEDULE_SIZE)
+        return 0;
+
+    uint64_t now_ms = get_time_ms();
+    uint32_t values[] = {
+            (uint32_t)(now_ms / 1000), now_ms % 1000,
+            (uint32_t)(next_wakeup_ms / 1000), next_wakeup_ms % 1000,
+            ts_scan_delay_ms, scan_window_ms, interval_ms};
+    uint8_t sizes[] = {4, 2, 4, 2, 2, 2, 4};
+
+    size_t len = 0;
+    for (uint8_t i = 0; i < sizeof(sizes); i++)
+        for (uint8_t k = 0; k < sizes[i]; k++)
+            dest_buff[len++] = (values[i] >> (8 * k)) & 0xFF;
+
+    return len;
+}
+
+
+
+// starts non-connectable advertising of wake schedule, returns nimble error code
+int schedule_adv_start(uint8_t own_addr_type, uint64_t next_wakeup_ms, uint16_t scan_window_ms,
+                       uint32_t interval_ms)
+{
+    if (SCHEDULE_ADV_ITVL_MS == 0 || ts_schedule_is_advertised)
+        return 0;
+
+    uint8_t schedule[WAKE_SCHEDULE_SIZE];
+    time_sync_serialize_schedule(schedule, sizeof(schedule), next_wakeup_ms, scan_window_ms, interval_ms);
+
+    uint8_t data[SCHEDULE_ADV_DATA_SIZE];
+    uint8_t len = 0;
+    data[len++] = 2;    // flags, length and type
+    data[len++] = BLE_HS_ADV_TYPE_FLAGS;
+    data[len++] = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+    data[len++] = 1 + HEADER_SIZE + WAKE_SCHEDULE_SIZE;   // manufacturer data, length and type
+    data[len++] = BLE_HS_ADV_TYPE_MFG_DATA;
+    form_packet(data + len, SCHEDULE_HEADER, schedule, sizeof(schedule));
+    len += HEADER_SIZE + WAKE_SCHEDULE_SIZE;
+
+    uint32_t itvl_ms = SCHEDULE_ADV_ITVL_MS < SCHEDULE_ADV_MIN_ITVL_MS ? SCHEDULE_ADV_MIN_ITVL_MS : SCHEDULE_ADV_ITVL_MS;
+    uint16_t itvl = itvl_ms * 8 / 5;    // in 0.625 ms units
+
+    int rc;
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    struct ble_gap_ext_adv_params adv_params = {0};
+    adv_params.legacy_pdu = 1;          // sensors of any BLE version get the schedule
+    adv_params.own_addr_type = own_addr_type;
+    adv_params.primary_phy = BLE_HCI_LE_PHY_1M;
+    adv_params.secondary_phy = BLE_HCI_LE_PHY_1M;
+    adv_params.itvl_min = itvl;
+    adv_params.itvl_max = itvl;
+
+    rc = ble_gap_ext_adv_configure(SCHEDULE_ADV_INSTANCE, &adv_params, NULL, NULL, NULL);
+    if (rc == 0)
+    {
+        struct os_mbuf* om = ble_hs_mbuf_from_flat(data, len);
+        rc = om == NULL ? BLE_HS_ENOMEM : ble_gap_ext_adv_set_data(SCHEDULE_ADV_INSTANCE, om);
+    }
+    if (rc == 0)
+        rc = ble_gap_ext_adv_start(SCHEDULE_ADV_INSTANCE, 0, 0);
+#else
+    struct ble_gap_adv_params adv_params = {0};
+    adv_params.conn_mode = BLE_GAP_CONN_MODE_NON;   // schedule needs no connection
+    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+    adv_params.itvl_min = itvl;
+    adv_params.itvl_max = itvl;
+
+    rc = ble_gap_adv_set_data(data, len);
+    if (rc == 0)
+        rc = ble_gap_adv_start(own_addr_type, NULL, BLE_HS_FOREVER, &adv_params, NULL, NULL);
+#endif
+    if (rc != 0)
+        TRACE_E(TRACE_SCHEDULE_FAIL, 0, rc);
+    ts_schedule_is_advertised = rc == 0;
+    return rc;
+}
+
+
+// stops advertising of wake schedule, if it runs
+int schedule_adv_stop()
+{
+    if (!ts_schedule_is_advertised)
+        return 0;
+
+    ts_schedule_is_advertised = false;
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    int rc = ble_gap_ext_adv_stop(SCHEDULE_ADV_INSTANCE);
+#else
+    int rc = ble_gap_adv_stop();
+#endif
+    if (rc != 0)
+        TRACE_E(TRACE_SCHEDULE_FAIL, 1, rc);
+    return rc;
+}
+
+
+#endif /* MAIN_TIME_SYNC_H_ */
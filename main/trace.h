@@ -0,0 +1,240 @@
+/*
+ * trace.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_TRACE_H_
+#define MAIN_TRACE_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "sys/time.h"
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+
+// Description:
+// The trace is a replacement of synchronous UART logging on hot paths (discovery,
+// button debouncing, analysis, ESP_CHECK). A trace point writes a binary record of
+// 16 bytes into a ring buffer in RTC memory: RTC time (in ms, lower 32 bits), event
+// id, level and two arguments. It takes a few dozen cycles against milliseconds of
+// a formatted log line. The oldest record is overwritten when the buffer is full,
+// so the buffer keeps the history of the last TRACE_BUFF_LEN events across sleep
+// cycles. Trace points are gated at compile time by CONFIG_AM_TRACE_LEVEL, disabled
+// ones compile to nothing (their arguments are not evaluated either). The buffer
+// is dumped on demand over UART (trace_dump) or read over GATT (trace_serialize),
+// every serialized record is (all little-endian): time (u32 ms), id (u8), level
+// (u8), two reserved bytes, arguments (2 x u32).
+
+#define TRACE_LEVEL         CONFIG_AM_TRACE_LEVEL
+#define TRACE_BUFF_LEN      CONFIG_AM_TRACE_BUFF_LEN
+#define TRACE_RTC_BUDGET    2048    // max amount of RTC memory for the trace, in bytes
+#define TRACE_RECORD_SIZE   16      // size of serialized record
+
+// trace levels
+#define TRACE_LEVEL_NONE    0
+#define TRACE_LEVEL_ERROR   1
+#define TRACE_LEVEL_INFO    2
+#define TRACE_LEVEL_DEBUG   3
+
+// enum of traced events, arguments of every event are listed in brackets
+typedef enum {
+    TRACE_CHECK_OK = 0,         // ESP_CHECK succeeded (line, tag)
+    TRACE_CHECK_FAIL,           // ESP_CHECK failed (line, error)
+    TRACE_WAKEUP,               // wakeup (cause, cycles woken from light sleep, 0 - boot)
+    TRACE_SLEEP,                // go to sleep (interval ms, state)
+    TRACE_ADV_CANDIDATE,        // advert passed prefilter (addr bytes 0-3, addr bytes 4-5 | rssi << 16)
+    TRACE_ADV_STATS,            // prefilter counters at the end of scan (seen, passed)
+    TRACE_PACKET_ERROR,         // packet can not be opened (header, len)
+    TRACE_PACKET_DATA,          // data packet received (white list index, number of samples)
+    TRACE_PACKET_TLV,           // TLV packet received (sequence number, records len)
+    TRACE_SCAN_EARLY_STOP,      // every registered sensor has reported (reported, registered)
+    TRACE_SCAN_COMPLETE,        // scan is complete (reason, -)
+    TRACE_BUTTON_PRESS,         // button was released (press duration ms, -)
+    TRACE_BUTTON_ERROR,         // button press duration measurement error (duration us, -)
+    TRACE_ANALYSIS_STALE,       // data is too old for analysis (age s, subject)
+    TRACE_ANALYSIS,             // analysis of subject (subject, total score)
+    TRACE_PARAM_SCORE,          // score of parameter (parameter | status << 8, score)
+    TRACE_SUBJECT_STATE,        // analysis result of subject (subject, state)
+    TRACE_REG_SUBJECT,          // subject of devices being registered (subject, -)
+    TRACE_ALERT_RAISED,         // alert is raised (subject | state << 8, latency us)
+    TRACE_ALERT_FAIL,           // alert advertising failed (step, error)
+    TRACE_ESCALATION_ROUND,     // confirmation round is started (round, state)
+    TRACE_ALERT_CLEARED,        // alert is cleared (rounds, -)
+    TRACE_UPLINK_FLUSH,         // staged uplink records are written to flash (records, head seq)
+    TRACE_UPLINK_BATCH,         // uplink batch is delivered (first seq, records | len << 16)
+    TRACE_UPLINK_FAIL,          // uplink log or transport failed (step, error)
+    TRACE_DATA_CONNECT,         // data client is connected (connection handle, -)
+    TRACE_DATA_HISTORY,         // history download is started (source, start)
+    TRACE_DATA_HISTORY_END,     // history download is finished (source, notifications)
+    TRACE_DATA_FAIL,            // data service failed (step, error)
+    TRACE_BACKLOG_START,        // backlog sync is started (white list index, -)
+    TRACE_BACKLOG_END,          // backlog sync is over (packets, samples)
+    TRACE_BACKLOG_FAIL,         // backlog sync failed (step, error)
+    TRACE_ENERGY_CYCLE,         // energy of cycle is committed (charge uAs, total uAh)
+    TRACE_WORKER_DROP,          // adverts were dropped, the worker queue was full (dropped, total)
+    TRACE_WORKER_FAIL,          // message could not be posted to the worker (message type, event type)
+    TRACE_SCAN_STAGE,           // stage of scan policy is started (stage, duty permille)
+    TRACE_MODE_TIMEOUT,         // registration or deletion mode is exited after timeout (mode, -)
+    TRACE_LINK_RESEAT,          // sensor is flagged to re-seat (white list index, rssi dBm | missed streak << 8)
+    TRACE_LIGHT_SLEEP,          // go to light sleep, ble stack is kept (interval ms, crossover ms)
+    TRACE_RESIDENT_EXIT,        // ble stack is given up for deep sleep (reason, cycles woken from light sleep)
+    TRACE_SCHEDULE_FAIL,        // wake schedule advert failed (step, nimble error code)
+    TRACE_ID_CNT
+} trace_id_t;
+
+// struct that describes one slot of the ring buffer
+typedef struct {
+    uint32_t timestamp; // RTC time of the event, in ms (lower 32 bits)
+    uint8_t id;         // event id (trace_id_t)
+    uint8_t level;      // trace level of the event
+    uint16_t reserved;
+    uint32_t args[2];   // event arguments
+} trace_record_t;
+
+
+// trace points, compiled only if their level is enabled
+#if TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_E(id, arg0, arg1) trace_write(id, TRACE_LEVEL_ERROR, (uint32_t)(arg0), (uint32_t)(arg1))
+#else
+#define TRACE_E(id, arg0, arg1) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_I(id, arg0, arg1) trace_write(id, TRACE_LEVEL_INFO, (uint32_t)(arg0), (uint32_t)(arg1))
+#else
+#define TRACE_I(id, arg0, arg1) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_D(id, arg0, arg1) trace_write(id, TRACE_LEVEL_DEBUG, (uint32_t)(arg0), (uint32_t)(arg1))
+#else
+#define TRACE_D(id, arg0, arg1) ((void)0)
+#endif
+
+
+void trace_write(trace_id_t id, uint8_t level, uint32_t arg0, uint32_t arg1);
+uint8_t get_trace_cnt();
+esp_err_t get_trace_record(uint8_t age, trace_record_t* record);
+void trace_dump();
+size_t trace_serialize(uint8_t* dest_buff, size_t dest_buff_len);
+
+
+const char* g_tag_trace = "TRACE";  // tag used in ESP_CHECK
+
+// names of events for dumping
+const char* trace_id_names[TRACE_ID_CNT] = {
+        "CHECK_OK", "CHECK_FAIL", "WAKEUP", "SLEEP", "ADV_CANDIDATE", "ADV_STATS", "PACKET_ERROR",
+        "PACKET_DATA", "PACKET_TLV", "SCAN_EARLY_STOP", "SCAN_COMPLETE", "BUTTON_PRESS", "BUTTON_ERROR",
+        "ANALYSIS_STALE", "ANALYSIS", "PARAM_SCORE", "SUBJECT_STATE",
+        "REG_SUBJECT", "ALERT_RAISED", "ALERT_FAIL", "ESCALATION_ROUND", "ALERT_CLEARED",
+        "UPLINK_FLUSH", "UPLINK_BATCH", "UPLINK_FAIL", "DATA_CONNECT", "DATA_HISTORY", "DATA_HISTORY_END",
+        "DATA_FAIL", "BACKLOG_START", "BACKLOG_END", "BACKLOG_FAIL", "ENERGY_CYCLE", "WORKER_DROP", "WORKER_FAIL",
+        "SCAN_STAGE", "MODE_TIMEOUT", "LINK_RESEAT", "LIGHT_SLEEP", "RESIDENT_EXIT",
+        "SCHEDULE_FAIL"};
+
+portMUX_TYPE trace_mux = portMUX_INITIALIZER_UNLOCKED;  // trace points are hit from several tasks
+
+// ring buffer of records, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR trace_record_t trace_buff[TRACE_BUFF_LEN];
+RTC_DATA_ATTR uint8_t trace_head = 0;   // index of the slot to write next
+RTC_DATA_ATTR uint8_t trace_cnt = 0;    // number of filled slots
+
+_Static_assert(sizeof(trace_buff) <= TRACE_RTC_BUDGET, "trace buffer exceeds RTC memory budget");
+_Static_assert(sizeof(trace_record_t) == TRACE_RECORD_SIZE, "trace record must be packed");
+
+
+// writes record to the ring buffer, the oldest record is overwritten if the buffer is full
+void trace_write(trace_id_t id, uint8_t level, uint32_t arg0, uint32_t arg1)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint32_t timestamp = (uint32_t)((uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+
+    portENTER_CRITICAL_SAFE(&trace_mux);
+    trace_record_t* record = &trace_buff[trace_head];
+    record->timestamp = timestamp;
+    record->id = id;
+    record->level = level;
+    record->reserved = 0;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+
+    trace_head = (trace_head + 1) % TRACE_BUFF_LEN;
+    if (trace_cnt < TRACE_BUFF_LEN)
+        trace_cnt++;
+    portEXIT_CRITICAL_SAFE(&trace_mux);
+}
+
+
+// gets number of stored records
+uint8_t get_trace_cnt()
+{
+    return trace_cnt;
+}
+
+
+// gets record by its age (0 - the latest one)
+esp_err_t get_trace_record(uint8_t age, trace_record_t* record)
+{
+    if (record == NULL || age >= trace_cnt)
+        return ESP_FAIL;
+
+    portENTER_CRITICAL_SAFE(&trace_mux);
+    *record = trace_buff[(trace_head + TRACE_BUFF_LEN - 1 - age) % TRACE_BUFF_LEN];
+    portEXIT_CRITICAL_SAFE(&trace_mux);
+    return ESP_OK;
+}
+
+
+// prints all stored records over UART, from the oldest to the latest one
+void trace_dump()
+{
+    ESP_LOGI(g_tag_trace, "Trace: %u records", trace_cnt);
+    for (int16_t age = trace_cnt - 1; age >= 0; age--)
+    {
+        trace_record_t record;
+        if (get_trace_record(age, &record) != ESP_OK)
+            break;
+
+        const char* name = record.id < TRACE_ID_CNT ? trace_id_names[record.id] : "UNKNOWN";
+        if (record.id == TRACE_CHECK_OK)    // the second argument is the tag of the check
+            ESP_LOGI(g_tag_trace, "%10lu %s line %lu [%s]", (unsigned long)record.timestamp, name,
+                    (unsigned long)record.args[0], (const char*)(uintptr_t)record.args[1]);
+        else
+            ESP_LOGI(g_tag_trace, "%10lu %s %ld 0x%08lx", (unsigned long)record.timestamp, name,
+                    (long)record.args[0], (unsigned long)record.args[1]);
+    }
+}
+
+
+// writes stored records, from the latest one, as many as fit into the buffer
+// returns number of written bytes
+size_t trace_serialize(uint8_t* dest_buff, size_t dest_buff_len)
+{
+    if (dest_buff == NULL)
+        return 0;
+
+    size_t len = 0;
+    for (uint8_t age = 0; age < trace_cnt && len + TRACE_RECORD_SIZE <= dest_buff_len; age++)
+    {
+        trace_record_t record;
+        if (get_trace_record(age, &record) != ESP_OK)
+            break;
+
+        uint32_t values[] = {record.timestamp, record.id | (record.level << 8), record.args[0], record.args[1]};
+        for (uint8_t i = 0; i < 4; i++)
+            for (uint8_t k = 0; k < 4; k++)
+                dest_buff[len++] = (values[i] >> (8 * k)) & 0xFF;
+    }
+
+    return len;
+}
+
+
+#endif /* MAIN_TRACE_H_ */
@@ -0,0 +1,263 @@
+/*
+ * uplink.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_UPLINK_H_
+#define MAIN_UPLINK_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_check_err.h"
+#include "system.h"
+#include "uplink_log.h"
+#include "sample_history.h"
+#include "white_list.h"
+#include "trace.h"
+#include "sdkconfig.h"
+
+// Description:
+// The uplink forwards the uplink log (see uplink_log.h) to the central data center
+// over a pluggable transport (satellite, cellular, etc). Powering up an uplink radio
+// costs much more than a BLE wake cycle, so the log is not sent every cycle, it is
+// drained when UPLINK_BATCH_RECORDS records are pending or the oldest pending one
+// is UPLINK_MAX_DELAY_S old, or at once on a critical state. A drain powers the
+// transport up once and sends as many batches as needed, a batch is acknowledged
+// only when the transport confirms delivery, so an undelivered batch is sent again
+// next time. Records are compressed in a batch (all multi-byte fields big-endian):
+//   version (1 byte) | first sequence number (4 bytes) | base time (4 bytes, s) |
+//   records count (2 bytes) | records
+// and every record is:
+//   type << 6 | subject (1 byte) | time delta (zigzag varint, s) | then
+//   for a sample:  channel (1 byte) | source index (1 byte) | value delta (zigzag varint)
+//   for a result:  state (1 byte) | total score (1 byte)
+// The time delta is counted from the previous record, the value delta from the
+// previous sample of the same subject and channel in the batch (0 for the first one).
+// Records follow each other without gaps, so the receiver numbers them from the
+// first sequence number and drops duplicates of at-least-once delivery.
+
+#define UPLINK_BATCH_RECORDS    CONFIG_AM_UPLINK_BATCH_RECORDS  // number of pending records that triggers a drain
+#define UPLINK_MAX_DELAY_S      CONFIG_AM_UPLINK_MAX_DELAY_S    // max age of pending record, in s
+#define UPLINK_BATCH_VERSION    0x01    // version of batch format
+#define UPLINK_BATCH_HDR_SIZE   11      // version, first sequence number, base time, records count
+#define UPLINK_BATCH_MAX_LEN    512     // max size of batch buffer
+#define UPLINK_RECORD_MAX_LEN   13      // max size of compressed record
+
+// struct that describes uplink transport, the functions block until they finish
+typedef struct {
+    const char* name;
+    size_t max_batch_len;                                   // max size of one batch, in bytes
+    esp_err_t (*power_up)();                                // powers the radio up and attaches to the network
+    esp_err_t (*send)(const uint8_t* batch, size_t batch_len);  // ESP_OK only if delivery is confirmed
+    void (*power_down)();                                   // powers the radio down
+} uplink_transport_t;
+
+
+void uplink_set_transport(const uplink_transport_t* transport);
+esp_err_t uplink_log_sample(uint8_t subject_id, sample_channel_t channel, int16_t value, uint8_t src_index,
+                            uint32_t timestamp);
+esp_err_t uplink_log_result(uint8_t subject_id, int8_t state, uint8_t total_score, uint32_t timestamp);
+bool uplink_is_due(bool is_urgent);
+esp_err_t uplink_poll(bool is_urgent);
+size_t uplink_encode_batch(uint8_t* dest_buff, size_t dest_buff_len, uint32_t first_seq, uint32_t* next_seq);
+uint8_t put_varint(uint8_t* dest_buff, int32_t value);
+esp_err_t uplink_log_transport_send(const uint8_t* batch, size_t batch_len);
+
+
+const char* g_tag_uplink = "UPLINK";    // tag used in ESP_CHECK
+
+// transport that prints batches over UART, stands in for uplink radio
+const uplink_transport_t uplink_log_transport = {
+        .name = "log",
+        .max_batch_len = UPLINK_BATCH_MAX_LEN,
+        .power_up = NULL,
+        .send = uplink_log_transport_send,
+        .power_down = NULL
+};
+
+const uplink_transport_t* uplink_transport = &uplink_log_transport; // current transport
+
+
+// sets transport used by the following drains
+void uplink_set_transport(const uplink_transport_t* transport)
+{
+    uplink_transport = transport;
+}
+
+
+// appends sample to the uplink log
+esp_err_t uplink_log_sample(uint8_t subject_id, sample_channel_t channel, int16_t value, uint8_t src_index,
+                            uint32_t timestamp)
+{
+    return uplink_log_append(UPLINK_REC_SAMPLE, subject_id, channel, src_index, value, timestamp);
+}
+
+
+// appends analysis result to the uplink log
+esp_err_t uplink_log_result(uint8_t subject_id, int8_t state, uint8_t total_score, uint32_t timestamp)
+{
+    return uplink_log_append(UPLINK_REC_RESULT, subject_id, (uint8_t)state, total_score, 0, timestamp);
+}
+
+
+// checks if the log should be drained now
+bool uplink_is_due(bool is_urgent)
+{
+    uint32_t pending_cnt = uplink_log_get_pending_cnt();
+    if (uplink_transport == NULL || pending_cnt == 0)
+        return false;
+
+    if (is_urgent || pending_cnt >= UPLINK_BATCH_RECORDS)
+        return true;
+
+    uplink_record_t oldest;
+    if (uplink_log_read(uplink_log_get_ack_seq(), &oldest) != ESP_OK)
+        return true;    // unreadable record is skipped by the drain
+
+    uint32_t now = get_rtc_time_s();
+    return now >= oldest.timestamp && now - oldest.timestamp >= UPLINK_MAX_DELAY_S;
+}
+
+
+// drains the uplink log, if it is due, in batches over the transport
+// on a critical state (is_urgent) the log is drained at once
+esp_err_t uplink_poll(bool is_urgent)
+{
+    if (!uplink_is_due(is_urgent))
+        return ESP_OK;
+
+    // staged records are sent from RTC memory as well, but a drain costs
+    // much more than a flash write, so they are not kept for later
+    uplink_log_flush();
+
+    if (uplink_transport->power_up != NULL && uplink_transport->power_up() != ESP_OK)
+    {
+        TRACE_E(TRACE_UPLINK_FAIL, 2, 0);
+        return ESP_FAIL;
+    }
+
+    uint8_t batch[UPLINK_BATCH_MAX_LEN];
+    size_t batch_size = uplink_transport->max_batch_len < sizeof(batch) ? uplink_transport->max_batch_len : sizeof(batch);
+    esp_err_t err = ESP_OK;
+    while (uplink_log_get_pending_cnt() > 0 && err == ESP_OK)
+    {
+        uint32_t first_seq = uplink_log_get_ack_seq();
+        uint32_t next_seq = first_seq;
+        size_t batch_len = uplink_encode_batch(batch, batch_size, first_seq, &next_seq);
+        if (batch_len == 0)
+        {
+            // no readable record is left, skip the unreadable ones
+            uplink_log_ack(next_seq);
+            break;
+        }
+
+        err = uplink_transport->send(batch, batch_len);
+        if (err == ESP_OK)
+        {
+            TRACE_I(TRACE_UPLINK_BATCH, first_seq, (next_seq - first_seq) | (batch_len << 16));
+            uplink_log_ack(next_seq);
+        }
+        else
+            TRACE_E(TRACE_UPLINK_FAIL, 3, err);
+    }
+
+    if (uplink_transport->power_down != NULL)
+        uplink_transport->power_down();
+    return err;
+}
+
+
+// encodes records from first_seq into a batch, as many as fit into the buffer,
+// next_seq is set to the sequence number after the last encoded (or skipped) one
+// unreadable records (torn ones) are skipped, they can not be delivered anyway
+// returns length of the batch, 0 if no readable record is left
+size_t uplink_encode_batch(uint8_t* dest_buff, size_t dest_buff_len, uint32_t first_seq, uint32_t* next_seq)
+{
+    if (dest_buff == NULL || next_seq == NULL || dest_buff_len < UPLINK_BATCH_HDR_SIZE + UPLINK_RECORD_MAX_LEN)
+        return 0;
+
+    int16_t last_values[MAX_SUBJECTS][CHANNEL_CNT] = {};
+    uint32_t head_seq = uplink_log_get_head_seq();
+    uint32_t base_timestamp = 0;
+    uint32_t last_timestamp = 0;
+    uint16_t records_cnt = 0;
+    size_t len = UPLINK_BATCH_HDR_SIZE;
+    uint32_t seq = first_seq;
+    for (; seq < head_seq && len + UPLINK_RECORD_MAX_LEN <= dest_buff_len && records_cnt < UINT16_MAX; seq++)
+    {
+        uplink_record_t record;
+        if (uplink_log_read(seq, &record) != ESP_OK || record.subject_id >= MAX_SUBJECTS ||
+            (record.type == UPLINK_REC_SAMPLE && record.code >= CHANNEL_CNT))
+        {
+            if (records_cnt == 0)   // the batch starts from the first readable record
+                first_seq = seq + 1;
+            else
+                break;  // records of a batch follow each other without gaps
+            continue;
+        }
+
+        if (records_cnt == 0)   // the base time is the time of the first record
+            last_timestamp = base_timestamp = record.timestamp;
+
+        dest_buff[len++] = (record.type << 6) | (record.subject_id & 0x3F);
+        len += put_varint(dest_buff + len, (int32_t)(record.timestamp - last_timestamp));
+        last_timestamp = record.timestamp;
+        if (record.type == UPLINK_REC_SAMPLE)
+        {
+            int16_t* last_value = &last_values[record.subject_id][record.code];
+            dest_buff[len++] = record.code;
+            dest_buff[len++] = record.extra;
+            len += put_varint(dest_buff + len, record.value - *last_value);
+            *last_value = record.value;
+        }
+        else
+        {
+            dest_buff[len++] = record.code;
+            dest_buff[len++] = record.extra;
+        }
+        records_cnt++;
+    }
+
+    *next_seq = seq;
+    if (records_cnt == 0)
+        return 0;
+
+    dest_buff[0] = UPLINK_BATCH_VERSION;
+    PUT_BE32(dest_buff + 1, first_seq);
+    PUT_BE32(dest_buff + 5, base_timestamp);
+    PUT_BE16(dest_buff + 9, records_cnt);
+    return len;
+}
+
+
+// writes value as zigzag varint (7 bits per byte, the lowest first)
+// returns number of written bytes
+uint8_t put_varint(uint8_t* dest_buff, int32_t value)
+{
+    uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+    uint8_t len = 0;
+    do
+    {
+        uint8_t byte = zigzag & 0x7F;
+        zigzag >>= 7;
+        dest_buff[len++] = byte | (zigzag != 0 ? 0x80 : 0);
+    } while (zigzag != 0);
+
+    return len;
+}
+
+
+// prints batch over UART, delivery is always confirmed
+esp_err_t uplink_log_transport_send(const uint8_t* batch, size_t batch_len)
+{
+    ESP_LOGI(g_tag_uplink, "Batch of %u bytes:", (unsigned)batch_len);
+    ESP_LOG_BUFFER_HEX(g_tag_uplink, batch, batch_len);
+    return ESP_OK;
+}
+
+
+#endif /* MAIN_UPLINK_H_ */
@@ -0,0 +1,354 @@
+/*
+ * uplink_log.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_UPLINK_LOG_H_
+#define MAIN_UPLINK_LOG_H_
+
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
+#include "esp_check_err.h"
+#include "trace.h"
+#include "sdkconfig.h"
+
+// Description:
+// The uplink log is a persistent append-only log of records for the central data
+// center (CDC): analysis results and raw samples. It lives in the "uplink" flash
+// partition (see partitions.csv), which is used as a ring of sectors. Every record
+// has a fixed size of 16 bytes and a sequence number, which grows by one per record
+// and is never reused, so a record in flash is found by its sequence number without
+// any index. Appended records are staged in RTC memory first and are written to
+// flash UPLINK_STAGE_LEN at a time, so a wake cycle usually does not touch flash at
+// all. When the head enters a new sector, the sector is erased, the oldest records
+// are dropped with it (delivered or not). The ack cursor is the sequence number of
+// the first record not delivered yet, it is moved only after a transport confirms
+// delivery (see uplink.h) and is persisted in NVS, so every record is delivered at
+// least once, even across power loss. The head is kept in RTC memory, after power
+// loss it is recovered by reading the first record of every sector and scanning the
+// newest sector. Every record is protected by CRC16, a torn record is skipped.
+
+#define UPLINK_PARTITION_LABEL  "uplink"        // label of the log partition
+#define UPLINK_NVS_NAMESPACE    "uplink"        // NVS namespace of the ack cursor
+#define UPLINK_NVS_ACK_KEY      "ack"           // key of the ack cursor
+#define UPLINK_RECORD_SIZE      16              // size of one record, in bytes
+#define UPLINK_SECTOR_SIZE      4096            // flash sector size, the unit of erasing
+#define UPLINK_SECTOR_RECORDS   (UPLINK_SECTOR_SIZE / UPLINK_RECORD_SIZE)
+#define UPLINK_STAGE_LEN        16              // number of records staged in RTC memory
+#define UPLINK_ERASED_SEQ       UINT32_MAX      // sequence number of never written slot
+
+// enum of record types
+typedef enum {
+    UPLINK_REC_SAMPLE = 0,  // raw sample (see sample_history.h)
+    UPLINK_REC_RESULT = 1   // analysis result of a subject (see analysis_module.h)
+} uplink_rec_type_t;
+
+// struct that describes one record of the log
+typedef struct {
+    uint32_t seq;           // sequence number
+    uint32_t timestamp;     // RTC time, in s
+    uint8_t type;           // record type (uplink_rec_type_t)
+    uint8_t subject_id;     // subject of the record
+    uint8_t code;           // channel of sample, state of result
+    uint8_t extra;          // source index of sample, total score of result
+    int16_t value;          // value of sample, 0 for result
+    uint16_t crc;           // CRC16 of all the fields above
+} uplink_record_t;
+
+
+esp_err_t uplink_log_init();
+esp_err_t uplink_log_append(uplink_rec_type_t type, uint8_t subject_id, uint8_t code, uint8_t extra,
+                            int16_t value, uint32_t timestamp);
+esp_err_t uplink_log_flush();
+esp_err_t uplink_log_read(uint32_t seq, uplink_record_t* record);
+esp_err_t uplink_log_ack(uint32_t seq);
+uint32_t uplink_log_get_head_seq();
+uint32_t uplink_log_get_first_seq();
+uint32_t uplink_log_get_ack_seq();
+uint32_t uplink_log_get_pending_cnt();
+esp_err_t uplink_log_recover();
+uint32_t uplink_log_get_offset(uint32_t seq);
+uint16_t uplink_record_crc(const uplink_record_t* record);
+
+
+const char* g_tag_ulog = "ULOG";    // tag used in ESP_CHECK
+
+const esp_partition_t* uplink_partition = NULL; // log partition, found on init
+uint32_t uplink_capacity = 0;                   // number of record slots in the partition
+
+// log state, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR bool uplink_is_recovered = false; // flag to indicate whether head and cursor are valid
+RTC_DATA_ATTR uint32_t uplink_head_seq = 0;     // sequence number of the next record written to flash
+RTC_DATA_ATTR uint32_t uplink_ack_seq = 0;      // sequence number of the first undelivered record
+RTC_DATA_ATTR uplink_record_t uplink_stage[UPLINK_STAGE_LEN];   // records not written to flash yet
+RTC_DATA_ATTR uint8_t uplink_stage_cnt = 0;     // number of staged records
+
+_Static_assert(sizeof(uplink_record_t) == UPLINK_RECORD_SIZE, "uplink record must be packed");
+
+
+// inits the log, finds its partition and restores head and
+// ack cursor, if RTC memory has been lost
+esp_err_t uplink_log_init()
+{
+    uplink_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                UPLINK_PARTITION_LABEL);
+    if (uplink_partition == NULL || uplink_partition->size < 2 * UPLINK_SECTOR_SIZE)
+    {
+        ESP_LOGE(g_tag_ulog, "Uplink partition is not found!");
+        return ESP_FAIL;
+    }
+    uplink_capacity = uplink_partition->size / UPLINK_RECORD_SIZE;
+
+    if (uplink_is_recovered)
+        return ESP_OK;
+
+    return uplink_log_recover();
+}
+
+
+// appends record to the log, the record is staged in RTC memory,
+// staged records are written to flash when the stage is full
+esp_err_t uplink_log_append(uplink_rec_type_t type, uint8_t subject_id, uint8_t code, uint8_t extra,
+                            int16_t value, uint32_t timestamp)
+{
+    if (uplink_partition == NULL)
+        return ESP_FAIL;
+
+    if (uplink_stage_cnt == UPLINK_STAGE_LEN && uplink_log_flush() != ESP_OK)
+        return ESP_FAIL;
+
+    uplink_record_t* record = &uplink_stage[uplink_stage_cnt];
+    record->seq = uplink_head_seq + uplink_stage_cnt;
+    record->timestamp = timestamp;
+    record->type = type;
+    record->subject_id = subject_id;
+    record->code = code;
+    record->extra = extra;
+    record->value = value;
+    record->crc = uplink_record_crc(record);
+    uplink_stage_cnt++;
+
+    if (uplink_stage_cnt == UPLINK_STAGE_LEN)
+        return uplink_log_flush();
+    return ESP_OK;
+}
+
+
+// writes staged records to flash, the sector is erased when the head enters it
+esp_err_t uplink_log_flush()
+{
+    if (uplink_partition == NULL)
+        return ESP_FAIL;
+
+    uint8_t written_cnt = 0;
+    esp_err_t err = ESP_OK;
+    while (written_cnt < uplink_stage_cnt && err == ESP_OK)
+    {
+        uint32_t offset = uplink_log_get_offset(uplink_head_seq);
+        if (offset % UPLINK_SECTOR_SIZE == 0)
+            err = esp_partition_erase_range(uplink_partition, offset, UPLINK_SECTOR_SIZE);
+
+        // the rest of the sector is written at once
+        uint8_t cnt = uplink_stage_cnt - written_cnt;
+        uint32_t sector_left = (UPLINK_SECTOR_SIZE - offset % UPLINK_SECTOR_SIZE) / UPLINK_RECORD_SIZE;
+        if (cnt > sector_left)
+            cnt = sector_left;
+
+        if (err == ESP_OK)
+            err = esp_partition_write(uplink_partition, offset, &uplink_stage[written_cnt], cnt * UPLINK_RECORD_SIZE);
+        if (err == ESP_OK)
+        {
+            written_cnt += cnt;
+            uplink_head_seq += cnt;
+        }
+    }
+
+    // keep records which were not written, they are written by the next flush
+    if (written_cnt > 0)
+    {
+        memmove(uplink_stage, &uplink_stage[written_cnt], (uplink_stage_cnt - written_cnt) * sizeof(uplink_record_t));
+        uplink_stage_cnt -= written_cnt;
+        TRACE_I(TRACE_UPLINK_FLUSH, written_cnt, uplink_head_seq);
+    }
+
+    if (err != ESP_OK)
+    {
+        TRACE_E(TRACE_UPLINK_FAIL, 0, err);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+
+// reads record by its sequence number, from flash or from the stage
+esp_err_t uplink_log_read(uint32_t seq, uplink_record_t* record)
+{
+    if (uplink_partition == NULL || record == NULL)
+        return ESP_FAIL;
+
+    if (seq >= uplink_head_seq)
+    {
+        if (seq - uplink_head_seq >= uplink_stage_cnt)
+            return ESP_FAIL;
+        *record = uplink_stage[seq - uplink_head_seq];
+        return ESP_OK;
+    }
+
+    if (seq < uplink_log_get_first_seq())   // dropped with its sector
+        return ESP_FAIL;
+
+    if (esp_partition_read(uplink_partition, uplink_log_get_offset(seq), record, sizeof(*record)) != ESP_OK)
+        return ESP_FAIL;
+
+    // torn or overwritten record
+    if (record->seq != seq || record->crc != uplink_record_crc(record))
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+
+// moves the ack cursor, every record before seq has been delivered
+esp_err_t uplink_log_ack(uint32_t seq)
+{
+    if (seq <= uplink_ack_seq)
+        return ESP_OK;
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(UPLINK_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_u32(handle, UPLINK_NVS_ACK_KEY, seq);
+        if (err == ESP_OK)
+            err = nvs_commit(handle);
+        nvs_close(handle);
+    }
+
+    // the cursor moves even if it is not persisted,
+    // after power loss some records are delivered again
+    uplink_ack_seq = seq;
+    if (err != ESP_OK)
+    {
+        TRACE_E(TRACE_UPLINK_FAIL, 1, err);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+
+// gets sequence number of the next appended record
+uint32_t uplink_log_get_head_seq()
+{
+    return uplink_head_seq + uplink_stage_cnt;
+}
+
+
+// gets sequence number of the oldest record kept in flash, the head
+// sector is not full, so one sector is never counted in
+uint32_t uplink_log_get_first_seq()
+{
+    uint32_t kept_cnt = uplink_capacity - UPLINK_SECTOR_RECORDS + uplink_head_seq % UPLINK_SECTOR_RECORDS;
+    return uplink_head_seq > kept_cnt ? uplink_head_seq - kept_cnt : 0;
+}
+
+
+// gets sequence number of the first undelivered record
+// records dropped with their sector are not waited for
+uint32_t uplink_log_get_ack_seq()
+{
+    uint32_t first_seq = uplink_log_get_first_seq();
+    return uplink_ack_seq > first_seq ? uplink_ack_seq : first_seq;
+}
+
+
+// gets number of undelivered records
+uint32_t uplink_log_get_pending_cnt()
+{
+    return uplink_log_get_head_seq() - uplink_log_get_ack_seq();
+}
+
+
+// restores head and ack cursor after RTC memory has been lost: finds the
+// sector with the newest first record and counts written slots in it
+esp_err_t uplink_log_recover()
+{
+    uint32_t sectors_cnt = uplink_partition->size / UPLINK_SECTOR_SIZE;
+    uint32_t head_sector = 0;
+    uint32_t head_sector_seq = UPLINK_ERASED_SEQ;
+    for (uint32_t sector = 0; sector < sectors_cnt; sector++)
+    {
+        uplink_record_t record;
+        if (esp_partition_read(uplink_partition, sector * UPLINK_SECTOR_SIZE, &record, sizeof(record)) != ESP_OK)
+            return ESP_FAIL;
+
+        if (record.seq == UPLINK_ERASED_SEQ || record.crc != uplink_record_crc(&record) ||
+            record.seq % UPLINK_SECTOR_RECORDS != 0)
+            continue;
+
+        if (head_sector_seq == UPLINK_ERASED_SEQ || record.seq > head_sector_seq)
+        {
+            head_sector = sector;
+            head_sector_seq = record.seq;
+        }
+    }
+
+    uplink_head_seq = 0;
+    if (head_sector_seq != UPLINK_ERASED_SEQ)
+    {
+        // records are appended, so written slots are followed by erased ones only
+        uint32_t written_cnt = 1;
+        while (written_cnt < UPLINK_SECTOR_RECORDS)
+        {
+            uint32_t seq;
+            uint32_t offset = head_sector * UPLINK_SECTOR_SIZE + written_cnt * UPLINK_RECORD_SIZE;
+            if (esp_partition_read(uplink_partition, offset, &seq, sizeof(seq)) != ESP_OK)
+                return ESP_FAIL;
+            if (seq == UPLINK_ERASED_SEQ)
+                break;
+            written_cnt++;
+        }
+        uplink_head_seq = head_sector_seq + written_cnt;
+    }
+
+    // restore the ack cursor, nothing has been delivered if it was never saved
+    uplink_ack_seq = 0;
+    nvs_handle_t handle;
+    if (nvs_open(UPLINK_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK)
+    {
+        nvs_get_u32(handle, UPLINK_NVS_ACK_KEY, &uplink_ack_seq);
+        nvs_close(handle);
+    }
+    if (uplink_ack_seq > uplink_head_seq)   // the partition has been erased
+        uplink_ack_seq = uplink_head_seq;
+
+    uplink_stage_cnt = 0;
+    uplink_is_recovered = true;
+    ESP_LOGI(g_tag_ulog, "Uplink log recovered: head %lu, ack %lu.", (unsigned long)uplink_head_seq,
+            (unsigned long)uplink_ack_seq);
+    return ESP_OK;
+}
+
+
+// gets offset of record slot with given sequence number in the partition
+uint32_t uplink_log_get_offset(uint32_t seq)
+{
+    return (seq % uplink_capacity) * UPLINK_RECORD_SIZE;
+}
+
+
+// calculates CRC16 of record, the crc field itself is not included
+uint16_t uplink_record_crc(const uplink_record_t* record)
+{
+    return esp_rom_crc16_le(0, (const uint8_t*)record, offsetof(uplink_record_t, crc));
+}
+
+
+#endif /* MAIN_UPLINK_LOG_H_ */
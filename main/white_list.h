@@ -10,23 +10,43 @@
 
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include "host/ble_hs.h"
 #include "esp_check_err.h"
+#include "sdkconfig.h"
 
 // Description:
-// The white list is a static array of three structures (aka device_data_t), each
+// The white list is a static array of WHITE_LIST_SIZE slots (aka device_data_t), each
 // containing a 16-bit service UUID, an address, and a flag indicating whether the
-// address field is empty or not. At initialisation, the list is preloaded with
-// interesting UUIDs (0x1809 - temperature, 0x1822 - pulseox, 0x183E - physical
-// activity monitor) and empty address fields. During device registration, the address
-// field of the corresponding structure is updated with the received address, and the
-// flag is set to 0 (is not empty). When a device is removed from the list, the flag
-// is reset to 1 (is empty). The list includes typical utility functions for adding and
-// removing entries, checking for the presence of an address or UUID, verifying if
-// the list is empty, and more. To ensure user settings persist, the list's values
-// are retained during sleep mode and restored upon wakeup.
-
+// slot is empty or not. The capacity is set in Kconfig. Only interesting UUIDs
+// (0x1809 - temperature, 0x1822 - pulseox, 0x183E - physical activity monitor) may
+// be registered, up to WHITE_LIST_MAX_PER_UUID devices per UUID (e.g. two temperature
+// probes). A registered device keeps its slot until it is removed, so the slot index
+// is a stable id of the device (stored with its samples, see sample_history.h). Next
+// to the slots the list keeps an index array of occupied slots sorted by address, so
+// an address is found by binary search in O(log n), and the number of entries per
+// interesting UUID, so checking whether a UUID is interesting is O(1). The list
+// includes typical utility functions for adding and removing entries, checking for
+// the presence of an address or UUID, verifying if the list is empty, and more. To
+// ensure user settings persist, the list's values are retained during sleep mode
+// and restored upon wakeup.
+// One gateway may serve several subjects (e.g. a squad), every entry belongs to a
+// subject, which is chosen at registration time (see set_registration_subject). The
+// limit of entries per UUID applies to every subject separately.
+// Every slot changed since the last save is marked dirty, so only changed entries
+// are written to NVS (see more white_list_storage.h). Every change of the set of
+// addresses increments the generation of the list, so the addresses (kept in a
+// static array) and the filter accept list of the controller are rebuilt only
+// when the list has actually changed.
+
+
+#define WHITE_LIST_SIZE         CONFIG_AM_WHITE_LIST_CAPACITY       // number of slots in the white list
+#define WHITE_LIST_MAX_PER_UUID CONFIG_AM_WHITE_LIST_MAX_PER_UUID   // max number of entries with the same uuid per subject
+#define MAX_SUBJECTS            CONFIG_AM_MAX_SUBJECTS              // number of subjects served by the gateway
+#define WL_UUID_CNT             3   // number of interesting uuids
+
+_Static_assert(WHITE_LIST_SIZE <= INT8_MAX, "white list index must fit into int8_t");
 
 // struct that describes device in white list
 typedef struct
@@ -34,43 +54,69 @@ typedef struct
     ble_uuid16_t device_uuid;   // device uuid
     ble_addr_t device_addr;     // device mac addr
     bool addr_is_empty;         // flag indicating whether the addr field is empty or not
+    uint8_t subject_id;         // subject the device belongs to
+    uint8_t adv_phy;            // PHYs of device adverts, see ADV_PHY in ext_scan.h
 } device_data_t;
 
+_Static_assert(sizeof(device_data_t) == 14, "white list entry size must not change, entries are stored in NVS");
+
 
 esp_err_t init_white_list();
 esp_err_t deinit_white_list();
 uint8_t get_white_list_len();
-esp_err_t push_to_white_list(ble_uuid16_t uuid, ble_addr_t addr);
+esp_err_t push_to_white_list(ble_uuid16_t uuid, ble_addr_t addr, uint8_t adv_phy);
 esp_err_t remove_from_white_list_by_addr(const ble_addr_t* addr);
 esp_err_t remove_from_white_list_by_uuid16(const ble_uuid16_t* uuid);
 bool uuid_is_interesting(const ble_uuid16_t* uuid);
 bool white_list_contains_addr(const ble_addr_t* addr);
+int8_t get_white_list_index_by_addr(const ble_addr_t* addr);
+int8_t get_white_list_index_by_pos(uint8_t pos);
+esp_err_t set_registration_subject(uint8_t subject_id);
+uint8_t get_registration_subject();
+uint8_t get_subject_sensors_cnt(uint8_t subject_id);
+uint8_t get_subject_sensors_cnt_by_uuid16(uint8_t subject_id, const ble_uuid16_t* uuid);
+int8_t get_free_subject_id();
+bool white_list_slot_is_dirty(uint8_t slot);
+void mark_white_list_slot_dirty(uint8_t slot);
+void clear_white_list_dirty();
+esp_err_t restore_white_list_slot(uint8_t slot, const device_data_t* entry);
 bool white_list_is_empty();
-esp_err_t get_addr_white_list(ble_addr_t **device_addr);
+esp_err_t get_addr_white_list(const ble_addr_t **device_addr);
+uint32_t get_white_list_generation();
 bool uuids16_are_equal(const ble_uuid16_t* uuid1, const ble_uuid16_t* uuid2);
 bool addrs_are_equal(const ble_addr_t* addr1, const ble_addr_t* addr2);
+int addrs_compare(const ble_addr_t* addr1, const ble_addr_t* addr2);
+int8_t get_wl_uuid_index(const ble_uuid16_t* uuid);
+int8_t find_sorted_pos(const ble_addr_t* addr, bool* found);
 
 
 bool wl_is_initialised = false;     // flag to indicate whether white list has been inited
-const uint8_t white_list_size = 3;  // size of the white list
+const uint8_t white_list_size = WHITE_LIST_SIZE;  // size of the white list
 uint8_t white_list_len = 0;         // number of entries in the white list
+uint8_t wl_registration_subject = 0;    // subject of devices being registered
+
+// interesting uuids, only devices with these uuids can be registered
+const ble_uuid16_t wl_uuids[WL_UUID_CNT] = {
+        BLE_UUID16_INIT(0x1809),    // 0x1809 - temperature
+        BLE_UUID16_INIT(0x1822),    // 0x1822 - pulseox
+        BLE_UUID16_INIT(0x183E)     // 0x183E - physical activity monitor
+};
 
 
 // white list, stored in RTC memory to persist across sleep cycles
-RTC_DATA_ATTR device_data_t white_list[] = {
-        {.device_uuid = BLE_UUID16_INIT(0x1809),// 0x1809 - temperature
-        .device_addr = {},
-        .addr_is_empty = true
-        },
-        {.device_uuid = BLE_UUID16_INIT(0x1822),// 0x1822 - pulseox
-        .device_addr = {},
-        .addr_is_empty = true
-        },
-        {.device_uuid = BLE_UUID16_INIT(0x183E),// 0x183E - physical activity monitor
-        .device_addr = {},
-        .addr_is_empty = true
-        }
+RTC_DATA_ATTR device_data_t white_list[WHITE_LIST_SIZE] = {
+        [0 ... WHITE_LIST_SIZE - 1] = {.device_uuid = {}, .device_addr = {}, .addr_is_empty = true}
 };
+RTC_DATA_ATTR uint8_t wl_sorted[WHITE_LIST_SIZE];   // slot indices of entries, sorted by addr
+RTC_DATA_ATTR uint8_t wl_sorted_len = 0;            // number of entries in wl_sorted
+RTC_DATA_ATTR uint8_t wl_uuid_cnt[MAX_SUBJECTS][WL_UUID_CNT];  // number of entries per subject and interesting uuid
+RTC_DATA_ATTR uint8_t wl_subject_cnt[MAX_SUBJECTS];             // number of entries per subject
+RTC_DATA_ATTR uint32_t wl_dirty[(WHITE_LIST_SIZE + 31) / 32];   // bitmap of slots changed since the last save
+RTC_DATA_ATTR uint32_t wl_change_generation = 0;                // incremented on every change of the list
+
+ble_addr_t wl_addrs[WHITE_LIST_SIZE];   // addrs of the entries, sorted like the index array
+uint32_t wl_addrs_generation = 0;       // generation wl_addrs were built for
+bool wl_addrs_are_built = false;        // flag to indicate whether wl_addrs have been built since boot
 
 
 // inits the white list
@@ -79,8 +125,8 @@ esp_err_t init_white_list()
     if (wl_is_initialised)  // check if already initialised
         return ESP_FAIL;
 
-    white_list_len = get_white_list_len();  // count the non-empty entries (after sleep)
-    wl_is_initialised = true;               // mark as initialised
+    white_list_len = wl_sorted_len; // restore the list length (after sleep)
+    wl_is_initialised = true;       // mark as initialised
     return ESP_OK;
 }
 
@@ -109,25 +155,43 @@ uint8_t get_white_list_len()
 }
 
 
-// adds a device to the white list by uuid and addr
-esp_err_t push_to_white_list(ble_uuid16_t uuid, ble_addr_t addr)
+// adds a device to the white list by uuid and addr, adv_phy - PHYs of its adverts
+esp_err_t push_to_white_list(ble_uuid16_t uuid, ble_addr_t addr, uint8_t adv_phy)
 {
     if (!wl_is_initialised) // check if already initialised
         return ESP_FAIL;
 
-    if (white_list_len == white_list_size)   // check if the list is full
+    if (!uuid_is_interesting(&uuid))    // check if the list is full or no more devices with this uuid
+        return ESP_FAIL;
+
+    bool found;
+    int8_t pos = find_sorted_pos(&addr, &found);
+    if (found)  // check if the addr is already in the list
         return ESP_FAIL;
 
     for (uint8_t i = 0; i < white_list_size; i++)
-        if (white_list[i].addr_is_empty && uuids16_are_equal(&white_list[i].device_uuid, &uuid))
+        if (white_list[i].addr_is_empty)
         {
-            white_list[i].device_addr = addr;       // assign the addr to entity with corresp. uuid
-            white_list[i].addr_is_empty = false;    // mark as not empty entity with corresp. uuid
+            white_list[i].device_uuid = uuid;       // assign the uuid and addr to the empty slot
+            white_list[i].device_addr = addr;
+            white_list[i].addr_is_empty = false;    // mark slot as not empty
+            white_list[i].subject_id = wl_registration_subject;
+            white_list[i].adv_phy = adv_phy;
+            wl_dirty[i / 32] |= 1UL << (i % 32);    // mark slot as changed
+
+            // insert slot index keeping the index array sorted
+            memmove(&wl_sorted[pos + 1], &wl_sorted[pos], wl_sorted_len - pos);
+            wl_sorted[pos] = i;
+            wl_sorted_len++;
+            wl_uuid_cnt[wl_registration_subject][get_wl_uuid_index(&uuid)]++;
+            wl_change_generation++;
+            wl_subject_cnt[wl_registration_subject]++;
+
             white_list_len++;   // increment the list length
             return ESP_OK;
         }
 
-    return ESP_FAIL;    // no matching entry found
+    return ESP_FAIL;    // no empty slot found
 }
 
 
@@ -140,19 +204,26 @@ esp_err_t remove_from_white_list_by_addr(const ble_addr_t* addr)
     if (white_list_len == 0)    // check if the list is empty
         return ESP_FAIL;
 
-    for (uint8_t i = 0; i < white_list_size; i++)
-        if (!white_list[i].addr_is_empty && addrs_are_equal(&white_list[i].device_addr, addr))
-        {
-            white_list[i].addr_is_empty = true; // mark as empty entity with corresp. addr
-            white_list_len--;   // decrement the list length
-            return ESP_OK;
-        }
-
-    return ESP_FAIL;    // addr not found
+    bool found;
+    int8_t pos = find_sorted_pos(addr, &found);
+    if (!found)
+        return ESP_FAIL;    // addr not found
+
+    uint8_t i = wl_sorted[pos];
+    white_list[i].addr_is_empty = true; // mark as empty entity with corresp. addr
+    wl_dirty[i / 32] |= 1UL << (i % 32);    // mark slot as changed
+    wl_uuid_cnt[white_list[i].subject_id][get_wl_uuid_index(&white_list[i].device_uuid)]--;
+    wl_subject_cnt[white_list[i].subject_id]--;
+    wl_change_generation++;
+    memmove(&wl_sorted[pos], &wl_sorted[pos + 1], wl_sorted_len - pos - 1);
+    wl_sorted_len--;
+
+    white_list_len--;   // decrement the list length
+    return ESP_OK;
 }
 
 
-// removes a device from the white list by uuid
+// removes a device from the white list by uuid (the first one by addr)
 esp_err_t remove_from_white_list_by_uuid16(const ble_uuid16_t* uuid)
 {
     if (!wl_is_initialised)     // check if already initialised
@@ -161,19 +232,16 @@ esp_err_t remove_from_white_list_by_uuid16(const ble_uuid16_t* uuid)
     if (white_list_len == 0)    // check if the list is empty
         return ESP_FAIL;
 
-    for (uint8_t i = 0; i < white_list_size; i++)
-        if (!white_list[i].addr_is_empty && uuids16_are_equal(&white_list[i].device_uuid, uuid))
-        {
-            white_list[i].addr_is_empty = true; // mark as empty entity with corresp. addr
-            white_list_len--;   // decrement the list length
-            return ESP_OK;
-        }
+    for (uint8_t pos = 0; pos < wl_sorted_len; pos++)
+        if (uuids16_are_equal(&white_list[wl_sorted[pos]].device_uuid, uuid))
+            return remove_from_white_list_by_addr(&white_list[wl_sorted[pos]].device_addr);
 
     return ESP_FAIL;    // uuid not found
 }
 
 
-// checks if the uuid is interesting (in the white list) and has no assigned address
+// checks if the uuid is interesting and one more device with it can be
+// registered for the current registration subject
 bool uuid_is_interesting(const ble_uuid16_t* uuid)
 {
     if (!wl_is_initialised)     // check if already initialised
@@ -182,28 +250,147 @@ bool uuid_is_interesting(const ble_uuid16_t* uuid)
     if (white_list_len == white_list_size)  // check if the list is full
         return false;
 
-    for (uint8_t i = 0; i < white_list_size; i++)
-        if (white_list[i].addr_is_empty && uuids16_are_equal(&white_list[i].device_uuid, uuid))
-            return true;    // uuid is interesting
-
-    return false;    // uuid not found
+    int8_t uuid_index = get_wl_uuid_index(uuid);
+    return uuid_index != -1 && wl_uuid_cnt[wl_registration_subject][uuid_index] < WHITE_LIST_MAX_PER_UUID;
 }
 
 
 // checks if the white list contains a specific mac address
 bool white_list_contains_addr(const ble_addr_t* addr)
+{
+    return get_white_list_index_by_addr(addr) != -1;
+}
+
+
+// gets index of the white list slot with a specific mac address
+// returns -1 if addr is not found
+int8_t get_white_list_index_by_addr(const ble_addr_t* addr)
 {
     if (!wl_is_initialised)     // check if already initialised
-        return false;
+        return -1;
 
     if (white_list_len == 0)    // check if the list is empty
-        return false;
+        return -1;
 
-    for (uint8_t i = 0; i < white_list_size; i++)
-        if (!white_list[i].addr_is_empty && addrs_are_equal(&white_list[i].device_addr, addr))
-            return true;    // addr found
+    bool found;
+    int8_t pos = find_sorted_pos(addr, &found);
+    return found ? wl_sorted[pos] : -1;
+}
+
+
+// gets index of the white list slot by position of its entry in the
+// list (0 - white_list_len - 1), used to iterate over the entries
+// returns -1 if there is no such entry
+int8_t get_white_list_index_by_pos(uint8_t pos)
+{
+    if (!wl_is_initialised || pos >= wl_sorted_len)
+        return -1;
+
+    return wl_sorted[pos];
+}
+
+
+// sets subject of devices being registered
+esp_err_t set_registration_subject(uint8_t subject_id)
+{
+    if (subject_id >= MAX_SUBJECTS)
+        return ESP_FAIL;
+
+    wl_registration_subject = subject_id;
+    return ESP_OK;
+}
+
+
+// gets subject of devices being registered
+uint8_t get_registration_subject()
+{
+    return wl_registration_subject;
+}
+
+
+// gets number of entries of given subject
+uint8_t get_subject_sensors_cnt(uint8_t subject_id)
+{
+    if (subject_id >= MAX_SUBJECTS)
+        return 0;
+
+    return wl_subject_cnt[subject_id];
+}
+
+
+// gets number of entries of given subject with given uuid
+uint8_t get_subject_sensors_cnt_by_uuid16(uint8_t subject_id, const ble_uuid16_t* uuid)
+{
+    int8_t uuid_index = get_wl_uuid_index(uuid);
+    if (subject_id >= MAX_SUBJECTS || uuid_index == -1)
+        return 0;
+
+    return wl_uuid_cnt[subject_id][uuid_index];
+}
+
+
+// gets the lowest subject without any entries
+// returns -1 if every subject has entries
+int8_t get_free_subject_id()
+{
+    for (uint8_t i = 0; i < MAX_SUBJECTS; i++)
+        if (wl_subject_cnt[i] == 0)
+            return i;
+    return -1;
+}
+
+
+// checks if the slot has changed since the last save
+bool white_list_slot_is_dirty(uint8_t slot)
+{
+    return slot < WHITE_LIST_SIZE && (wl_dirty[slot / 32] & (1UL << (slot % 32)));
+}
+
+
+// marks the slot as changed, so the next save writes it (or erases its key, if empty)
+void mark_white_list_slot_dirty(uint8_t slot)
+{
+    if (slot < WHITE_LIST_SIZE)
+        wl_dirty[slot / 32] |= 1UL << (slot % 32);
+}
+
+
+// marks all slots as saved
+void clear_white_list_dirty()
+{
+    memset(wl_dirty, 0, sizeof(wl_dirty));
+}
+
+
+// restores an entry into given slot (e.g. from NVS after power loss),
+// the entry is not marked dirty, since it is already saved
+esp_err_t restore_white_list_slot(uint8_t slot, const device_data_t* entry)
+{
+    if (!wl_is_initialised || slot >= WHITE_LIST_SIZE || entry->addr_is_empty)
+        return ESP_FAIL;
+
+    if (!white_list[slot].addr_is_empty)    // check if slot is already taken
+        return ESP_FAIL;
+
+    int8_t uuid_index = get_wl_uuid_index(&entry->device_uuid);
+    if (uuid_index == -1 || entry->subject_id >= MAX_SUBJECTS)
+        return ESP_FAIL;
+
+    bool found;
+    int8_t pos = find_sorted_pos(&entry->device_addr, &found);
+    if (found)  // check if the addr is already in the list
+        return ESP_FAIL;
+
+    white_list[slot] = *entry;
+    memmove(&wl_sorted[pos + 1], &wl_sorted[pos], wl_sorted_len - pos);
+    wl_sorted[pos] = slot;
+    wl_sorted_len++;
+    wl_uuid_cnt[entry->subject_id][uuid_index]++;
+    wl_subject_cnt[entry->subject_id]++;
+    wl_change_generation++;
 
-    return false;    // addr not found
+    white_list_len++;   // increment the list length
+    return ESP_OK;
 }
 
 
@@ -214,8 +401,9 @@ bool white_list_is_empty()
 }
 
 
-// retrieves all addrs in the white list (not structures)
-esp_err_t get_addr_white_list(ble_addr_t **addr)
+// retrieves all addrs in the white list (not structures), the addrs are
+// kept in a static array, which is rebuilt only if the list has changed
+esp_err_t get_addr_white_list(const ble_addr_t **addr)
 {
     if (!wl_is_initialised)     // check if already initialised
         return ESP_FAIL;
@@ -223,16 +411,26 @@ esp_err_t get_addr_white_list(ble_addr_t **addr)
     if (white_list_len == 0)    // check if the list is empty
         return ESP_FAIL;
 
-    *addr = (ble_addr_t*)malloc(white_list_len); // allocate memory for addrs
-    uint8_t cnt = 0;
-    for (uint8_t i = 0; i < white_list_size; i++)
-        if (!white_list[i].addr_is_empty)
-            (*addr)[cnt++] = white_list[i].device_addr;
+    if (!wl_addrs_are_built || wl_addrs_generation != wl_change_generation)
+    {
+        for (uint8_t pos = 0; pos < wl_sorted_len; pos++)
+            wl_addrs[pos] = white_list[wl_sorted[pos]].device_addr;
+        wl_addrs_generation = wl_change_generation;
+        wl_addrs_are_built = true;
+    }
 
+    *addr = wl_addrs;
     return ESP_OK;
 }
 
 
+// gets generation of the list, it is changed on every change of the list
+uint32_t get_white_list_generation()
+{
+    return wl_change_generation;
+}
+
+
 // compares two 16-bit uuids for equality
 bool uuids16_are_equal(const ble_uuid16_t* uuid1, const ble_uuid16_t* uuid2)
 {
@@ -253,4 +451,51 @@ bool addrs_are_equal(const ble_addr_t* addr1, const ble_addr_t* addr2)
 }
 
 
+// compares two mac addrs, first by type then by value
+// returns negative, zero or positive value like memcmp
+int addrs_compare(const ble_addr_t* addr1, const ble_addr_t* addr2)
+{
+    if (addr1->type != addr2->type)
+        return addr1->type - addr2->type;
+    return memcmp(addr1->val, addr2->val, 6);
+}
+
+
+// gets index of uuid among interesting uuids
+// returns -1 if uuid is not interesting
+int8_t get_wl_uuid_index(const ble_uuid16_t* uuid)
+{
+    for (uint8_t i = 0; i < WL_UUID_CNT; i++)
+        if (uuids16_are_equal(&wl_uuids[i], uuid))
+            return i;
+    return -1;
+}
+
+
+// finds position of addr in the sorted index array by binary search
+// if addr is not found, returns position to insert it at
+int8_t find_sorted_pos(const ble_addr_t* addr, bool* found)
+{
+    int8_t low = 0;
+    int8_t high = wl_sorted_len;
+    while (low < high)
+    {
+        int8_t mid = (low + high) / 2;
+        int cmp = addrs_compare(&white_list[wl_sorted[mid]].device_addr, addr);
+        if (cmp == 0)
+        {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    *found = false;
+    return low;
+}
+
+
 #endif /* MAIN_WHITE_LIST_H_ */
@@ -0,0 +1,202 @@
+/*
+ * white_list_storage.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_WHITE_LIST_STORAGE_H_
+#define MAIN_WHITE_LIST_STORAGE_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "nvs.h"
+#include "esp_check_err.h"
+#include "white_list.h"
+
+// Description:
+// The white list lives in RTC memory, which keeps its values during deep sleep but
+// not after power loss (brown-out, battery swap). To avoid registration of every
+// sensor again, the white list is mirrored to NVS. Every occupied slot is stored as
+// a separate blob under the key "e<slot>" together with the generation it was saved
+// in, an empty slot has no key. Saving writes only the slots marked dirty in the
+// white list, then it writes the generation under the key "gen", so the generation
+// is always written last. Entries stamped with a newer generation than the saved
+// one were written by an interrupted save, they are ignored on restore and their
+// keys are erased, as the next save reuses their generation and would confirm
+// them (if erasing fails, the slot is marked dirty, so the next save erases it
+// before writing the generation). Saving is done
+// only when the white list has changed (registration, deletion), so ordinary timer
+// wakeups never write to flash. Restoring is done in one pass of the NVS iterator
+// over the namespace, only when RTC memory has been lost.
+
+#define WL_STORAGE_NAMESPACE    "white_list"    // NVS namespace of the white list
+#define WL_STORAGE_GEN_KEY      "gen"           // key of the saved generation
+#define WL_STORAGE_KEY_SIZE     8               // size of entry key "e<slot>"
+
+// struct that describes one stored entry
+typedef struct {
+    uint32_t generation;    // generation the entry was saved in
+    device_data_t entry;    // white list entry
+} wl_record_t;
+
+
+esp_err_t wl_storage_save();
+esp_err_t wl_storage_restore();
+uint32_t wl_storage_get_generation();
+
+
+const char* g_tag_wls = "WLS";  // tag used in ESP_CHECK
+
+// generation of the last save, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR uint32_t wl_saved_generation = 0;
+
+
+// writes changed white list slots to NVS
+esp_err_t wl_storage_save()
+{
+    bool has_dirty_slots = false;
+    for (uint8_t slot = 0; slot < WHITE_LIST_SIZE && !has_dirty_slots; slot++)
+        has_dirty_slots = white_list_slot_is_dirty(slot);
+
+    if (!has_dirty_slots)   // nothing to write
+        return ESP_OK;
+
+    nvs_handle_t handle;
+    if (nvs_open(WL_STORAGE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+        return ESP_FAIL;
+
+    uint32_t generation = wl_saved_generation + 1;
+    esp_err_t err = ESP_OK;
+    for (uint8_t slot = 0; slot < WHITE_LIST_SIZE && err == ESP_OK; slot++)
+    {
+        if (!white_list_slot_is_dirty(slot))
+            continue;
+
+        char key[WL_STORAGE_KEY_SIZE];
+        snprintf(key, sizeof(key), "e%u", slot);
+        if (white_list[slot].addr_is_empty)
+        {
+            err = nvs_erase_key(handle, key);
+            if (err == ESP_ERR_NVS_NOT_FOUND)   // slot has never been saved
+                err = ESP_OK;
+        }
+        else
+        {
+            wl_record_t record = {.generation = generation, .entry = white_list[slot]};
+            err = nvs_set_blob(handle, key, &record, sizeof(record));
+        }
+    }
+
+    // the generation is written last, it confirms the entries written before
+    if (err == ESP_OK)
+        err = nvs_set_u32(handle, WL_STORAGE_GEN_KEY, generation);
+    if (err == ESP_OK)
+        err = nvs_commit(handle);
+    nvs_close(handle);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(g_tag_wls, "White list save failed! Error: %s", esp_err_to_name(err));
+        return ESP_FAIL;
+    }
+
+    wl_saved_generation = generation;
+    clear_white_list_dirty();
+    return ESP_OK;
+}
+
+
+// restores the white list from NVS, in one pass over the stored entries
+// the white list must be initialised and empty
+esp_err_t wl_storage_restore()
+{
+    if (!white_list_is_empty())
+        return ESP_FAIL;
+
+    nvs_handle_t handle;
+    if (nvs_open(WL_STORAGE_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+        return ESP_FAIL;    // nothing has been saved yet
+
+    uint32_t generation;
+    if (nvs_get_u32(handle, WL_STORAGE_GEN_KEY, &generation) != ESP_OK)
+    {
+        nvs_close(handle);
+        return ESP_FAIL;
+    }
+
+    uint32_t stale[(WHITE_LIST_SIZE + 31) / 32] = {};  // bitmap of slots written by an interrupted save
+    bool has_stale = false;
+    nvs_iterator_t it = NULL;
+    esp_err_t err = nvs_entry_find(NVS_DEFAULT_PART_NAME, WL_STORAGE_NAMESPACE, NVS_TYPE_BLOB, &it);
+    while (err == ESP_OK)
+    {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+
+        wl_record_t record;
+        size_t record_len = sizeof(record);
+        unsigned slot;
+        if (sscanf(info.key, "e%u", &slot) == 1 && slot < WHITE_LIST_SIZE &&
+            nvs_get_blob(handle, info.key, &record, &record_len) == ESP_OK && record_len == sizeof(record))
+        {
+            if (record.generation <= generation)
+                restore_white_list_slot(slot, &record.entry);
+            else
+            {
+                stale[slot / 32] |= 1UL << (slot % 32);
+                has_stale = true;
+            }
+        }
+
+        err = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+
+    // entries of an interrupted save are erased after the iteration, keys are
+    // not erased while the iterator walks over them
+    err = ESP_OK;
+    for (uint8_t slot = 0; slot < WHITE_LIST_SIZE && has_stale; slot++)
+    {
+        if (!(stale[slot / 32] & (1UL << (slot % 32))))
+            continue;
+
+        char key[WL_STORAGE_KEY_SIZE];
+        snprintf(key, sizeof(key), "e%u", slot);
+        esp_err_t erase_err = nvs_erase_key(handle, key);
+        if (erase_err != ESP_OK && erase_err != ESP_ERR_NVS_NOT_FOUND)
+            err = erase_err;
+    }
+    if (has_stale && err == ESP_OK)
+        err = nvs_commit(handle);
+    nvs_close(handle);
+
+    wl_saved_generation = generation;
+    clear_white_list_dirty();
+
+    // stale slots are empty, if the cleanup failed they are marked dirty,
+    // so the next save erases their keys
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(g_tag_wls, "White list cleanup failed! Error: %s", esp_err_to_name(err));
+        for (uint8_t slot = 0; slot < WHITE_LIST_SIZE; slot++)
+            if (stale[slot / 32] & (1UL << (slot % 32)))
+                mark_white_list_slot_dirty(slot);
+    }
+
+    ESP_LOGI(g_tag_wls, "White list restored: %u entries, generation %lu.", white_list_len,
+            (unsigned long)generation);
+    return ESP_OK;
+}
+
+
+// gets generation of the last save
+uint32_t wl_storage_get_generation()
+{
+    return wl_saved_generation;
+}
+
+
+#endif /* MAIN_WHITE_LIST_STORAGE_H_ */
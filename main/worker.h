@@ -0,0 +1,248 @@
+/*
+ * worker.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_WORKER_H_
+#define MAIN_WORKER_H_
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "host/ble_hs.h"
+#include "esp_check_err.h"
+#include "task_priorities_rtos.h"
+#include "ext_scan.h"
+#include "trace.h"
+#include "sdkconfig.h"
+
+// Description:
+// The worker is the task, in which the application logic runs: handling of GAP
+// events (adverts, connections, end of scan), button presses and everything that
+// follows from them (analysis, white list changes, LED, going to sleep). The
+// NimBLE host task and the esp_timer task only post fixed-size messages into the
+// queue of the worker and return, so a long processing can't delay handling of
+// HCI events, and the application state (e.g. device mode) is changed in one task
+// only. A message is one of:
+//   GAP event  - copy of the event and the handler, the advert data of a discovery
+//                event is copied too and the event points to the copy
+//   data       - copy of received notification and the handler
+//   call       - function to call (button press, start of scan)
+// Adverts are posted without waiting, if the queue is full the advert is dropped
+// and counted (a sensor repeats its adverts), other messages wait for the worker
+// up to WORKER_POST_TIMEOUT_MS. Incomplete extended adverts are dropped before
+// posting, and so are adverts that are not candidates by their content, the host
+// callback checks them first (see adv_prefilter.h). GATT server access and GATT client procedure callbacks still run in
+// the host task, they must answer at once and only read state or start the next
+// procedure.
+
+#define WORKER_QUEUE_LEN        CONFIG_AM_WORKER_QUEUE_LEN  // max number of messages waiting in the queue
+#define WORKER_STACK_SIZE       4096    // stack of the worker task
+#define WORKER_DATA_SIZE        244     // max copied data, extended advert (229) or notification (ATT MTU 247 - 3)
+#define WORKER_POST_TIMEOUT_MS  100     // max wait for free space of messages that are not dropped
+
+_Static_assert(EXT_ADV_MAX_DATA_LEN <= WORKER_DATA_SIZE, "extended advert must fit into worker message");
+
+// enum of message types
+typedef enum {
+    WORKER_MSG_GAP_EVENT = 0,   // gap event for the gap event handler
+    WORKER_MSG_DATA,            // received data for the data handler
+    WORKER_MSG_CALL             // function call
+} worker_msg_type_t;
+
+// handler of received data
+typedef void worker_data_fn(const uint8_t* data, uint16_t data_len);
+// function called by the worker
+typedef void worker_call_fn(void);
+
+// struct that describes message of the worker
+typedef struct {
+    uint8_t type;                   // message type (worker_msg_type_t)
+    uint16_t data_len;              // length of copied data
+    union {
+        ble_gap_event_fn* gap_event_cb;
+        worker_data_fn* data_cb;
+        worker_call_fn* call_cb;
+    };                              // handler of the message
+    void* arg;                      // argument of gap event handler
+    struct ble_gap_event event;     // copy of gap event
+    uint8_t data[WORKER_DATA_SIZE]; // copied advert data or notification
+} worker_msg_t;
+
+
+esp_err_t worker_init();
+int worker_post_gap_event(const struct ble_gap_event* event, ble_gap_event_fn* gap_event_cb, void* arg);
+esp_err_t worker_post_data(struct os_mbuf* om, worker_data_fn* data_cb);
+esp_err_t worker_post_call(worker_call_fn* call_cb);
+esp_err_t worker_post(const worker_msg_t* msg, bool may_drop);
+static void worker_task(void* arg);
+
+
+const char* g_tag_worker = "WORKER";    // tag used in ESP_CHECK
+QueueHandle_t worker_queue = NULL;       // queue of messages
+TaskHandle_t worker_task_hndl = NULL;    // worker task
+uint32_t worker_dropped_cnt = 0;         // number of dropped adverts, since boot
+
+
+// creates the queue and the worker task
+esp_err_t worker_init()
+{
+    if (worker_queue != NULL)   // check if already initialised
+        return ESP_FAIL;
+
+    worker_queue = xQueueCreate(WORKER_QUEUE_LEN, sizeof(worker_msg_t));
+    if (worker_queue == NULL)
+        return ESP_FAIL;
+
+    BaseType_t res = xTaskCreate(worker_task, "worker", WORKER_STACK_SIZE, NULL,
+                                 tskIDLE_PRIORITY + MEDIUM_TASK_PRIORITY, &worker_task_hndl);
+    if (res != pdPASS)
+        return ESP_FAIL;
+
+    return ESP_OK;
+}
+
+
+// posts copy of gap event, used as the body of nimble gap event callbacks
+// returns 0 (nimble callbacks are answered at once)
+int worker_post_gap_event(const struct ble_gap_event* event, ble_gap_event_fn* gap_event_cb, void* arg)
+{
+    worker_msg_t msg;
+    msg.type = WORKER_MSG_GAP_EVENT;
+    msg.gap_event_cb = gap_event_cb;
+    msg.arg = arg;
+    msg.event = *event;
+    msg.data_len = 0;
+
+    // advert data is valid only during the callback
+    bool is_advert = false;
+    switch (event->type)
+    {
+        case BLE_GAP_EVENT_DISC:
+            msg.data_len = event->disc.length_data > WORKER_DATA_SIZE ? WORKER_DATA_SIZE : event->disc.length_data;
+            memcpy(msg.data, event->disc.data, msg.data_len);
+            msg.event.disc.length_data = msg.data_len;
+            is_advert = true;
+            break;
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+        case BLE_GAP_EVENT_EXT_DISC:
+            if (event->ext_disc.data_status != BLE_GAP_EXT_ADV_DATA_STATUS_COMPLETE)
+                return 0;
+            msg.data_len = event->ext_disc.length_data > WORKER_DATA_SIZE ? WORKER_DATA_SIZE : event->ext_disc.length_data;
+            memcpy(msg.data, event->ext_disc.data, msg.data_len);
+            msg.event.ext_disc.length_data = msg.data_len;
+            is_advert = true;
+            break;
+#endif
+        case BLE_GAP_EVENT_NOTIFY_RX:
+            msg.event.notify_rx.om = NULL;  // freed after the callback, notifications are posted by worker_post_data
+            break;
+        default:
+            break;
+    }
+
+    worker_post(&msg, is_advert);
+    return 0;
+}
+
+
+// posts copy of received notification
+esp_err_t worker_post_data(struct os_mbuf* om, worker_data_fn* data_cb)
+{
+    worker_msg_t msg;
+    msg.type = WORKER_MSG_DATA;
+    msg.data_cb = data_cb;
+    if (ble_hs_mbuf_to_flat(om, msg.data, sizeof(msg.data), &msg.data_len) != 0)
+    {
+        TRACE_E(TRACE_WORKER_FAIL, WORKER_MSG_DATA, OS_MBUF_PKTLEN(om));
+        return ESP_FAIL;
+    }
+
+    return worker_post(&msg, false);
+}
+
+
+// posts function call (e.g. from timer callback)
+esp_err_t worker_post_call(worker_call_fn* call_cb)
+{
+    worker_msg_t msg;
+    msg.type = WORKER_MSG_CALL;
+    msg.call_cb = call_cb;
+    msg.data_len = 0;
+
+    return worker_post(&msg, false);
+}
+
+
+// posts message into the queue, message that may be dropped is not waited for
+esp_err_t worker_post(const worker_msg_t* msg, bool may_drop)
+{
+    if (worker_queue == NULL)
+        return ESP_FAIL;
+
+    TickType_t timeout = may_drop ? 0 : pdMS_TO_TICKS(WORKER_POST_TIMEOUT_MS);
+    if (xQueueSend(worker_queue, msg, timeout) != pdTRUE)
+    {
+        if (may_drop)
+            worker_dropped_cnt++;
+        else
+            TRACE_E(TRACE_WORKER_FAIL, msg->type, msg->type == WORKER_MSG_GAP_EVENT ? msg->event.type : 0);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+
+// worker task, handles messages one by one
+static void worker_task(void* arg)
+{
+    worker_msg_t msg;
+    uint32_t reported_dropped_cnt = 0;
+    while (true)
+    {
+        if (xQueueReceive(worker_queue, &msg, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        // dropped adverts are traced once the queue has space again
+        if (worker_dropped_cnt != reported_dropped_cnt)
+        {
+            TRACE_E(TRACE_WORKER_DROP, worker_dropped_cnt - reported_dropped_cnt, worker_dropped_cnt);
+            reported_dropped_cnt = worker_dropped_cnt;
+        }
+
+        switch (msg.type)
+        {
+            case WORKER_MSG_GAP_EVENT:
+            {
+                // copied advert data is pointed to by the event
+                if (msg.event.type == BLE_GAP_EVENT_DISC)
+                    msg.event.disc.data = msg.data;
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+                else if (msg.event.type == BLE_GAP_EVENT_EXT_DISC)
+                    msg.event.ext_disc.data = msg.data;
+#endif
+                msg.gap_event_cb(&msg.event, msg.arg);
+                break;
+            }
+            case WORKER_MSG_DATA:
+                msg.data_cb(msg.data, msg.data_len);
+                break;
+            case WORKER_MSG_CALL:
+                msg.call_cb();
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+
+#endif /* MAIN_WORKER_H_ */